@@ -6,9 +6,26 @@
 #include "vm.h"
 #include "object.h"
 #include "upvalue.h"
+#include "thread.h"
 
 #define ERROR_BUFFER_SIZE 1024*4 /* 4kb for error buffer, already very large */
 
+/* Context of a rendering. It is created by the top level rendering and
+ * shared by the runtimes of its includes and extends. The error of the
+ * rendering goes to its own buffer while it runs and is copied to whoever
+ * starts it once it fails : the engine for a top level rendering , or the
+ * context of the calling rendering for one started by a host function ,
+ * so the function can read it with ajj_last_error */
+struct ajj_context {
+  struct ajj* a;
+  void* udata;
+  struct vm_budget budget;
+  char err[ERROR_BUFFER_SIZE];
+};
+
+/* Error buffer of the running rendering , or the engine's own buffer */
+#define ajj_err_buf(A) ((A)->rt ? (A)->rt->ctx->err : (A)->err)
+
 #define UPVALUE_SLAB_SIZE 32
 #define UPVALUE_SLAB_LIMIT 64
 
@@ -23,6 +40,135 @@
 
 struct runtime;
 
+/* Template entry inside of the template table. Each template owns a
+ * gc scope which holds the template object itself plus all the constant
+ * values created during parsing. Deleting a template is just destroying
+ * this gc scope */
+struct jj_file {
+  struct jj_file* prev; /* LRU list */
+  struct jj_file* next;
+  struct ajj_object* tmpl;
+  struct gc_scope* scp;
+  time_t ts;
+  size_t sz;  /* approximate memory occupied by this template */
+  size_t src_len; /* length of the source , only for source from vfs */
+  size_t out_avg; /* moving average of the output size , used to reserve
+                   * memory output up front */
+  size_t data_len; /* length of the source for ajj_render_data , it is
+                    * (size_t)-1 for other templates */
+  unsigned int key;  /* hash of the template name , or hash of the source
+                      * for ajj_render_data */
+  int used;   /* used since last time template_trim visits it */
+  unsigned int fixed:1; /* registered in memory template which cannot be
+                         * loaded again , so never evicted */
+  unsigned int vfs_src:1; /* source is returned by vfs_load */
+};
+
+#define jj_file_of(T) ((struct jj_file*)((T)->val.obj.data))
+
+/* Ownership of the template source passed to ajj_new_template */
+enum {
+  TMPL_SRC_COPY, /* source is copied */
+  TMPL_SRC_OWN,  /* source is taken , released by free */
+  TMPL_SRC_VFS   /* source is taken , released by the vfs */
+};
+
+/* Read only snapshot of the template table used for lookup without
+ * holding the lock , defined in ajj.c */
+struct tmpl_index;
+
+/* Reader of a template store. Each engine that renders from the store
+ * owns one , it is padded to a cache line so lookups from different
+ * threads never write to the same line. While an engine holds any
+ * template ( see ajj_pin_template ) , its reader announces the epoch of
+ * the store it entered with */
+struct store_reader {
+  size_t epoch; /* epoch announced , 0 if no template is held */
+  size_t depth; /* number of templates held , only touched by the owner */
+  size_t hit;   /* lookups of the owner , only written by the owner */
+  size_t miss;
+  char pad[ AJJ_CACHE_LINE_SIZE - 4*sizeof(size_t) ];
+};
+
+/* Memory removed from the store , released once every reader has left
+ * the epoch it is retired in. One of the pointers is set */
+struct store_retire {
+  struct jj_file* f;
+  struct tmpl_index* idx;
+  size_t epoch;
+};
+
+/* Template cache. All the templates are linked into a LRU list , the
+ * next of the sentinel is the least recently used one. If a memory
+ * limit is set, the least recently used templates that are not pinned
+ * by any runtime gets evicted. A lookup only marks the template as
+ * used and the list is reordered lazily when trimming ( CLOCK ).
+ *
+ * Writers modify the template table with the lock held and publish a
+ * new snapshot of it when releasing the lock , which also moves the
+ * epoch forward. Readers look up the snapshot without any lock and
+ * only write to their own reader. The old snapshot and the templates
+ * removed from the table are retired with the epoch and released once
+ * no reader announces that epoch or an older one , so neither side
+ * waits for the other */
+struct tmpl_cache {
+  struct jj_file lru; /* sentinel */
+  size_t mem;   /* memory used by all the cached templates */
+  size_t limit; /* memory budget , 0 means unbounded */
+  size_t hit;   /* lookups of the readers already removed */
+  size_t miss;
+  size_t evict;
+  size_t data; /* templates of ajj_render_data , they are not inside of
+                * the template table but only found by their source */
+  mutex_t lock; /* serializes writers */
+
+  struct tmpl_index* index; /* current snapshot */
+  int dirty;     /* table is changed since last snapshot */
+  size_t epoch;  /* starts from 1 , 0 means a reader holds nothing */
+  struct store_reader** reader;
+  size_t reader_len;
+  size_t reader_cap;
+  struct jj_file** drop; /* removed templates waiting for the snapshot */
+  size_t drop_len;
+  size_t drop_cap;
+  struct store_retire* retire; /* waiting for the readers */
+  size_t retire_len;
+  size_t retire_cap;
+  int retiring; /* retire_len != 0 , read without the lock */
+};
+
+/* Immutable part of the environment table of an engine. A layer is
+ * either a full copy of the table or a delta holding the names changed
+ * since the layer below it , the newer names win. Layers of an engine
+ * are kept alive in publishing order ( a layer holds the newer one ) ,
+ * so the upvalues retired after a layer is published are freed only
+ * when no snapshot can reach them */
+struct env_layer {
+  struct map d;
+  struct ajj* a; /* engine that owns the upvalues */
+  struct env_layer* next;
+  struct env_layer* below; /* NULL for a full copy , pinned by the
+                            * snapshots that use this layer */
+  size_t depth; /* number of layers down to the full copy */
+  size_t copied; /* entries copied into the deltas since the full copy */
+  struct upvalue** retire; /* upvalues removed from the environment after
+                            * this layer is published */
+  size_t retire_len;
+  size_t retire_cap;
+  int ref;
+};
+
+/* Snapshot of the environment seen by renderings. The tables are views
+ * of the layers , newest first , and the last one is chained to the
+ * snapshot of the parent engine , or to the builtins for an engine
+ * created by ajj_create. Each layer of the stack is pinned */
+struct env_version {
+  struct upvalue_table* tbl;
+  struct env_layer* layer;
+  struct env_version* base; /* snapshot of the parent engine */
+  int ref;
+};
+
 struct ajj {
   struct slab obj_slab; /* object slab */
   struct slab upval_slab; /* global var slab */
@@ -38,13 +184,42 @@ struct ajj {
   struct map tmpl_tbl; /* template table. Provide key value map to
                         * find a specific template. If we have already
                         * loaded a template, then we can just reference
-                        * it here without loading it multiple times */
+                        * it here without loading it multiple times.
+                        * The value is a pointer of struct jj_file */
+  struct tmpl_cache cache; /* template cache bookkeeping */
+
+  /* Template store. All the compiled templates live in a store which is
+   * a private ajj engine that only uses the fields above. An engine
+   * created by ajj_create owns its store and engines forked from it
+   * share the same store. For a store it points to itself */
+  struct ajj* store;
+  struct ajj* parent; /* engine this one is forked from , or NULL */
+  struct store_reader* reader; /* reader of the store , NULL for a store */
+  struct ajj_pool* inc_pool; /* pool for rendering includes , or NULL */
+  struct ajj_render* render; /* running resumable rendering , or NULL */
+  size_t step_limit; /* instruction budget of a rendering , 0 unlimited */
+  size_t time_limit; /* time budget of a rendering in ms , 0 unlimited */
+  int autoescape; /* AJJ_ESCAPE_XXX for the templates compiled */
+
+  /* Environment snapshots. Every change of the environment publishes a
+   * new immutable snapshot and a rendering pins the snapshot current at
+   * its start , so the environment can be changed while renderings are
+   * in flight. Protected by env_lock */
+  struct env_version* env_ver;   /* current snapshot */
+  struct env_layer* env_layer;   /* copy of env the snapshot is built on */
+  struct upvalue** env_dead;     /* retired upvalues no longer referenced
+                                  * by any snapshot , freed by the owner */
+  size_t env_dead_len;
+  size_t env_dead_cap;
+  mutex_t env_lock;
 
   /* runtime field that points to places that VM
    * currently working at. It will be set when we
    * start executing the code */
   struct runtime* rt;
-  struct upvalue_table env;       /* environment value table */
+  struct upvalue_table env;       /* environment value table , only
+                                   * touched by the engine's owner.
+                                   * Renderings read the snapshot */
   struct upvalue_table builtins;  /* builtin table */
 
   /* INLINE those common builtin types and this makes our builtin type
@@ -61,28 +236,62 @@ struct ajj {
   void* udata;
 };
 
-struct jj_file {
-  struct ajj_object* tmpl;
-  time_t ts;
+/* Chunks waiting for a gathering write. The scratch buffer never grows ,
+ * so the chunks copied into it stay where they are until the sync */
+struct io_gather {
+  struct ajj_iovec iov[AJJ_IO_GATHER_IOV_SIZE];
+  size_t len;
+  char* scratch;
+  size_t used;
+  size_t cap;
 };
 
 enum {
   AJJ_IO_FILE,
-  AJJ_IO_MEM
+  AJJ_IO_MEM,
+  AJJ_IO_SINK
 };
 
 struct ajj_io {
   union {
     FILE* f; /* make c89 initilization happy */
     struct strbuf m;
+    struct {
+      struct ajj_io_sink s;
+      void* udata;
+      void (*release)( void* ); /* frees udata of builtin sinks */
+    } sink;
   } out;
   int tp;
+  int err; /* sticky , set once a write fails */
+  struct io_gather* gather; /* NULL if gathering is off */
+  struct ajj* render; /* engine whose resumable rendering writes to the IO ,
+                       * NULL if none. Set by that rendering only */
 };
 
+/* Write a chunk that stays alive until the next ajj_io_sync , it is
+ * referenced instead of copied if the IO is gathering */
+int ajj_io_write_ref( struct ajj_io* , const void* , size_t );
+
+/* Hand the gathered chunks to the sink , must be called before the
+ * referenced memory goes away */
+int ajj_io_sync( struct ajj_io* );
+
+/* Make sure a memory IO can take the given size of output without
+ * growing , other IO is not affected */
+void ajj_io_reserve( struct ajj_io* , size_t );
+
+/* Initialize a sink IO in place , an IO initialized this way has no
+ * gathering and needs no ajj_io_destroy */
+void ajj_io_init_sink( struct ajj_io* , const struct ajj_io_sink* ,
+    void* );
+
 /* get the current gc scope */
 struct gc_scope*
 ajj_cur_gc_scope( struct ajj* a );
 
+/* Find a template inside of the store , no lock is held , so it can only
+ * be used when no other engines share the store */
 struct jj_file*
 ajj_find_template( struct ajj* a , const char* name );
 
@@ -90,15 +299,46 @@ struct ajj_object*
 ajj_new_template( struct ajj* a ,const char* name ,
     const char* src , int own , time_t ts );
 
-/* THIS FUNCTION IS NOT SAFE!
- * This function is used when we try to recover from the parsing
- * error. It is only used in parser, when the parsing failed, the
- * parser will remove this template and destroy it */
+/* Remove a template from the template table. If the template may still
+ * be used by a rendering , its memory is released once it is done */
 int ajj_delete_template( struct ajj* a, const char* name );
 
 /* Wipe out ALL the template is safe operation */
 void ajj_clear_template( struct ajj* );
 
+/* Pin/Unpin a template. A pinned template is never destroyed even if it
+ * is removed or evicted , runtime pins its template during the whole
+ * rendering. Pinning only touches the reader of the engine , which keeps
+ * everything retired after it alive , so the engine that unpins must be
+ * the one that pins */
+void ajj_pin_template( struct ajj* a , struct ajj_object* tmpl );
+void ajj_unpin_template( struct ajj* a , struct ajj_object* tmpl );
+
+/* Load the source of a template with vfs_load_async , the current
+ * resumable rendering is parked until the load is finished */
+const char* ajj_load_async( struct ajj* a , const char* filename ,
+    size_t* len , time_t* ts );
+
+/* Pin the current environment snapshot of the engine , the returned
+ * snapshot's table is the environment of a rendering. Safe to be called
+ * from any thread */
+struct env_version* ajj_env_acquire( struct ajj* a );
+void ajj_env_release( struct env_version* v );
+#define ajj_env_table(V) ((V)->tbl)
+
+/* Submit an include deferred by a rendering to the pool. The job pins
+ * the snapshot and copies the budget ( NULL for unlimited ) , see
+ * vm_run_include */
+struct ajj_job*
+pool_submit_include( struct ajj_pool* , struct ajj_io* , const char* ,
+    void* , struct env_version* , const struct vm_budget* );
+
+/* Instructions run by a finished include job */
+size_t pool_include_step( struct ajj_job* );
+
+/* Release memory returned by vfs_load */
+void ajj_vfs_free( struct ajj* a , const char* src , size_t len );
+
 /* Register value/class/function into different uvpalue table */
 void
 ajj_add_value( struct ajj* a , struct upvalue_table* ut,
@@ -126,7 +366,8 @@ ajj_add_test( struct ajj* a, struct upvalue_table* ut,
     ajj_function entry,
     void* );
 
-/* HIGH level API to help to manage the template */
+/* HIGH level API to help to manage the template. The returned template
+ * is pinned , caller needs to unpin it after using it */
 struct ajj_object*
 ajj_parse_template( struct ajj* a, const char* filename );
 
@@ -5,6 +5,7 @@
 #include "builtin.h"
 #include "vm.h"
 #include "opt.h"
+#include "thread.h"
 
 #include <stdlib.h>
 #include <assert.h>
@@ -19,9 +20,8 @@ struct ajj_value AJJ_TRUE = { {1} , AJJ_VALUE_BOOLEAN };
 struct ajj_value AJJ_FALSE= { {0} , AJJ_VALUE_BOOLEAN };
 struct ajj_value AJJ_NONE = { {0} , AJJ_VALUE_NONE };
 
-struct ajj* ajj_create( struct ajj_vfs* vfs , void* vfs_udata ) {
-
-  struct ajj* r = malloc(sizeof(*r));
+static
+void engine_init( struct ajj* r , struct ajj_vfs* vfs , void* vfs_udata ) {
   r->err[0] = 0;
 
   slab_init(&(r->upval_slab),UPVALUE_SLAB_SIZE,
@@ -36,12 +36,14 @@ struct ajj* ajj_create( struct ajj_vfs* vfs , void* vfs_udata ) {
   slab_init(&(r->gc_slab),GC_SLAB_SIZE,
       sizeof(struct gc_scope),GC_SLAB_LIMIT);
 
-  map_create(&(r->tmpl_tbl),sizeof(struct jj_file),32);
   gc_root_init(&(r->gc_root),1);
   r->rt = NULL;
-  /* initiliaze the upvalue table */
-  upvalue_table_init(&(r->builtins),NULL);
-  upvalue_table_init(&(r->env),&(r->builtins));
+  r->reader = NULL;
+  r->inc_pool = NULL;
+  r->render = NULL;
+  r->step_limit = 0;
+  r->time_limit = 0;
+  r->autoescape = AJJ_ESCAPE_NONE;
   r->list = NULL;
   r->dict = NULL;
   r->loop = NULL;
@@ -50,24 +52,77 @@ struct ajj* ajj_create( struct ajj_vfs* vfs , void* vfs_udata ) {
   assert(vfs);
   r->vfs = *vfs;
   r->vfs_udata = vfs_udata;
+}
+
+static
+void env_init( struct ajj* a );
+static
+void env_destroy( struct ajj* a );
+
+static
+struct ajj* compile_ctx_create( struct ajj* a );
+static
+void compile_ctx_free( struct ajj* ctx );
+static
+void store_reader_add( struct ajj* a );
+static
+void store_reader_remove( struct ajj* a );
+
+struct ajj* ajj_create( struct ajj_vfs* vfs , void* vfs_udata ) {
+
+  struct ajj* r = malloc(sizeof(*r));
+  engine_init(r,vfs,vfs_udata);
+  /* initiliaze the upvalue table */
+  upvalue_table_init(&(r->builtins),NULL);
+  upvalue_table_init(&(r->env),&(r->builtins));
 
   /* NOTE: */
   /* lastly load the builtins into the ajj things */
   ajj_builtin_load(r);
+
+  /* template store is created after builtins since it needs
+   * the builtin types */
+  r->store = compile_ctx_create(r);
+  r->parent = NULL;
+  store_reader_add(r);
+  env_init(r);
+  return r;
+}
+
+struct ajj* ajj_fork( struct ajj* a ) {
+  struct ajj* r = malloc(sizeof(*r));
+  engine_init(r,&(a->vfs),a->vfs_udata);
+  /* builtins and environment are resolved through the parent */
+  upvalue_table_init(&(r->builtins),NULL);
+  upvalue_table_init(&(r->env),NULL);
+  r->list = a->list;
+  r->dict = a->dict;
+  r->loop = a->loop;
+  r->udata = a->udata;
+  r->store = a->store;
+  r->parent = a;
+  store_reader_add(r);
+  r->step_limit = a->step_limit;
+  r->time_limit = a->time_limit;
+  r->autoescape = a->autoescape;
+  env_init(r);
   return r;
 }
 
 void ajj_destroy( struct ajj* r ) {
   /* clear the env and builtin table */
+  env_destroy(r);
   upvalue_table_clear(r,&(r->env));
   upvalue_table_clear(r,&(r->builtins));
   r->list = NULL;
   r->dict = NULL;
+  /* destroy all the templates, each one has its own gc scope */
+  store_reader_remove(r);
+  if(!r->parent) compile_ctx_free(r->store);
   /* just exit the scope without deleting this scope
    * since it is not a pointer from the gc_slab */
   gc_scope_exit(r,&(r->gc_root));
   /* Now destroy rest of the data structure */
-  map_destroy(&(r->tmpl_tbl));
   slab_destroy(&(r->upval_slab));
   slab_destroy(&(r->obj_slab));
   slab_destroy(&(r->ft_slab));
@@ -86,34 +141,713 @@ ajj_cur_gc_scope( struct ajj* a ) {
 /* =============================
  * Template
  * ===========================*/
+static
+size_t program_size( const struct program* prg ) {
+  size_t i;
+  size_t sz = prg->len * sizeof(int) * 2 + /* codes + spos */
+    prg->str_cap * (sizeof(struct string) + 1) +
+    prg->num_cap * sizeof(double);
+  for( i = 0 ; i < prg->str_len ; ++i ) {
+    sz += prg->str_tbl[i].len + 1;
+  }
+  return sz;
+}
+
+/* Approximate memory a compiled template occupies. It doesn't need to
+ * be accurate but only serves as the metric for the cache budget */
+static
+size_t template_size( const struct ajj_object* tmpl ) {
+  const struct func_table* ft = tmpl->val.obj.fn_tb;
+  size_t sz = sizeof(struct jj_file) + sizeof(struct gc_scope) +
+    sizeof(struct ajj_object) + sizeof(struct func_table) +
+    strlen(tmpl->val.obj.src) + 1;
+  size_t i;
+  if( ft->func_tb != ft->func_buf )
+    sz += ft->func_cap * sizeof(struct function);
+  for( i = 0 ; i < ft->func_len ; ++i ) {
+    const struct function* f = ft->func_tb + i;
+    if(IS_JINJA(f)) sz += program_size(&(f->f.jj_fn));
+  }
+  return sz;
+}
+
+/* Snapshot of the template table , an open addressing hash table with
+ * linear probing. It is never modified once it is published */
+struct tmpl_index {
+  size_t mask;
+  struct jj_file* slot[1];
+};
+
+#define template_name(F) (&((F)->tmpl->val.obj.fn_tb->name))
+
+/* Template compiled by ajj_render_data , it lives in the cache but is
+ * only found by its source and never by its name */
+#define template_is_data(F) ((F)->data_len != (size_t)-1)
+
+/* Mark a template as recently used, no lock is needed. The flag is only
+ * written when it is clear , so lookups of a hot template don't write to
+ * its cache line */
+#define template_mark(F) \
+  do { \
+    if(!atomic_load_relaxed(&((F)->used))) \
+      atomic_store_relaxed(&((F)->used),1); \
+  } while(0)
+
+/* Count a lookup in the engine's own reader */
+#define reader_count(A,C) \
+  atomic_store_relaxed(&((A)->reader->C),(A)->reader->C+1)
+
+static
+struct tmpl_index* index_build( struct ajj* s ) {
+  size_t cap = 8;
+  struct tmpl_index* idx;
+  struct jj_file* f;
+  while( cap < (map_size(&(s->tmpl_tbl)) + s->cache.data) * 2 ) cap *= 2;
+  idx = calloc(1,sizeof(*idx) + sizeof(struct jj_file*)*(cap-1));
+  idx->mask = cap - 1;
+  for( f = s->cache.lru.next ; f != &(s->cache.lru) ; f = f->next ) {
+    size_t i = f->key & idx->mask;
+    while( idx->slot[i] ) i = (i+1) & idx->mask;
+    idx->slot[i] = f;
+  }
+  return idx;
+}
+
+static
+struct jj_file* index_find( const struct tmpl_index* idx ,
+    const char* name ) {
+  size_t len = strlen(name);
+  unsigned int h = data_hash(name,len);
+  size_t i = h & idx->mask;
+  struct jj_file* f;
+  while( (f = idx->slot[i]) != NULL ) {
+    if( f->key == h && !template_is_data(f) &&
+        string_cmpcl(template_name(f),name,len) == 0 )
+      return f;
+    i = (i+1) & idx->mask;
+  }
+  return NULL;
+}
+
+static
+struct jj_file* index_find_data( const struct tmpl_index* idx ,
+    const char* src , size_t len , unsigned int h ) {
+  size_t i = h & idx->mask;
+  struct jj_file* f;
+  while( (f = idx->slot[i]) != NULL ) {
+    if( f->key == h && f->data_len == len &&
+        memcmp(f->tmpl->val.obj.src,src,len) == 0 )
+      return f;
+    i = (i+1) & idx->mask;
+  }
+  return NULL;
+}
+
+#define store_lock(S) mutex_lock(&((S)->cache.lock))
+
+/* All the functions below that take the store as argument expect
+ * the caller to hold the store lock */
+static
+void template_destroy( struct ajj* s , struct jj_file* f ) {
+  if(f->vfs_src) {
+    ajj_vfs_free(s,f->tmpl->val.obj.src,f->src_len);
+    f->tmpl->val.obj.src = NULL;
+  }
+  /* the template object and all its constant values are owned
+   * by the template's gc scope */
+  gc_scope_destroy(s,f->scp);
+  free(f);
+}
+
+static
+void store_retire( struct ajj* s , struct jj_file* f ,
+    struct tmpl_index* idx , size_t epoch ) {
+  struct store_retire* r;
+  if( s->cache.retire_len == s->cache.retire_cap ) {
+    s->cache.retire = mem_grow(s->cache.retire,sizeof(struct store_retire),
+        0,&(s->cache.retire_cap));
+  }
+  r = s->cache.retire + s->cache.retire_len++;
+  r->f = f;
+  r->idx = idx;
+  r->epoch = epoch;
+}
+
+/* Release the retired memory that no reader can reach. A reader that
+ * announces nothing can only find the current snapshot */
+static
+void store_reclaim( struct ajj* s ) {
+  size_t min = (size_t)-1;
+  size_t i , j;
+  for( i = 0 ; i < s->cache.reader_len ; ++i ) {
+    size_t e = atomic_load(&(s->cache.reader[i]->epoch));
+    if( e && e < min ) min = e;
+  }
+  for( i = 0 , j = 0 ; i < s->cache.retire_len ; ++i ) {
+    struct store_retire* r = s->cache.retire + i;
+    if( r->epoch < min ) {
+      if(r->f) template_destroy(s,r->f);
+      free(r->idx);
+    } else {
+      s->cache.retire[j++] = *r;
+    }
+  }
+  s->cache.retire_len = j;
+  atomic_store_relaxed(&(s->cache.retiring),j != 0);
+}
+
+/* Publish the changes of the template table. The old snapshot and the
+ * removed templates are retired with the epoch they are reachable in ,
+ * readers entering afterwards announce a newer one */
+static
+void store_commit( struct ajj* s ) {
+  if(s->cache.dirty) {
+    struct tmpl_index* old;
+    size_t e;
+    size_t i;
+    s->cache.dirty = 0;
+    old = atomic_swap(&(s->cache.index),index_build(s));
+    e = atomic_add(&(s->cache.epoch),1);
+    if(old) store_retire(s,NULL,old,e);
+    for( i = 0 ; i < s->cache.drop_len ; ++i )
+      store_retire(s,s->cache.drop[i],NULL,e);
+    s->cache.drop_len = 0;
+    store_reclaim(s);
+  }
+}
+
+static
+void store_unlock( struct ajj* s ) {
+  store_commit(s);
+  mutex_unlock(&(s->cache.lock));
+}
+
+/* Remove the template from the template table and the LRU list. The
+ * memory is released once nobody uses it */
+static
+void template_unlink( struct ajj* s , struct jj_file* f ) {
+  if(template_is_data(f))
+    --s->cache.data;
+  else
+    CHECK(!map_remove_c(&(s->tmpl_tbl),template_name(f)->str,NULL));
+  LREMOVE(f);
+  LINIT(f);
+  s->cache.mem -= f->sz;
+  if( s->cache.drop_len == s->cache.drop_cap ) {
+    s->cache.drop = mem_grow(s->cache.drop,sizeof(struct jj_file*),
+        0,&(s->cache.drop_cap));
+  }
+  s->cache.drop[s->cache.drop_len++] = f;
+  s->cache.dirty = 1;
+}
+
+/* Evict least recently used templates until we are under the memory
+ * budget. Registered in memory templates are never evicted since they
+ * cannot be loaded again. A template used since last visit gets a second
+ * chance and moves to the end of the list , so at most two rounds are
+ * needed. A template still used by a rendering can be evicted as well ,
+ * it is only released once the rendering is done */
+static
+void template_trim( struct ajj* s , const struct jj_file* keep ) {
+  int round;
+  if(s->cache.limit == 0) return;
+  for( round = 0 ; round < 2 ; ++round ) {
+    struct jj_file* f = s->cache.lru.next;
+    struct jj_file* last = s->cache.lru.prev;
+    while( s->cache.mem > s->cache.limit && f != &(s->cache.lru) ) {
+      struct jj_file* n = f->next;
+      if( atomic_swap(&(f->used),0) ) {
+        LREMOVE(f);
+        LINSERT(f,&(s->cache.lru));
+      } else if( f != keep && !f->fixed ) {
+        template_unlink(s,f);
+        ++s->cache.evict;
+      }
+      if( f == last ) break;
+      f = n;
+    }
+  }
+}
+
+static
+struct jj_file*
+template_find( struct ajj* s , const char* name ) {
+  struct jj_file** ret = map_find_c(&(s->tmpl_tbl),name);
+  return ret == NULL ? NULL : *ret;
+}
+
+static
+int template_remove( struct ajj* s , const char* name ) {
+  struct jj_file* f = template_find(s,name);
+  if(!f) return -1;
+  template_unlink(s,f);
+  return 0;
+}
+
 struct jj_file*
 ajj_find_template( struct ajj* a , const char* name ) {
-  struct jj_file* ret = map_find_c(&(a->tmpl_tbl),name);
-  return ret == NULL ? NULL : ret;
+  return template_find(a->store,name);
 }
 
 struct ajj_object*
 ajj_new_template( struct ajj* a ,const char* name ,
     const char* src , int own , time_t ts ) {
-  struct jj_file f;
+  struct ajj* s = a->store;
+  struct jj_file* f = malloc(sizeof(*f));
   /* Try to delete if this template is already existed */
-  ajj_delete_template(a,name);
-
-  /* Create new oneand insert it into the map */
-  f.tmpl = ajj_object_create_jinja(a,name,src,own);
-  f.ts = ts;
-  CHECK(!map_insert_c(&(a->tmpl_tbl),name,&f));
-  return f.tmpl;
+  template_remove(s,name);
+
+  /* Each template has its own gc scope which has same life cycle tag
+   * as the root scope , so nothing will be lifted out of it */
+  f->scp = slab_malloc(&(s->gc_slab));
+  gc_root_init(f->scp,s->gc_root.scp_id);
+  f->scp->parent = &(s->gc_root);
+
+  /* Create new one and insert it into the map */
+  f->tmpl = ajj_object_create_jinja(s,f->scp,name,src,own);
+  f->tmpl->val.obj.data = f;
+  f->ts = ts;
+  f->sz = 0;
+  f->out_avg = 0;
+  f->data_len = (size_t)-1;
+  f->key = data_hash(name,strlen(name));
+  f->used = 0;
+  f->fixed = (ts == 0);
+  f->vfs_src = (own == TMPL_SRC_VFS);
+  f->src_len = f->vfs_src ? strlen(src) : 0;
+  LINSERT(f,&(s->cache.lru));
+  CHECK(!map_insert_c(&(s->tmpl_tbl),name,&f));
+  s->cache.dirty = 1;
+  return f->tmpl;
 }
 
 int ajj_delete_template( struct ajj* a, const char* name ) {
-  struct jj_file f;
-  if( map_remove_c(&(a->tmpl_tbl),name,&f))
-    return -1;
-  LREMOVE(f.tmpl); /* remove it from gc scope */
-  ajj_object_destroy_jinja(a,f.tmpl); /* destroy internal gut */
-  slab_free(&(a->obj_slab),f.tmpl); /* free object back to slab */
-  return 0;
+  struct ajj* s = a->store;
+  int ret;
+  store_lock(s);
+  ret = template_remove(s,name);
+  store_unlock(s);
+  return ret;
+}
+
+void ajj_clear_template( struct ajj* a ) {
+  struct ajj* s = a->store;
+  store_lock(s);
+  while( !LEMPTY(&(s->cache.lru)) ) {
+    template_unlink(s,s->cache.lru.next);
+  }
+  store_unlock(s);
+}
+
+/* Enter the read side of the store , the epoch is announced before
+ * anything of the store is read */
+void ajj_pin_template( struct ajj* a , struct ajj_object* tmpl ) {
+  struct store_reader* r = a->reader;
+  UNUSE_ARG(tmpl);
+  if( r->depth++ == 0 )
+    atomic_store(&(r->epoch),atomic_load(&(a->store->cache.epoch)));
+}
+
+/* Leave the read side , the memory kept alive by this reader is released
+ * unless a writer is busy , then the writer does it */
+void ajj_unpin_template( struct ajj* a , struct ajj_object* tmpl ) {
+  struct store_reader* r = a->reader;
+  UNUSE_ARG(tmpl);
+  assert(r->depth > 0);
+  if( --r->depth == 0 ) {
+    struct ajj* s = a->store;
+    atomic_store(&(r->epoch),0);
+    if( atomic_load_relaxed(&(s->cache.retiring)) &&
+        mutex_trylock(&(s->cache.lock)) == 0 ) {
+      store_reclaim(s);
+      mutex_unlock(&(s->cache.lock));
+    }
+  }
+}
+
+/* Register the engine as a reader of its store */
+static
+void store_reader_add( struct ajj* a ) {
+  struct ajj* s = a->store;
+  void* mem;
+  CHECK(!posix_memalign(&mem,AJJ_CACHE_LINE_SIZE,
+        sizeof(struct store_reader)));
+  a->reader = (struct store_reader*)mem;
+  a->reader->epoch = 0;
+  a->reader->depth = 0;
+  a->reader->hit = a->reader->miss = 0;
+  store_lock(s);
+  if( s->cache.reader_len == s->cache.reader_cap ) {
+    s->cache.reader = mem_grow(s->cache.reader,
+        sizeof(struct store_reader*),0,&(s->cache.reader_cap));
+  }
+  s->cache.reader[s->cache.reader_len++] = a->reader;
+  store_unlock(s);
+}
+
+/* The engine must not hold any template , its statistics is kept */
+static
+void store_reader_remove( struct ajj* a ) {
+  struct ajj* s = a->store;
+  size_t i;
+  assert(a->reader->depth == 0);
+  store_lock(s);
+  for( i = 0 ; i < s->cache.reader_len ; ++i ) {
+    if( s->cache.reader[i] == a->reader ) {
+      s->cache.reader[i] = s->cache.reader[--s->cache.reader_len];
+      break;
+    }
+  }
+  s->cache.hit += a->reader->hit;
+  s->cache.miss += a->reader->miss;
+  store_unlock(s);
+  free(a->reader);
+  a->reader = NULL;
+}
+
+void ajj_cache_set_limit( struct ajj* a , size_t limit ) {
+  struct ajj* s = a->store;
+  store_lock(s);
+  s->cache.limit = limit;
+  template_trim(s,NULL);
+  store_unlock(s);
+}
+
+void ajj_cache_get_stat( struct ajj* a , struct ajj_cache_stat* stat ) {
+  struct ajj* s = a->store;
+  size_t i;
+  store_lock(s);
+  stat->hit = s->cache.hit;
+  stat->miss = s->cache.miss;
+  for( i = 0 ; i < s->cache.reader_len ; ++i ) {
+    stat->hit += atomic_load_relaxed(&(s->cache.reader[i]->hit));
+    stat->miss += atomic_load_relaxed(&(s->cache.reader[i]->miss));
+  }
+  stat->evict = s->cache.evict;
+  stat->size = map_size(&(s->tmpl_tbl)) + s->cache.data;
+  stat->mem = s->cache.mem;
+  stat->limit = s->cache.limit;
+  store_unlock(s);
+}
+
+/* =============================
+ * Compilation
+ * ===========================*/
+
+/* Parser and optimizer only touch the ajj engine for allocating objects
+ * and reporting error. So a template is compiled into a compile context
+ * which is a private template store that shares nothing but read only
+ * builtin function tables with the real engine. Once the compilation is
+ * done, the compiled template is published into the engine's store with
+ * the lock held , the memory of the compile context is merged into the
+ * store as well */
+static
+void compile_ctx_init( struct ajj* ctx , struct ajj* a ) {
+  ctx->err[0] = 0;
+  /* compile context never needs upvalue */
+  slab_init(&(ctx->upval_slab),0,sizeof(struct upvalue),0);
+  slab_init(&(ctx->obj_slab),OBJECT_SLAB_SIZE,
+      sizeof(struct ajj_object),OBJECT_SLAB_LIMIT);
+  slab_init(&(ctx->ft_slab),FUNCTION_TABLE_SLAB_SIZE,
+      sizeof(struct func_table),FUNCTION_TABLE_SLAB_LIMIT);
+  slab_init(&(ctx->gc_slab),GC_SLAB_SIZE,
+      sizeof(struct gc_scope),GC_SLAB_LIMIT);
+  map_create(&(ctx->tmpl_tbl),sizeof(struct jj_file*),32);
+  LINIT(&(ctx->cache.lru));
+  ctx->cache.mem = 0;
+  ctx->cache.limit = 0;
+  ctx->cache.hit = ctx->cache.miss = ctx->cache.evict = 0;
+  ctx->cache.data = 0;
+  mutex_init(&(ctx->cache.lock));
+  ctx->cache.index = NULL;
+  ctx->cache.dirty = 0;
+  ctx->cache.epoch = 1;
+  ctx->cache.reader = NULL;
+  ctx->cache.reader_len = ctx->cache.reader_cap = 0;
+  ctx->cache.drop = NULL;
+  ctx->cache.drop_len = ctx->cache.drop_cap = 0;
+  ctx->cache.retire = NULL;
+  ctx->cache.retire_len = ctx->cache.retire_cap = 0;
+  ctx->cache.retiring = 0;
+  ctx->reader = NULL;
+  gc_root_init(&(ctx->gc_root),a->gc_root.scp_id);
+  ctx->store = ctx;
+  ctx->parent = NULL;
+  ctx->rt = NULL;
+  ctx->render = NULL;
+  /* builtin types are only used for constructing constant values */
+  ctx->list = a->list;
+  ctx->dict = a->dict;
+  ctx->loop = a->loop;
+  ctx->vfs = a->vfs;
+  ctx->vfs_udata = a->vfs_udata;
+  ctx->udata = a->udata;
+  ctx->autoescape = a->autoescape;
+}
+
+static
+void compile_ctx_destroy( struct ajj* ctx ) {
+  ajj_clear_template(ctx);
+  gc_scope_exit(ctx,&(ctx->gc_root));
+  map_destroy(&(ctx->tmpl_tbl));
+  free(ctx->cache.index);
+  free(ctx->cache.drop);
+  free(ctx->cache.retire);
+  free(ctx->cache.reader);
+  mutex_destroy(&(ctx->cache.lock));
+  slab_destroy(&(ctx->upval_slab));
+  slab_destroy(&(ctx->obj_slab));
+  slab_destroy(&(ctx->ft_slab));
+  slab_destroy(&(ctx->gc_slab));
+}
+
+static
+struct ajj* compile_ctx_create( struct ajj* a ) {
+  struct ajj* ctx = malloc(sizeof(*ctx));
+  compile_ctx_init(ctx,a);
+  return ctx;
+}
+
+static
+void compile_ctx_free( struct ajj* ctx ) {
+  compile_ctx_destroy(ctx);
+  free(ctx);
+}
+
+/* Move all the templates inside of the compile context into the store,
+ * the compile context is destroyed afterwards */
+static
+void compile_ctx_publish( struct ajj* s , struct ajj* ctx ) {
+  /* release the templates replaced inside of the compile context while
+   * their memory still belongs to it */
+  store_commit(ctx);
+  /* the memory of templates is owned by store's slab from now on */
+  slab_merge(&(s->obj_slab),&(ctx->obj_slab));
+  slab_merge(&(s->ft_slab),&(ctx->ft_slab));
+  slab_merge(&(s->gc_slab),&(ctx->gc_slab));
+
+  while( !LEMPTY(&(ctx->cache.lru)) ) {
+    struct jj_file* f = ctx->cache.lru.next;
+    const char* name = f->tmpl->val.obj.fn_tb->name.str;
+    LREMOVE(f);
+    CHECK(!map_remove_c(&(ctx->tmpl_tbl),name,NULL));
+    f->scp->parent = &(s->gc_root);
+    LINSERT(f,&(s->cache.lru));
+    if(template_is_data(f)) {
+      ++s->cache.data;
+    } else {
+      template_remove(s,name);
+      CHECK(!map_insert_c(&(s->tmpl_tbl),name,&f));
+    }
+    s->cache.mem += f->sz;
+    s->cache.dirty = 1;
+  }
+  s->cache.miss += ctx->cache.miss;
+  compile_ctx_destroy(ctx);
+}
+
+/* Compile a template inside of a compile context */
+static
+struct ajj_object*
+compile_template( struct ajj* ctx , const char* name ,
+    const char* src , int own , time_t ts ) {
+  struct ajj_object* ret;
+  struct jj_file* f;
+  ret = parse(ctx,name,src,own,ts);
+  if(!ret) return NULL; /* parser already deletes it */
+#ifndef DISABLE_OPTIMIZATION
+  /* During debugging phase we may not want to switch optimization
+   * on for debugging purpose */
+  if(optimize(ctx,ret)) {
+    ajj_delete_template(ctx,name);
+    return NULL;
+  }
+#endif
+  f = jj_file_of(ret);
+  f->sz = template_size(ret);
+  ctx->cache.mem += f->sz;
+  return ret;
+}
+
+/* Publish the template compiled inside of a compile context created by
+ * compile_ctx_create , the template returned is pinned */
+static
+struct ajj_object*
+publish_template( struct ajj* a , struct ajj* ctx ,
+    struct ajj_object* tmpl ) {
+  struct ajj* s = a->store;
+  store_lock(s);
+  compile_ctx_publish(s,ctx);
+  ajj_pin_template(a,tmpl);
+  template_trim(s,jj_file_of(tmpl));
+  store_unlock(s);
+  free(ctx);
+  return tmpl;
+}
+
+/* Publish a template compiled by ajj_render_data , the one published
+ * by another thread in between for the same source is used instead.
+ * The snapshot is current while the lock is held */
+static
+struct ajj_object*
+publish_data( struct ajj* a , struct ajj* ctx , struct ajj_object* tmpl ) {
+  struct ajj* s = a->store;
+  const struct jj_file* f = jj_file_of(tmpl);
+  struct tmpl_index* idx;
+  struct jj_file* o;
+  store_lock(s);
+  idx = atomic_load(&(s->cache.index));
+  o = idx ? index_find_data(idx,tmpl->val.obj.src,f->data_len,f->key) :
+    NULL;
+  if(o) {
+    ajj_pin_template(a,o->tmpl);
+    store_unlock(s);
+    compile_ctx_free(ctx);
+    return o->tmpl;
+  }
+  compile_ctx_publish(s,ctx);
+  ajj_pin_template(a,tmpl);
+  template_trim(s,f);
+  store_unlock(s);
+  free(ctx);
+  return tmpl;
+}
+
+/* Load the source of the template from vfs with the blocking calls.
+ * The vfs is called with the engine a and the error goes to rpt */
+static
+const char* load_template_sync( struct ajj* a , struct ajj* rpt ,
+    const char* filename , size_t* len , time_t* ts , int has_ts ) {
+  const char* src = a->vfs.vfs_load(a,filename,len,
+      has_ts ? ts : NULL,a->vfs_udata);
+
+  if(!has_ts) {
+    /* In this case , since we don't know the ts, we do
+     * an extra call to retreieve the timestamp */
+    int ret = a->vfs.vfs_timestamp(a,filename,ts,a->vfs_udata);
+    if(ret) {
+      /* Failed here */
+      if(src) ajj_vfs_free(a,src,*len);
+      return NULL;
+    }
+  }
+
+  if(!src) {
+    ajj_error(rpt,"Cannot load file with name:%s!",filename);
+    return NULL;
+  }
+  return src;
+}
+
+/* Load the source of the template from vfs */
+static
+const char* load_template( struct ajj* a , const char* filename ,
+    size_t* len , time_t* ts , int has_ts ) {
+  if(a->render && a->vfs.vfs_load_async) {
+    /* timestamp is always reported by the asynchronous load */
+    return ajj_load_async(a,filename,len,ts);
+  }
+  return load_template_sync(a,a,filename,len,ts,has_ts);
+}
+
+/* =============================
+ * Parallel compilation
+ * ===========================*/
+struct compile_job {
+  struct ajj* a; /* engine the vfs is called with */
+  const char** names;
+  size_t len;
+  size_t next; /* next template to compile , shared by all workers */
+  int fail; /* set by the first worker that fails */
+};
+
+struct compile_worker {
+  struct compile_job* job;
+  struct ajj ctx;
+  thread_t tid;
+  int fail;
+};
+
+static
+void* compile_worker_main( void* arg ) {
+  struct compile_worker* w = (struct compile_worker*)arg;
+  struct compile_job* job = w->job;
+  while( !atomic_get(&(job->fail)) ) {
+    size_t i = atomic_add(&(job->next),1);
+    const char* src;
+    size_t len;
+    time_t ts;
+    if( i >= job->len ) break;
+    ++w->ctx.cache.miss;
+    /* user's vfs sees the user's engine , not the compile context */
+    src = load_template_sync(job->a,&(w->ctx),job->names[i],&len,&ts,0);
+    if(!src || !compile_template(&(w->ctx),job->names[i],src,
+          TMPL_SRC_VFS,ts)) {
+      w->fail = 1;
+      atomic_swap(&(job->fail),1);
+    }
+  }
+  return NULL;
+}
+
+int ajj_compile_all( struct ajj* a , const char** names , size_t len ,
+    size_t nthread ) {
+  struct compile_job job;
+  struct compile_worker* w;
+  struct ajj* s = a->store;
+  size_t i;
+  size_t spawn;
+
+  if( len == 0 ) return 0;
+  if( nthread == 0 ) {
+    long n = thread_cpu_count();
+    nthread = n <= 0 ? 1 : (size_t)n;
+  }
+  if( nthread > len ) nthread = len;
+
+  job.a = a;
+  job.names = names;
+  job.len = len;
+  job.next = 0;
+  job.fail = 0;
+
+  w = malloc(sizeof(*w)*nthread);
+  for( i = 0 ; i < nthread ; ++i ) {
+    w[i].job = &job;
+    w[i].fail = 0;
+    compile_ctx_init(&(w[i].ctx),a);
+  }
+  for( spawn = 0 ; spawn < nthread ; ++spawn ) {
+    if(thread_create(&(w[spawn].tid),compile_worker_main,w+spawn))
+      break;
+  }
+  /* if we cannot spawn enough threads, the rest of work is done
+   * inside of the calling thread */
+  if( spawn < nthread ) compile_worker_main(w+spawn);
+  for( i = 0 ; i < spawn ; ++i ) {
+    thread_join(w[i].tid);
+  }
+
+  if(job.fail) {
+    /* nothing gets published if any template fails */
+    int rpt = 0;
+    for( i = 0 ; i < nthread ; ++i ) {
+      if(w[i].fail && !rpt) {
+        memcpy(ajj_err_buf(a),w[i].ctx.err,ERROR_BUFFER_SIZE);
+        rpt = 1;
+      }
+      compile_ctx_destroy(&(w[i].ctx));
+    }
+  } else {
+    store_lock(s);
+    for( i = 0 ; i < nthread ; ++i ) {
+      compile_ctx_publish(s,&(w[i].ctx));
+    }
+    template_trim(s,NULL);
+    store_unlock(s);
+  }
+  free(w);
+  return job.fail ? -1 : 0;
 }
 
 /* =============================
@@ -176,6 +910,11 @@ ajj_value_new_const_string( struct ajj* a,
         ajj_cur_gc_scope(a),&s));
 }
 
+void ajj_value_mark_safe( struct ajj_value* val ) {
+  if( val->type == AJJ_VALUE_STRING )
+    val->value.object->safe = 1;
+}
+
 const char*
 ajj_value_to_str( const struct ajj_value* val ,
     size_t* len ) {
@@ -380,6 +1119,7 @@ void ajj_add_vvalue( struct ajj* a , struct upvalue_table* ut,
         size_t str_l= va_arg(vl,size_t);
         n = string_dupc(name);
         uv = upvalue_table_overwrite(a,ut,&n,1,1);
+        uv->type = UPVALUE_VALUE;
         uv->gut.val = ajj_value_assign(
             ajj_object_create_string(a,scp,str,str_l,0));
         break;
@@ -390,6 +1130,7 @@ void ajj_add_vvalue( struct ajj* a , struct upvalue_table* ut,
         struct ajj_value* val = va_arg(vl,struct ajj_value*);
         n = string_dupc(name);
         uv = upvalue_table_overwrite(a,ut,&n,1,1);
+        uv->type = UPVALUE_VALUE;
         uv->gut.val = ajj_value_move_scope(a,scp,val);
         break;
       }
@@ -438,6 +1179,287 @@ ajj_add_test( struct ajj* a, struct upvalue_table* ut,
   return &(uv->gut.gfunc);
 }
 
+/* ==================================================
+ * Environment snapshots
+ * The environment table is only changed by the thread that owns the
+ * engine. After each change the changed name is put into a new delta
+ * layer stacked on the current layers and published as a new snapshot ,
+ * the upvalues themselves are shared by the layers. An upvalue
+ * referenced by a snapshot is never modified or freed in place , it is
+ * copied on write and retired into the newest layer at that time.
+ * Retired upvalues are handed back to the owner once that layer dies and
+ * freed by the owner's thread since the slabs are not thread safe.
+ * ================================================*/
+
+static
+void env_layer_release( struct env_layer* l ) {
+  while( l && atomic_add(&(l->ref),-1) == 1 ) {
+    struct env_layer* next = l->next;
+    struct ajj* a = l->a;
+    size_t i;
+    mutex_lock(&(a->env_lock));
+    for( i = 0 ; i < l->retire_len ; ++i ) {
+      if( a->env_dead_len == a->env_dead_cap ) {
+        a->env_dead = mem_grow(a->env_dead,sizeof(struct upvalue*),
+            0,&(a->env_dead_cap));
+      }
+      a->env_dead[a->env_dead_len++] = l->retire[i];
+    }
+    mutex_unlock(&(a->env_lock));
+    map_destroy(&(l->d));
+    free(l->retire);
+    free(l);
+    l = next;
+  }
+}
+
+void ajj_env_release( struct env_version* v ) {
+  while( v && atomic_add(&(v->ref),-1) == 1 ) {
+    struct env_version* base = v->base;
+    struct env_layer* l = v->layer;
+    while(l) {
+      struct env_layer* below = l->below;
+      env_layer_release(l);
+      l = below;
+    }
+    free(v->tbl);
+    free(v);
+    v = base;
+  }
+}
+
+/* Snapshot takes a reference of each layer of the stack and the pin of
+ * the base */
+static
+struct env_version* env_version_create( struct ajj* a ,
+    struct env_layer* l , struct env_version* base ) {
+  struct env_version* v = malloc(sizeof(*v));
+  size_t n = l->depth;
+  size_t i;
+  v->tbl = malloc(sizeof(struct upvalue_table)*n);
+  v->layer = l;
+  for( i = 0 ; i < n ; ++i ) {
+    v->tbl[i].d = l->d; /* view , the layer owns the map */
+    if( i+1 < n )
+      v->tbl[i].prev = v->tbl + i + 1;
+    else
+      v->tbl[i].prev = base ? ajj_env_table(base) : a->env.prev;
+    atomic_add(&(l->ref),1);
+    l = l->below;
+  }
+  v->base = base;
+  v->ref = 1;
+  return v;
+}
+
+/* Free the upvalues that no snapshot can reach anymore */
+static
+void env_drain( struct ajj* a ) {
+  struct upvalue** dead;
+  size_t len , i;
+  mutex_lock(&(a->env_lock));
+  dead = a->env_dead;
+  len = a->env_dead_len;
+  a->env_dead = NULL;
+  a->env_dead_len = a->env_dead_cap = 0;
+  mutex_unlock(&(a->env_lock));
+  for( i = 0 ; i < len ; ++i ) {
+    struct upvalue* uv = dead[i];
+    if( uv->type == UPVALUE_FUNCTION &&
+        IS_OBJECTCTOR(&(uv->gut.gfunc)) ) {
+      func_table_destroy(a,GET_OBJECTCTOR(&(uv->gut.gfunc)));
+    }
+    slab_free(&(a->upval_slab),uv);
+  }
+  free(dead);
+}
+
+/* Retire an upvalue removed from the environment table */
+static
+void env_retire( struct ajj* a , struct upvalue* uv ) {
+  struct env_layer* l = a->env_layer;
+  if( !uv->shared ) {
+    if( uv->type == UPVALUE_FUNCTION &&
+        IS_OBJECTCTOR(&(uv->gut.gfunc)) ) {
+      func_table_destroy(a,GET_OBJECTCTOR(&(uv->gut.gfunc)));
+    }
+    slab_free(&(a->upval_slab),uv);
+    return;
+  }
+  /* the engine holds the current layer , so it is still alive */
+  if( l->retire_len == l->retire_cap ) {
+    l->retire = mem_grow(l->retire,sizeof(struct upvalue*),
+        0,&(l->retire_cap));
+  }
+  l->retire[l->retire_len++] = uv;
+}
+
+/* Make the upvalue of the name private to the environment table before
+ * it is overwritten. A deleted name keeps a NULL slot in the table since
+ * the name of a function upvalue points to the key */
+static
+void env_unshare( struct ajj* a , const char* name ) {
+  struct upvalue** slot = map_find_c(&(a->env.d),name);
+  struct upvalue* uv;
+  if(!slot) return;
+  if(*slot == NULL) {
+    uv = slab_malloc(&(a->upval_slab));
+    uv->prev = NULL;
+    uv->type = UPVALUE_VALUE;
+    uv->fixed = 0;
+    uv->shared = 0;
+    *slot = uv;
+  } else if((*slot)->shared) {
+    uv = slab_malloc(&(a->upval_slab));
+    *uv = **slot;
+    uv->shared = 0;
+    env_retire(a,*slot);
+    *slot = uv;
+  }
+}
+
+/* Empty layer stacked on below , NULL below for a full copy */
+static
+struct env_layer* env_layer_create( struct ajj* a ,
+    struct env_layer* below ) {
+  struct env_layer* l = malloc(sizeof(*l));
+  map_create(&(l->d),sizeof(struct upvalue*),UPVALUE_DEFAULT_BUF_SIZE);
+  l->a = a;
+  l->next = NULL;
+  l->below = below;
+  l->depth = below ? below->depth + 1 : 1;
+  l->copied = below ? below->copied : 0;
+  l->retire = NULL;
+  l->retire_len = l->retire_cap = 0;
+  l->ref = 1; /* held by the engine */
+  return l;
+}
+
+/* Free a layer that is never published */
+static
+void env_layer_discard( struct env_layer* l ) {
+  map_destroy(&(l->d));
+  free(l);
+}
+
+/* Copy all the entries of src into l , the ones already in l win */
+static
+void env_layer_fill( struct env_layer* l , struct map* src ) {
+  int itr = map_iter_start(src);
+  while( map_iter_has(src,itr) ) {
+    struct map_pair p = map_iter_deref(src,itr);
+    struct upvalue* uv = *(struct upvalue**)p.val;
+    if( uv && !map_find(&(l->d),p.key) ) {
+      if(!uv->shared) uv->shared = 1;
+      CHECK(!map_insert(&(l->d),p.key,0,&uv));
+    }
+    itr = map_iter_move(src,itr);
+  }
+}
+
+/* Merge an unpublished delta with the delta below it */
+static
+struct env_layer* env_layer_merge( struct ajj* a , struct env_layer* l ) {
+  struct env_layer* m = env_layer_create(a,l->below->below);
+  env_layer_fill(m,&(l->d));
+  env_layer_fill(m,&(l->below->d));
+  m->copied = l->copied + map_size(&(m->d));
+  env_layer_discard(l);
+  return m;
+}
+
+/* Publish the change of the name as a new snapshot , NULL name stands
+ * for any change. The name goes into a new delta layer and the deltas
+ * are merged like the digits of a binary counter whenever the top one
+ * is not smaller than the one below , so a lookup passes a logarithmic
+ * number of layers and a change copies a logarithmic number of entries
+ * on average. A name removed for good cannot be a delta since a NULL
+ * slot also hides the parent engine , so it makes a full copy , and so
+ * do deltas that have copied as many entries as the full copy holds */
+static
+void env_publish( struct ajj* a , const char* name ) {
+  struct env_layer* cur = a->env_layer;
+  struct env_layer* l = NULL;
+  struct env_layer* old_l;
+  struct env_version* v;
+  struct env_version* old_v;
+  struct upvalue** slot = name ? map_find_c(&(a->env.d),name) : NULL;
+
+  if( cur && slot && *slot ) {
+    struct upvalue* uv = *slot;
+    struct env_layer* full = cur;
+    if(!uv->shared) uv->shared = 1;
+    l = env_layer_create(a,cur);
+    CHECK(!map_insert_c(&(l->d),name,&uv));
+    ++l->copied;
+    while( l->below->below &&
+           map_size(&(l->d)) >= map_size(&(l->below->d)) )
+      l = env_layer_merge(a,l);
+    while( full->below ) full = full->below;
+    if( l->copied > map_size(&(full->d)) + UPVALUE_DEFAULT_BUF_SIZE ) {
+      env_layer_discard(l);
+      l = NULL;
+    }
+  }
+  if(!l) {
+    l = env_layer_create(a,NULL);
+    env_layer_fill(l,&(a->env.d));
+  }
+  v = env_version_create(a,l,a->parent ? ajj_env_acquire(a->parent):NULL);
+
+  mutex_lock(&(a->env_lock));
+  old_v = a->env_ver;
+  old_l = a->env_layer;
+  a->env_ver = v;
+  a->env_layer = l;
+  if(old_l) {
+    old_l->next = l;
+    atomic_add(&(l->ref),1);
+  }
+  mutex_unlock(&(a->env_lock));
+  ajj_env_release(old_v);
+  env_layer_release(old_l);
+  env_drain(a);
+}
+
+struct env_version* ajj_env_acquire( struct ajj* a ) {
+  struct env_version* base = a->parent ? ajj_env_acquire(a->parent) : NULL;
+  struct env_version* stale = NULL;
+  struct env_version* v;
+  mutex_lock(&(a->env_lock));
+  v = a->env_ver;
+  if( base && v->base != base ) {
+    /* parent published a new snapshot , rebase the current layer */
+    stale = v;
+    v = env_version_create(a,a->env_layer,base);
+    a->env_ver = v;
+    base = NULL;
+  }
+  atomic_add(&(v->ref),1);
+  mutex_unlock(&(a->env_lock));
+  ajj_env_release(base);
+  ajj_env_release(stale);
+  return v;
+}
+
+static
+void env_init( struct ajj* a ) {
+  a->env_ver = NULL;
+  a->env_layer = NULL;
+  a->env_dead = NULL;
+  a->env_dead_len = a->env_dead_cap = 0;
+  mutex_init(&(a->env_lock));
+  env_publish(a,NULL);
+}
+
+static
+void env_destroy( struct ajj* a ) {
+  ajj_env_release(a->env_ver);
+  env_layer_release(a->env_layer);
+  env_drain(a);
+  mutex_destroy(&(a->env_lock));
+}
+
 /* ==================================================
  * Registeration
  * ================================================*/
@@ -445,25 +1467,49 @@ void ajj_env_add_value( struct ajj* a, const char* name,
     int type, ... ) {
   va_list vl;
   va_start(vl,type);
+  env_unshare(a,name);
   ajj_add_vvalue(a,&(a->env),&(a->gc_root),name,type,vl);
+  env_publish(a,name);
 }
 
 void ajj_env_add_class( struct ajj* a, const struct ajj_class* cls ) {
+  env_unshare(a,cls->name);
   ajj_add_class(a,&(a->env),cls);
+  env_publish(a,cls->name);
 }
 
 void ajj_env_add_function( struct ajj* a, const char* name,
     ajj_function entry,
     void* udata ) {
+  env_unshare(a,name);
   ajj_add_function(a,&(a->env),name,entry,udata);
+  env_publish(a,name);
+}
+
+void ajj_env_add_test( struct ajj* a, const char* name,
+    ajj_function entry,
+    void* udata ) {
+  env_unshare(a,name);
+  ajj_add_test(a,&(a->env),name,entry,udata);
+  env_publish(a,name);
 }
 
 int ajj_env_has( struct ajj* a, const char* name ) {
-  return upvalue_table_find_c(&(a->env),name,NULL) != NULL;
+  struct env_version* v = ajj_env_acquire(a);
+  int ret = upvalue_table_find_c(ajj_env_table(v),name,NULL) != NULL;
+  ajj_env_release(v);
+  return ret;
 }
 
 int ajj_env_del( struct ajj* a, const char* name ) {
-  return upvalue_table_del_c(a,&(a->env),name,a->env.prev);
+  struct upvalue** slot = map_find_c(&(a->env.d),name);
+  struct upvalue* uv;
+  if( !slot || !*slot ) return -1;
+  uv = *slot;
+  *slot = uv->prev;
+  env_retire(a,uv);
+  env_publish(a,name);
+  return 0;
 }
 
 /* upvalue */
@@ -553,11 +1599,22 @@ int ajj_upvalue_has( struct ajj* a, const char* name ) {
 
 void ajj_upvalue_del( struct ajj* a, const char* name ) {
   assert( a->rt && a->rt->global );
-  upvalue_table_del_c(a,a->rt->global,name,&(a->env));
+  upvalue_table_del_c(a,a->rt->global,name,a->rt->env);
 }
 
 void ajj_env_clear( struct ajj* a ) {
-  upvalue_table_clear(a,&(a->env));
+  int itr = map_iter_start(&(a->env.d));
+  while( map_iter_has(&(a->env.d),itr) ) {
+    struct map_pair p = map_iter_deref(&(a->env.d),itr);
+    struct upvalue** slot = (struct upvalue**)p.val;
+    while(*slot) {
+      struct upvalue* uv = *slot;
+      *slot = uv->prev;
+      env_retire(a,uv);
+    }
+    itr = map_iter_move(&(a->env.d),itr);
+  }
+  env_publish(a,NULL);
 }
 
 /* =======================================================
@@ -569,6 +1626,9 @@ void ajj_io_init_file( struct ajj_io* io , FILE* f ) {
   assert(f);
   io->tp = AJJ_IO_FILE;
   io->out.f = f;
+  io->err = 0;
+  io->gather = NULL;
+  io->render = NULL;
 }
 
 struct ajj_io*
@@ -583,63 +1643,407 @@ struct ajj_io*
 ajj_io_create_mem( struct ajj* a , size_t cap ) {
   struct ajj_io* r = malloc(sizeof(*r));
   UNUSE_ARG(a);
-  strbuf_init(&(r->out.m));
+  if(cap)
+    strbuf_init_cap(&(r->out.m),cap);
+  else
+    strbuf_init(&(r->out.m));
   r->tp = AJJ_IO_MEM;
+  r->err = 0;
+  r->gather = NULL;
+  r->render = NULL;
+  return r;
+}
+
+void ajj_io_init_sink( struct ajj_io* io , const struct ajj_io_sink* sink ,
+    void* udata ) {
+  assert(sink->sink_write);
+  assert(!sink->sink_reserve == !sink->sink_commit);
+  io->out.sink.s = *sink;
+  io->out.sink.udata = udata;
+  io->out.sink.release = NULL;
+  io->tp = AJJ_IO_SINK;
+  io->err = 0;
+  io->gather = NULL;
+  io->render = NULL;
+}
+
+struct ajj_io*
+ajj_io_create_sink( struct ajj* a , const struct ajj_io_sink* sink ,
+    void* udata ) {
+  struct ajj_io* r = malloc(sizeof(*r));
+  UNUSE_ARG(a);
+  ajj_io_init_sink(r,sink,udata);
   return r;
 }
 
+/* Stream IO , a builtin sink that cuts the output into chunks */
+struct stream_sink {
+  struct ajj_io* io; /* the stream itself */
+  ajj_stream_callback cb;
+  void* udata;
+  char* buf;
+  size_t len;
+  size_t cap;
+  size_t chunk;
+};
+
+/* Hand the buffered bytes to the consumer chunk by chunk , a partial
+ * chunk is only sent if all is set. The rendering suspended on a push
+ * back is the resumable one bound to the stream , not whatever the
+ * engine that created the stream is running */
+static
+int stream_sink_emit( struct stream_sink* s , int all ) {
+  size_t off = 0;
+  int ret = 0;
+  while( s->len - off >= s->chunk || (all && off < s->len) ) {
+    size_t n = s->len - off;
+    if( n > s->chunk ) n = s->chunk;
+    ret = s->cb(s->udata,s->buf+off,n);
+    if( ret == 0 ) {
+      off += n;
+    } else if( ret != AJJ_IO_BUSY ) {
+      ret = -1;
+      break;
+    } else if( s->io->render == NULL ) {
+      /* keep the bytes if the rendering cannot wait for the consumer */
+      break;
+    } else if(ajj_suspend(s->io->render)) {
+      ret = -1;
+      break;
+    }
+  }
+  s->len -= off;
+  if(off) memmove(s->buf,s->buf+off,s->len);
+  return ret;
+}
+
+static
+int stream_sink_write( void* udata , const void* mem , size_t len ) {
+  struct stream_sink* s = (struct stream_sink*)udata;
+  const char* src = (const char*)mem;
+  while( len > 0 ) {
+    size_t n;
+    if( s->len >= s->chunk ) {
+      /* consumer pushed back , keep the rest and try again */
+      if( s->cap - s->len < len )
+        s->buf = mem_grow(s->buf,sizeof(char),len,&(s->cap));
+      memcpy(s->buf+s->len,src,len);
+      s->len += len;
+      return stream_sink_emit(s,0) < 0 ? -1 : 0;
+    }
+    n = s->chunk - s->len;
+    if( n > len ) n = len;
+    memcpy(s->buf+s->len,src,n);
+    s->len += n;
+    src += n;
+    len -= n;
+    if( s->len == s->chunk && stream_sink_emit(s,0) < 0 )
+      return -1;
+  }
+  return 0;
+}
+
+static
+int stream_sink_flush( void* udata ) {
+  struct stream_sink* s = (struct stream_sink*)udata;
+  return s->len ? stream_sink_emit(s,1) : 0;
+}
+
+static
+void stream_sink_release( void* udata ) {
+  struct stream_sink* s = (struct stream_sink*)udata;
+  free(s->buf);
+  free(s);
+}
+
+static const struct ajj_io_sink STREAM_SINK = {
+  stream_sink_write,
+  NULL,
+  stream_sink_flush,
+  NULL,
+  NULL
+};
+
+struct ajj_io*
+ajj_io_create_stream( struct ajj* a , size_t chunk ,
+    ajj_stream_callback cb , void* udata ) {
+  struct stream_sink* s = malloc(sizeof(*s));
+  struct ajj_io* io;
+  assert( chunk > 0 );
+  s->cb = cb;
+  s->udata = udata;
+  s->buf = malloc(chunk);
+  s->len = 0;
+  s->cap = chunk;
+  s->chunk = chunk;
+  io = ajj_io_create_sink(a,&STREAM_SINK,s);
+  io->out.sink.release = stream_sink_release;
+  s->io = io;
+  return io;
+}
+
+static
+void io_gather_free( struct io_gather* g ) {
+  if(g) {
+    free(g->scratch);
+    free(g);
+  }
+}
+
+int ajj_io_set_gather( struct ajj_io* io , size_t cap ) {
+  if( io->tp != AJJ_IO_SINK ) return -1;
+  ajj_io_sync(io);
+  io_gather_free(io->gather);
+  io->gather = NULL;
+  if(cap) {
+    struct io_gather* g = malloc(sizeof(*g));
+    g->len = 0;
+    g->scratch = malloc(cap);
+    g->used = 0;
+    g->cap = cap;
+    io->gather = g;
+  }
+  return 0;
+}
+
 void ajj_io_destroy( struct ajj* a , struct ajj_io* io ) {
   UNUSE_ARG(a);
   if(io->tp == AJJ_IO_MEM) {
     strbuf_destroy(&(io->out.m));
   }
+  ajj_io_sync(io); /* the gathered output is not dropped */
+  io_gather_free(io->gather);
+  if( io->tp == AJJ_IO_SINK && io->out.sink.release )
+    io->out.sink.release(io->out.sink.udata);
   free(io);
 }
 
 static
 int io_file_vprintf( struct ajj_io* io , const char* fmt , va_list vl ) {
-  return vfprintf(io->out.f,fmt,vl);
+  int ret = vfprintf(io->out.f,fmt,vl);
+  if(ret < 0) io->err = 1;
+  return ret;
+}
+
+static
+int io_file_write( struct ajj_io* io , const void* mem , size_t len ) {
+  if(fwrite(mem,sizeof(char),len,io->out.f) != len) {
+    io->err = 1;
+    return -1;
+  }
+  return 0;
 }
 
+/* Format into the region reserved from the sink , or into a local buffer
+ * which is handed to sink_write. Large output goes to the heap */
 static
-void io_file_write( struct ajj_io* io , const void* mem , size_t len ) {
-  fwrite(mem,sizeof(char),len,io->out.f);
+int io_sink_vprintf( struct ajj_io* io , const char* fmt , va_list vl ) {
+  struct ajj_io_sink* s = &(io->out.sink.s);
+  void* udata = io->out.sink.udata;
+  char buf[AJJ_IO_PRINTF_BUF_SIZE];
+  char* dst = NULL;
+  size_t cap = 0;
+  va_list backup;
+  int ret;
+  int fail;
+
+  va_copy(backup,vl);
+  if(s->sink_reserve)
+    dst = s->sink_reserve(udata,AJJ_IO_PRINTF_BUF_SIZE,&cap);
+  if(dst) {
+    ret = vsnprintf(dst,cap,fmt,vl);
+    if( ret >= 0 && (size_t)ret < cap ) {
+      fail = s->sink_commit(udata,ret);
+      goto done;
+    }
+    if( (fail = s->sink_commit(udata,0)) != 0 ) goto done;
+  } else {
+    ret = vsnprintf(buf,sizeof(buf),fmt,vl);
+    if( ret >= 0 && (size_t)ret < sizeof(buf) ) {
+      fail = s->sink_write(udata,buf,ret);
+      goto done;
+    }
+  }
+  if(ret < 0) {
+    fail = 1;
+  } else {
+    dst = malloc(ret+1);
+    vsnprintf(dst,ret+1,fmt,backup);
+    fail = s->sink_write(udata,dst,ret);
+    free(dst);
+  }
+
+done:
+  va_end(backup);
+  if(fail) {
+    io->err = 1;
+    return -1;
+  }
+  return ret;
+}
+
+static
+int io_sink_write( struct ajj_io* io , const void* mem , size_t len ) {
+  if(io->out.sink.s.sink_write(io->out.sink.udata,mem,len)) {
+    io->err = 1;
+    return -1;
+  }
+  return 0;
+}
+
+int ajj_io_sync( struct ajj_io* io ) {
+  struct io_gather* g = io->gather;
+  struct ajj_io_sink* s = &(io->out.sink.s);
+  size_t i;
+  int fail = 0;
+  if( !g || g->len == 0 ) return io->err ? -1 : 0;
+  if(!io->err) {
+    if(s->sink_writev) {
+      fail = s->sink_writev(io->out.sink.udata,g->iov,g->len);
+    } else {
+      for( i = 0 ; i < g->len && !fail ; ++i )
+        fail = s->sink_write(io->out.sink.udata,g->iov[i].base,
+            g->iov[i].len);
+    }
+    if(fail) io->err = 1;
+  }
+  g->len = 0;
+  g->used = 0;
+  return io->err ? -1 : 0;
+}
+
+int ajj_io_write_ref( struct ajj_io* io , const void* mem , size_t len ) {
+  struct io_gather* g = io->gather;
+  if(!g) return ajj_io_write(io,mem,len);
+  if(io->err) return -1;
+  if( g->len == AJJ_IO_GATHER_IOV_SIZE && ajj_io_sync(io) ) return -1;
+  g->iov[g->len].base = mem;
+  g->iov[g->len].len = len;
+  ++g->len;
+  return (int)len;
+}
+
+/* Copy a dynamic chunk into the scratch buffer */
+static
+int io_gather_write( struct ajj_io* io , const void* mem , size_t len ) {
+  struct io_gather* g = io->gather;
+  char* dst;
+  if( len > g->cap - g->used || g->len == AJJ_IO_GATHER_IOV_SIZE ) {
+    if(ajj_io_sync(io)) return -1;
+    /* too large to be copied , hand it to the sink directly */
+    if( len > g->cap ) return io_sink_write(io,mem,len);
+  }
+  dst = g->scratch + g->used;
+  memcpy(dst,mem,len);
+  g->used += len;
+  if( g->len > 0 &&
+      (const char*)g->iov[g->len-1].base + g->iov[g->len-1].len == dst ) {
+    /* extend the last chunk if it is right before this one */
+    g->iov[g->len-1].len += len;
+  } else {
+    g->iov[g->len].base = dst;
+    g->iov[g->len].len = len;
+    ++g->len;
+  }
+  return 0;
 }
 
 int ajj_io_printf( struct ajj_io* io , const char* fmt , ... ) {
   va_list vl;
   va_start(vl,fmt);
-  if(io->tp == AJJ_IO_FILE) {
-    return io_file_vprintf(io,fmt,vl);
-  } else {
-    return strbuf_vprintf(&(io->out.m),fmt,vl);
-  }
+  return ajj_io_vprintf(io,fmt,vl);
 }
 
 int ajj_io_vprintf( struct ajj_io* io , const char* fmt , va_list vl ) {
-  if(io->tp == AJJ_IO_FILE) {
-    return io_file_vprintf(io,fmt,vl);
-  } else {
-    return strbuf_vprintf(&(io->out.m),fmt,vl);
+  if(ajj_io_sync(io)) return -1;
+  switch(io->tp) {
+    case AJJ_IO_FILE:
+      return io_file_vprintf(io,fmt,vl);
+    case AJJ_IO_SINK:
+      return io_sink_vprintf(io,fmt,vl);
+    default:
+      return strbuf_vprintf(&(io->out.m),fmt,vl);
   }
 }
 
 int ajj_io_write( struct ajj_io* io , const void* mem , size_t len ) {
-  if(io->tp == AJJ_IO_FILE) {
-    io_file_write(io,mem,len);
-  } else {
-    strbuf_append(&(io->out.m),(const char*)mem,len);
+  if(io->err) return -1;
+  switch(io->tp) {
+    case AJJ_IO_FILE:
+      if(io_file_write(io,mem,len)) return -1;
+      break;
+    case AJJ_IO_SINK:
+      if(io->gather ? io_gather_write(io,mem,len) :
+                      io_sink_write(io,mem,len))
+        return -1;
+      break;
+    default:
+      strbuf_append(&(io->out.m),(const char*)mem,len);
+      break;
+  }
+  return (int)len;
+}
+
+int ajj_io_writev( struct ajj_io* io , const struct ajj_iovec* iov ,
+    size_t cnt ) {
+  size_t len = 0;
+  size_t i;
+  if(io->err) return -1;
+  if( io->gather ) {
+    for( i = 0 ; i < cnt ; ++i ) {
+      if(io_gather_write(io,iov[i].base,iov[i].len)) return -1;
+      len += iov[i].len;
+    }
+    return (int)len;
+  }
+  if( io->tp == AJJ_IO_SINK && io->out.sink.s.sink_writev ) {
+    for( i = 0 ; i < cnt ; ++i ) len += iov[i].len;
+    if(io->out.sink.s.sink_writev(io->out.sink.udata,iov,cnt)) {
+      io->err = 1;
+      return -1;
+    }
+    return (int)len;
+  }
+  for( i = 0 ; i < cnt ; ++i ) {
+    if(ajj_io_write(io,iov[i].base,iov[i].len) < 0)
+      return -1;
+    len += iov[i].len;
   }
   return (int)len;
 }
 
-void ajj_io_flush( struct ajj_io* io ) {
-  if(io->tp == AJJ_IO_FILE)
-    fflush(io->out.f);
+int ajj_io_flush( struct ajj_io* io ) {
+  if(ajj_io_sync(io)) return -1;
+  switch(io->tp) {
+    case AJJ_IO_FILE:
+      if(fflush(io->out.f)) io->err = 1;
+      break;
+    case AJJ_IO_SINK:
+      if(io->out.sink.s.sink_flush) {
+        int ret = io->out.sink.s.sink_flush(io->out.sink.udata);
+        if(ret < 0) {
+          io->err = 1;
+        } else if(ret == AJJ_IO_BUSY) {
+          return AJJ_IO_BUSY;
+        }
+      }
+      break;
+    default:
+      break;
+  }
+  return io->err ? -1 : 0;
+}
+
+void ajj_io_reserve( struct ajj_io* io , size_t len ) {
+  struct strbuf* m = &(io->out.m);
+  if( io->tp != AJJ_IO_MEM ) return;
+  /* one more byte for the null terminator */
+  if( m->cap <= m->len + len )
+    strbuf_reserve(m,m->len + len + 1);
 }
 
 void* ajj_io_get_content( struct ajj_io* io , size_t* size ) {
-  if( io->tp == AJJ_IO_FILE ) {
+  if( io->tp != AJJ_IO_MEM ) {
     *size = 0;
     return NULL;
   } else {
@@ -649,7 +2053,7 @@ void* ajj_io_get_content( struct ajj_io* io , size_t* size ) {
 }
 
 void* ajj_io_detach( struct ajj_io* io , size_t* size ) {
-  if( io->tp == AJJ_IO_FILE ) {
+  if( io->tp != AJJ_IO_MEM ) {
     *size = 0;
     return NULL;
   } else {
@@ -1155,6 +2559,19 @@ ajj_display( struct ajj* a, const struct ajj_value* val,
         if(o->fn_tb->slot.display) {
           *own = 1;
           return o->fn_tb->slot.display(a,val,len);
+        } else if(o->fn_tb->slot.display_io) {
+          struct ajj_io* io = ajj_io_create_mem(a,0);
+          char* ret;
+          o->fn_tb->slot.display_io(a,val,io); /* memory never fails */
+          ret = ajj_io_detach(io,len);
+          ajj_io_destroy(a,io);
+          if(!ret) {
+            *own = 0;
+            *len = EMPTY_STRING.len;
+            return EMPTY_STRING.str;
+          }
+          *own = 1;
+          return ret;
         } else {
           *own = 0;
           *len = EMPTY_STRING.len;
@@ -1167,14 +2584,57 @@ ajj_display( struct ajj* a, const struct ajj_value* val,
   }
 }
 
+int ajj_display_io( struct ajj* a , const struct ajj_value* val ,
+    struct ajj_io* io ) {
+  char buf[DTOC_BUF_SIZE];
+  size_t len;
+  switch(val->type) {
+    case AJJ_VALUE_STRING:
+      {
+        const struct string* str = &(val->value.object->val.str);
+        if( str->len == 0 ) return 0;
+        return ajj_io_write(io,str->str,str->len) < 0 ? -1 : 0;
+      }
+    case AJJ_VALUE_NONE:
+      return 0;
+    case AJJ_VALUE_BOOLEAN:
+      /* True/False are static strings */
+      if(val->value.boolean)
+        return ajj_io_write_ref(io,TRUE_STRING.str,TRUE_STRING.len) < 0 ?
+          -1 : 0;
+      else
+        return ajj_io_write_ref(io,FALSE_STRING.str,FALSE_STRING.len) < 0 ?
+          -1 : 0;
+    case AJJ_VALUE_NUMBER:
+      len = dtoc_buf(val->value.number,buf);
+      return ajj_io_write(io,buf,len) < 0 ? -1 : 0;
+    case AJJ_VALUE_OBJECT:
+      {
+        struct object* o = &(val->value.object->val.obj);
+        if(o->fn_tb->slot.display_io) {
+          return o->fn_tb->slot.display_io(a,val,io);
+        } else if(o->fn_tb->slot.display) {
+          const char* str = o->fn_tb->slot.display(a,val,&len);
+          int ret = len > 0 && ajj_io_write(io,str,len) < 0 ? -1 : 0;
+          free((void*)str);
+          return ret;
+        }
+        return 0;
+      }
+    default:
+      UNREACHABLE();
+      return -1;
+  }
+}
+
 void ajj_error( struct ajj* a , const char* format , ... ) {
   va_list vl;
   va_start(vl,format);
-  vsnprintf(a->err,ERROR_BUFFER_SIZE,format,vl);
+  vsnprintf(ajj_err_buf(a),ERROR_BUFFER_SIZE,format,vl);
 }
 
 const char* ajj_last_error( struct ajj* a ) {
-  return a->err;
+  return ajj_err_buf(a);
 }
 
 void ajj_set_udata( struct ajj* a , void* udata ) {
@@ -1186,86 +2646,249 @@ void* ajj_get_udata( struct ajj* a ) {
 }
 
 void* ajj_runtime_get_udata( struct ajj* a ) {
-  if(a->rt) return a->rt->udata;
+  if(a->rt) return ajj_context_get_udata(a->rt->ctx);
   return NULL;
 }
 
+struct ajj_context* ajj_get_context( struct ajj* a ) {
+  return a->rt ? a->rt->ctx : NULL;
+}
+
+struct ajj* ajj_context_get_engine( struct ajj_context* ctx ) {
+  return ctx->a;
+}
+
+void* ajj_context_get_udata( struct ajj_context* ctx ) {
+  return ctx->udata;
+}
+
+void ajj_context_error( struct ajj_context* ctx , const char* format ,
+    ... ) {
+  va_list vl;
+  va_start(vl,format);
+  vsnprintf(ctx->err,ERROR_BUFFER_SIZE,format,vl);
+}
+
+const char* ajj_context_last_error( struct ajj_context* ctx ) {
+  return ctx->err;
+}
+
+/* Compile a template and publish it into the store , the template
+ * returned is pinned */
+static
+struct ajj_object*
+compile_and_publish( struct ajj* a , const char* name ,
+    const char* src , int own , time_t ts ) {
+  struct ajj* ctx = compile_ctx_create(a);
+  struct ajj_object* ret = compile_template(ctx,name,src,own,ts);
+  if(!ret) {
+    memcpy(ajj_err_buf(a),ctx->err,ERROR_BUFFER_SIZE);
+    compile_ctx_free(ctx);
+    return NULL;
+  }
+  return publish_template(a,ctx,ret);
+}
+
+/* Find a template and pin it. The snapshot is searched without lock,
+ * the table is only searched with lock for the template that is just
+ * created and not published yet. Nothing shared is written on a hit */
+static
+struct jj_file* template_acquire( struct ajj* a , const char* name ) {
+  struct ajj* s = a->store;
+  struct tmpl_index* idx;
+  struct jj_file* f;
+  ajj_pin_template(a,NULL);
+  idx = atomic_load(&(s->cache.index));
+  f = idx ? index_find(idx,name) : NULL;
+  if(!f) {
+    store_lock(s);
+    f = template_find(s,name);
+    store_unlock(s);
+    if(!f) ajj_unpin_template(a,NULL);
+  }
+  return f;
+}
+
 struct ajj_object*
 ajj_parse_template( struct ajj* a , const char* filename ) {
   size_t len;
   const char* src;
   time_t ts;
-  struct jj_file* f;
+  int has_ts = 0;
   /* try to load the template directly from existed one */
-  f = ajj_find_template(a,filename);
+  struct jj_file* f = template_acquire(a,filename);
   if(f) {
     if(f->ts == 0) {
-      return f->tmpl; /* This is a in memory object */
+      goto hit; /* This is a in memory object */
     } else {
       int ret = a->vfs.vfs_timestamp_is_current(
           a,filename,f->ts,a->vfs_udata);
       if(ret <0) {
+        ajj_unpin_template(a,f->tmpl);
         return NULL; /* failed */
       } else if(ret) {
         /* Hit the cache, so just return this template */
-        return f->tmpl;
+        goto hit;
       } else {
         ts = f->ts;
+        has_ts = 1;
+        ajj_unpin_template(a,f->tmpl);
       }
     }
   }
+  reader_count(a,miss);
 
   /* Either we don't have such file parsed or the timestamp
    * is outdated, so we need to load the whole file into the
-   * memory */
-  src = a->vfs.vfs_load(a,filename,&len, f ? &ts : NULL,a->vfs_udata);
-
-  if(!f) {
-    /* In this case , since we don't know the ts, we do
-     * an extra call to retreieve the timestamp */
-    int ret = a->vfs.vfs_timestamp(a,filename,&ts,a->vfs_udata);
-    if(ret) {
-      /* Failed here */
-      free((void*)src);
-      return NULL;
-    }
-  }
+   * memory. The compilation happens without holding the lock */
+  src = load_template(a,filename,&len,&ts,has_ts);
+  if(!src) return NULL;
+  return compile_and_publish(a,filename,src,TMPL_SRC_VFS,ts);
+
+hit:
+  reader_count(a,hit);
+  template_mark(f);
+  return f->tmpl;
+}
+
+/* Template that fails for parsing or optimization is released right
+ * away. The template that fails for rendering is still kept inside
+ * of the template cache since it may work with another model. User
+ * could bound the memory used by cached templates with function
+ * ajj_cache_set_limit */
+
+void ajj_vfs_free( struct ajj* a , const char* src , size_t len ) {
+  if(a->vfs.vfs_free)
+    a->vfs.vfs_free(a,(void*)src,len,a->vfs_udata);
+  else
+    free((void*)src);
+}
 
-  if(!src) {
-    ajj_error(a,"Cannot load file with name:%s!",filename);
-    return NULL;
-  } else {
+void ajj_set_budget( struct ajj* a , size_t step , size_t msec ) {
+  a->step_limit = step;
+  a->time_limit = msec;
+}
 
-#ifdef DISABLE_OPTIMIZATION
-    /* During debugging phase we may not want to switch optimization
-     * on for debugging purpose */
-    return parse(a,filename,src,1,ts);
-#else
-    struct ajj_object* ret;
-    ret = parse(a,filename,src,1,ts);
-    if(!ret) return NULL;
-    if(optimize(a,ret)) return NULL;
-    return ret;
-#endif
-  }
+void ajj_set_autoescape( struct ajj* a , int mode ) {
+  assert( mode == AJJ_ESCAPE_NONE || mode == AJJ_ESCAPE_HTML );
+  a->autoescape = mode;
 }
 
-/* Currently this function is not *safe* in terms of memory since
- * we put all jinja template related memory inside of our global
- * gc scope. If a template fails for rendering , it will be delayed
- * until user try to destroy ajj engine pointer. Suppose we have many
- * jinja template that is malformed or runtime error, then we will
- * end up with no memory ... To solve this problem, we need a major
- * change to our jinja template which I would like a  per template
- * per gc-scope style */
+int ajj_add_template( struct ajj* a , const char* name ,
+    const char* src ) {
+  struct ajj_object* jinja = compile_and_publish(a,name,src,
+      TMPL_SRC_COPY,0);
+  if(!jinja) return -1;
+  ajj_unpin_template(a,jinja);
+  return 0;
+}
 
 int ajj_render_file( struct ajj* a,
     struct ajj_io* output,
     const char* file ,
     void* udata) {
   struct ajj_object* jinja = ajj_parse_template(a,file);
+  int ret;
   if(!jinja) return -1;
-  return vm_run_jinja(a,jinja,output,udata);
+  ret = vm_run_jinja(a,jinja,output,udata);
+  ajj_unpin_template(a,jinja);
+  return ret;
+}
+
+/* Parallel batch rendering. The iterator is shared by all the workers
+ * and it is protected by the lock */
+struct batch_job {
+  ajj_batch_next next;
+  ajj_batch_done done;
+  void* data;
+  mutex_t lock;
+};
+
+struct batch_worker {
+  struct batch_job* job;
+  struct ajj* a; /* forked engine */
+  struct ajj_object* jinja;
+  thread_t tid;
+  int fail;
+};
+
+static
+int batch_next( void* data , struct ajj_io** output , void** udata ) {
+  struct batch_job* job = (struct batch_job*)data;
+  int ret;
+  mutex_lock(&(job->lock));
+  ret = job->next(job->data,output,udata);
+  mutex_unlock(&(job->lock));
+  return ret;
+}
+
+static
+void batch_done( struct ajj* a , void* data , void* udata , int ret ) {
+  struct batch_job* job = (struct batch_job*)data;
+  if(job->done) job->done(a,job->data,udata,ret);
+}
+
+static
+void* batch_worker_main( void* arg ) {
+  struct batch_worker* w = (struct batch_worker*)arg;
+  w->fail = vm_run_jinja_batch(w->a,w->jinja,batch_next,batch_done,w->job);
+  return NULL;
+}
+
+int ajj_render_batch( struct ajj* a , const char* file ,
+    ajj_batch_next next , ajj_batch_done done , void* data ,
+    size_t nthread ) {
+  struct batch_job job;
+  struct batch_worker* w;
+  struct ajj_object* jinja = ajj_parse_template(a,file);
+  size_t i;
+  size_t spawn;
+  int ret = 0;
+  if(!jinja) return -1;
+
+  if( nthread == 0 ) {
+    long n = thread_cpu_count();
+    nthread = n <= 0 ? 1 : (size_t)n;
+  }
+  if( nthread == 1 ) {
+    ret = vm_run_jinja_batch(a,jinja,next,done,data);
+    ajj_unpin_template(a,jinja);
+    return ret;
+  }
+
+  job.next = next;
+  job.done = done;
+  job.data = data;
+  mutex_init(&(job.lock));
+  w = malloc(sizeof(*w)*nthread);
+  for( i = 0 ; i < nthread ; ++i ) {
+    w[i].job = &job;
+    w[i].a = ajj_fork(a);
+    w[i].a->inc_pool = a->inc_pool;
+    w[i].jinja = jinja;
+    w[i].fail = 0;
+  }
+  for( spawn = 0 ; spawn < nthread ; ++spawn ) {
+    if(thread_create(&(w[spawn].tid),batch_worker_main,w+spawn))
+      break;
+  }
+  /* if we cannot spawn enough threads, the rest of work is done
+   * inside of the calling thread */
+  if( spawn < nthread ) batch_worker_main(w+spawn);
+  for( i = 0 ; i < spawn ; ++i ) {
+    thread_join(w[i].tid);
+  }
+  for( i = 0 ; i < nthread ; ++i ) {
+    if(w[i].fail && !ret) {
+      memcpy(ajj_err_buf(a),w[i].a->err,ERROR_BUFFER_SIZE);
+      ret = -1;
+    }
+    ajj_destroy(w[i].a);
+  }
+  free(w);
+  mutex_destroy(&(job.lock));
+  ajj_unpin_template(a,jinja);
+  return ret;
 }
 
 int ajj_render_data( struct ajj* a,
@@ -1273,7 +2896,43 @@ int ajj_render_data( struct ajj* a,
     const char* src,
     const char* key,
     void* udata ) {
-  struct ajj_object* jinja = parse(a,key,src,0,0);
-  if(!jinja) return -1;
-  return vm_run_jinja(a,jinja,output,udata);
+  struct ajj* s = a->store;
+  size_t len = strlen(src);
+  unsigned int h = data_hash(src,len);
+  struct tmpl_index* idx;
+  struct jj_file* f;
+  struct ajj_object* jinja;
+  int ret;
+
+  /* The compiled template is found by the hash of its source through
+   * the lock free snapshot , the key only names it. It is kept apart
+   * from the templates registered by name , so it never replaces one */
+  ajj_pin_template(a,NULL);
+  idx = atomic_load(&(s->cache.index));
+  f = idx ? index_find_data(idx,src,len,h) : NULL;
+  if(f) {
+    reader_count(a,hit);
+    template_mark(f);
+    jinja = f->tmpl;
+  } else {
+    struct ajj* ctx;
+    ajj_unpin_template(a,NULL);
+    reader_count(a,miss);
+    ctx = compile_ctx_create(a);
+    jinja = compile_template(ctx,key,src,TMPL_SRC_COPY,0);
+    if(!jinja) {
+      memcpy(ajj_err_buf(a),ctx->err,ERROR_BUFFER_SIZE);
+      compile_ctx_free(ctx);
+      return -1;
+    }
+    f = jj_file_of(jinja);
+    f->key = h;
+    f->data_len = len;
+    /* user hands us the source on each call , so it can be evicted */
+    f->fixed = 0;
+    jinja = publish_data(a,ctx,jinja);
+  }
+  ret = vm_run_jinja(a,jinja,output,udata);
+  ajj_unpin_template(a,jinja);
+  return ret;
 }
@@ -1,6 +1,7 @@
 #ifndef _AJJ_H_
 #define _AJJ_H_
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <assert.h>
 #include <stdarg.h>
@@ -10,12 +11,18 @@ struct ajj;
 struct ajj_value;
 struct ajj_object;
 struct ajj_io;
+struct ajj_load;
 
 /* Status code indicate whether the user defined function
  * works correctly or not. Extra error information may be
  * provided by using ajj_error */
 #define AJJ_EXEC_OK   0
 #define AJJ_EXEC_FAIL -1
+/* The function cannot make progress now , ( e.g. waiting for a slow
+ * data source ). The rendering is suspended and the function is called
+ * again with the same arguments once the rendering is resumed. Only
+ * allowed inside of a resumable rendering , see ajj_render_create */
+#define AJJ_EXEC_SUSPEND 2
 
 /* Signature represent a global function call .
  * Arg1: ajj engine pointer
@@ -169,6 +176,14 @@ struct ajj_slot {
       const struct ajj_value* , int* );
   int (*ge)(struct ajj* , const struct ajj_value* ,
       const struct ajj_value* , int* );
+
+  /* Streaming form of display. The representation is written into the
+   * IO object directly , so the print instruction allocates and copies
+   * nothing. Returns 0 on success and -1 if the output fails. If an
+   * object only provides this one , ajj_display builds the string from
+   * it. It is the last slot so the existing class tables still work */
+  int (*display_io)(struct ajj* , const struct ajj_value* ,
+      struct ajj_io* );
 };
 
 /* =============================================================
@@ -271,6 +286,11 @@ struct ajj_value ajj_value_new_string( struct ajj* , const char* , size_t );
  * string means the string is not garbage collected by VM */
 struct ajj_value ajj_value_new_const_string( struct ajj* , const char* ,size_t );
 
+/* Mark a string the host just created as safe , it is printed as it is
+ * even if autoescape is on. Use it for text that is already escaped.
+ * Non string values are not touched */
+void ajj_value_mark_safe( struct ajj_value* );
+
 /* Convert a ajj_value to its corresponding boolean value.
  * The ajj_value must be boolean type */
 #define ajj_value_to_boolean(V) ((V)->value.boolean)
@@ -354,6 +374,12 @@ int ajj_value_attr_push( struct ajj* , struct ajj_value* ,
 const char* ajj_display( struct ajj* , const struct ajj_value* ,
     size_t* , int* );
 
+/* Write the representation of a value into an IO object , the same
+ * text as ajj_display without the temporary string. Returns 0 on
+ * success and -1 if the output fails */
+int ajj_display_io( struct ajj* , const struct ajj_value* ,
+    struct ajj_io* );
+
 struct ajj_value ajj_value_move( struct ajj* , const struct ajj_value* ,
     struct ajj_value* );
 
@@ -432,16 +458,82 @@ struct ajj_vfs {
   /* Function to check whether this timestamp is the latest one ,
    * returns -1 means fail, returns 0 means false, otherwise returns 1*/
   int (*vfs_timestamp_is_current)( struct ajj* , const char* , time_t , void* );
+
+  /* Function to release the memory returned by vfs_load. The second
+   * argument is the memory and the third argument is the length of the
+   * null terminated content. If it is NULL, the memory is released by
+   * free , this allows the loader to return memory that is not from
+   * malloc , like a file mapping */
+  void (*vfs_free)( struct ajj* , void* , size_t , void* );
+
+  /* Optional function that starts loading the file asynchronously. It
+   * is only used inside of a resumable rendering ( see
+   * ajj_render_create ) , vfs_load is still used by the others. The
+   * second argument is the name of the file and the third one is the
+   * handle of the pending load. Returns -1 if the load cannot be
+   * started , otherwise the rendering is parked until the vfs calls
+   * ajj_load_finish with the handle , from any thread */
+  int (*vfs_load_async)( struct ajj* , const char* , struct ajj_load* ,
+      void* );
 };
 
+/* Deliver the result of an asynchronous load. The memory follows the
+ * same rules as the one returned by vfs_load , NULL means the file
+ * cannot be loaded. The last argument is the timestamp of the file. The
+ * handle must not be used after this call. The engine must still be
+ * alive , the content of a load whose rendering has been freed is
+ * released by vfs_free */
+void ajj_load_finish( struct ajj_load* , void* , size_t , time_t );
+
+/* User data of the rendering that waits for the load , it can be used
+ * to find the rendering to resume once the load is finished */
+void* ajj_load_get_udata( struct ajj_load* );
+
+/* Default file system, file is read into a malloc-ed buffer */
 extern struct ajj_vfs AJJ_DEFAULT_VFS;
 
+/* File system that maps the template file read only into memory
+ * instead of copying it. Processes that render same templates share
+ * the page cache. File that cannot be mapped is read as default file
+ * system does */
+extern struct ajj_vfs AJJ_MMAP_VFS;
+
+/* Template bundle. A bundle is a single read only file that packs many
+ * templates together with an index , it is mapped into memory once and
+ * all the templates are served from the mapping. To use it, pass the
+ * AJJ_BUNDLE_VFS and the bundle pointer as vfs udata to ajj_create. The
+ * bundle must outlive all the ajj engines that use it */
+struct ajj_bundle;
+
+extern struct ajj_vfs AJJ_BUNDLE_VFS;
+
+/* Create a bundle file from a list of template files, the template is
+ * named by the path in the list. Returns -1 if any file cannot be read
+ * or the name is duplicated */
+int ajj_bundle_create( const char* , const char** , size_t );
+
+/* Open a bundle file , returns NULL if it is not a valid bundle */
+struct ajj_bundle* ajj_bundle_open( const char* );
+
+/* Close a bundle */
+void ajj_bundle_close( struct ajj_bundle* );
+
 /* Create an ajj engine. Before rendering any templates, a ajj
  * engine pointer must be created and it serves as the environment
  * and resource holder for all the template rendering happened inside
  * of it . User should never mix different ajj engine pointer togeteher */
 struct ajj* ajj_create( struct ajj_vfs* , void* );
 
+/* Fork an ajj engine for another thread. The forked engine shares the
+ * compiled templates , vfs and the environment of its parent but has
+ * its own runtime , so the parent and each fork can render concurrently
+ * as long as every engine is used by one thread at a time. The parent's
+ * environment can be changed at any time , a fork picks the change up
+ * when its next rendering starts. Names added to a fork's environment
+ * shadow the parent's ones and are only visible to that fork.
+ * All the forks must be destroyed before destroying the parent */
+struct ajj* ajj_fork( struct ajj* );
+
 /* Destroy an ajj engine pointer */
 void ajj_destroy( struct ajj* );
 
@@ -457,7 +549,15 @@ void ajj_error ( struct ajj* , const char* , ... );
 const char* ajj_last_error( struct ajj* );
 
 /* Add a value into the ajj environment. The environment is *SHARED* by
- * all the template rendered inside of the same ajj engine */
+ * all the template rendered inside of the same ajj engine.
+ *
+ * Each rendering works on a snapshot of the environment taken when it
+ * starts , changes made later ( add , del or clear ) , either by a host
+ * function or while a resumable rendering is suspended , are only seen
+ * by the renderings started afterwards. The snapshot is copy on write ,
+ * so taking it costs nothing and a change publishes the touched name on
+ * top of the previous snapshot , those layers are folded together now
+ * and then. Removing a name for good copies the whole environment */
 void ajj_env_add_value( struct ajj* , const char* , int , ... );
 
 /* Add a class into ajj environment */
@@ -479,9 +579,8 @@ void ajj_env_add_test( struct ajj* , const char* , ajj_function entry,
 /* Check whether a name is existed inside of ajj environment */
 int ajj_env_has( struct ajj* , const char* );
 
-/* Delete a name from ajj environment. This is *NOT* for deleting
- * an class or function during the template is executing. If calling
- * this function during template rendering, the behavior is undefined */
+/* Delete a name from ajj environment. The renderings already running
+ * keep seeing the name , see ajj_env_add_value */
 int ajj_env_del( struct ajj* , const char* );
 
 /* ==============================================================
@@ -511,7 +610,8 @@ void ajj_upvalue_del( struct ajj* , const char* );
 /* Check whether a name inside of upvalue table is existed or not */
 int ajj_upvalue_has( struct ajj* , const char* );
 
-/* Clear the *all* the environment variables */
+/* Clear the *all* the environment variables , the renderings already
+ * running keep their snapshot */
 void ajj_env_clear( struct ajj* );
 
 /* =============================================================
@@ -520,19 +620,160 @@ void ajj_env_clear( struct ajj* );
 
 /* This function will retrieve the opaque pointer user sets when calls
  * the ajj_render_XXX function . So it is only available during the
- * execution of the template scripts */
+ * execution of the template scripts. Same as ajj_context_get_udata with
+ * the context of the running rendering */
 void* ajj_runtime_get_udata( struct ajj* );
 
+/* Each rendering has its own context which keeps its user data and its
+ * error , the includes and extends share the context of the including
+ * template. A host function gets the context of the rendering that
+ * invokes it with ajj_get_context , NULL is returned when the engine is
+ * not rendering. The context stays the same during the whole call even
+ * if the function suspends ( see ajj_suspend ) or renders another
+ * template with the same engine , so the function should fetch it once
+ * and use it afterwards. ajj_error and ajj_last_error work on the
+ * context of the running rendering , or on the engine outside of any
+ * rendering. The error of a failed rendering is copied to whoever
+ * starts it */
+struct ajj_context;
+
+struct ajj_context* ajj_get_context( struct ajj* );
+
+/* Engine that runs the rendering */
+struct ajj* ajj_context_get_engine( struct ajj_context* );
+
+/* Opaque pointer passed to the ajj_render_XXX function */
+void* ajj_context_get_udata( struct ajj_context* );
+
+/* Report error of the rendering */
+void ajj_context_error( struct ajj_context* , const char* , ... );
+
+/* Get the error of the rendering */
+const char* ajj_context_last_error( struct ajj_context* );
+
 /* =============================================================
  * IO object for holding the rendering output
  * ===========================================================*/
 
+/* A chunk of output for gathering write */
+struct ajj_iovec {
+  const void* base;
+  size_t len;
+};
+
+/* User supplied output sink. Output is handed to the sink directly ,
+ * so it can go into the buffers of a server or a socket without being
+ * copied into an intermediate buffer. The first argument of each
+ * callback is the opaque pointer passed to ajj_io_create_sink. Except
+ * sink_write , all the callbacks are optional and can be NULL. Each
+ * callback returns 0 on success and -1 on failure , once a callback
+ * fails , the IO object stays failed and the rendering fails */
+struct ajj_io_sink {
+  /* Write all the bytes */
+  int (*sink_write)( void* , const void* , size_t );
+
+  /* Write the chunks in order , sink_write is called for each chunk
+   * if it is not provided */
+  int (*sink_writev)( void* , const struct ajj_iovec* , size_t );
+
+  /* Push out the bytes buffered by the sink , returns AJJ_IO_BUSY if
+   * the bytes cannot go out for now */
+  int (*sink_flush)( void* );
+
+  /* Get a writable region with at least the requested size , whose size
+   * is stored in the last argument. Formatted output is written into it
+   * directly. Returns NULL if the sink has no such region for now. Must
+   * be provided with sink_commit */
+  void* (*sink_reserve)( void* , size_t , size_t* );
+
+  /* Commit the leading bytes of the region returned by sink_reserve */
+  int (*sink_commit)( void* , size_t );
+};
+
+/* Returned by a stream consumer that cannot take more output for now */
+#define AJJ_IO_BUSY 1
+
+/* Consumer of a stream IO , gets the output chunk by chunk. Returns 0
+ * if the chunk is taken , AJJ_IO_BUSY to push back and -1 to fail */
+typedef int (*ajj_stream_callback)( void* , const void* , size_t );
+
 /* Create an IO from an existed FILE* structure */
 struct ajj_io* ajj_io_create_file( struct ajj* , FILE* );
 
 /* Create an IO from memory with size */
 struct ajj_io* ajj_io_create_mem ( struct ajj* , size_t );
 
+/* Create an IO on top of a file descriptor. The output is buffered by
+ * the IO object in an aligned buffer with the given capacity ( 0 for
+ * the default one ) and written with write/writev once the buffered
+ * bytes reach the high water mark ( 0 means the buffer is full ). A
+ * small high water mark streams the page to the client while it is
+ * rendered. Destroying the IO writes out the buffered bytes but does
+ * not close the descriptor , which must be a blocking one */
+struct ajj_io* ajj_io_create_fd( struct ajj* , int , size_t , size_t );
+
+/* Create a stream IO. The output is handed to the consumer in chunks
+ * of the given size , a smaller chunk is only sent when the IO is
+ * flushed , either by ajj_io_flush or by {% flush %} inside of the
+ * template , so the head of a page can go out before its slow parts
+ * are rendered. When the consumer pushes back , the resumable rendering
+ * ( see ajj_render_create ) writing to the stream is suspended and retries the
+ * chunk once it is resumed , whichever engine or pool worker runs it ;
+ * otherwise the output is kept and sent with the next chunk. A chunk
+ * never exceeds the given size , kept output goes out as several chunks.
+ * After the rendering , ajj_io_flush sends the rest and returns
+ * AJJ_IO_BUSY while the consumer keeps pushing back. Output still held
+ * by the IO is dropped when it is destroyed */
+struct ajj_io* ajj_io_create_stream( struct ajj* , size_t ,
+    ajj_stream_callback , void* );
+
+/* Compressed formats of ajj_io_create_deflate */
+enum {
+  AJJ_DEFLATE_GZIP,
+  AJJ_DEFLATE_ZLIB
+};
+
+/* Create an IO that compresses the output with deflate and writes the
+ * compressed bytes into another IO , in the gzip ( RFC 1952 ) or the
+ * zlib ( RFC 1950 ) format , so the page is compressed while it is
+ * rendered. Flushing the IO , by ajj_io_flush or {% flush %} , ends
+ * the pending data with a sync point so the client can decode all of
+ * it , and then flushes the other IO. Destroying the IO finishes the
+ * stream but does not destroy the other IO , which must outlive it */
+struct ajj_io* ajj_io_create_deflate( struct ajj* , struct ajj_io* ,
+    int );
+
+/* Create an IO that forwards all the output to each of the given IO
+ * in order , so one rendering is written to the client , a cache and
+ * a hash at once. Flushing it flushes every child and returns
+ * AJJ_IO_BUSY if any of them is busy. The array is copied but the
+ * children are not destroyed with it and must outlive it */
+struct ajj_io* ajj_io_create_tee( struct ajj* , struct ajj_io** ,
+    size_t );
+
+/* Create an IO that hashes the output with the 64 bits XXH64 ( seed
+ * 0 ) and drops it , usually a child of a tee IO to key a cache or
+ * build an ETag without a second pass over the page */
+struct ajj_io* ajj_io_create_hash( struct ajj* );
+
+/* Get the hash of all the output written into a hash IO so far ,
+ * returns -1 if the IO is not a hash IO */
+int ajj_io_get_hash( struct ajj_io* , uint64_t* );
+
+/* Create an IO on top of a user sink , the sink structure is copied */
+struct ajj_io* ajj_io_create_sink( struct ajj* ,
+    const struct ajj_io_sink* , void* );
+
+/* Turn on gathering for a sink based IO with a scratch buffer of the
+ * given size , 0 turns it off. Static text of the templates is not
+ * copied but referenced , only the dynamic output is copied into the
+ * scratch buffer. The references are handed to sink_writev as a list
+ * of chunks once the list or the scratch buffer is full , when the
+ * rendering is done and before any other output. So a mostly static
+ * page is written with very little copy. Returns -1 if the IO is not
+ * sink based */
+int ajj_io_set_gather( struct ajj_io* , size_t );
+
 /* Destroy an IO object , this won't result in the FILE* handler been
  * closed, user needs to call fclose on the handler if the ajj_io object
  * is a file handler IO object */
@@ -544,11 +785,15 @@ int ajj_io_printf( struct ajj_io* , const char* , ... );
 /* va_list based printf to an IO object */
 int ajj_io_vprintf( struct ajj_io* , const char* , va_list );
 
-/* write to IO object with memory */
+/* write to IO object with memory , returns the size written or -1 */
 int ajj_io_write( struct ajj_io* , const void* , size_t );
 
-/* flush IO object */
-void ajj_io_flush( struct ajj_io* );
+/* write chunks to IO object , returns the size written or -1 */
+int ajj_io_writev( struct ajj_io* , const struct ajj_iovec* , size_t );
+
+/* flush IO object , returns 0 on success , -1 on failure and AJJ_IO_BUSY
+ * if the output cannot go out for now */
+int ajj_io_flush( struct ajj_io* );
 
 /* Get intenral content. Only works with memory based IO */
 void* ajj_io_get_content( struct ajj_io* , size_t* );
@@ -567,8 +812,228 @@ void* ajj_io_detach( struct ajj_io* , size_t* );
 int ajj_render_file( struct ajj* , struct ajj_io*, const char* , void* );
 
 /* Render a in memory data into an IO object. The content must be UTF
- * encoded */
+ * encoded. The compiled template is cached by the hash of its source and
+ * is reused by any following call passing in the same source , the key
+ * only names the template in error messages. Cached data never replaces
+ * or hides a template registered or loaded with the same name , and it
+ * can be evicted under the cache limit */
 int ajj_render_data( struct ajj* , struct ajj_io*, const char* , const char* ,
     void* );
 
+/* Iterator of a batch rendering. It fills in the IO object and the user
+ * data ( the model ) of the next item and returns 1 , or returns 0 once
+ * there are no more items. Calls to the iterator are serialized even if
+ * the batch is rendered by multiple threads */
+typedef int (*ajj_batch_next)( void* , struct ajj_io** , void** );
+
+/* Callback invoked once an item of a batch rendering is done. Arguments
+ * are the engine that renders the item , the pointer passed to
+ * ajj_render_batch , the user data of the item and the result of the
+ * rendering. It is called from the rendering thread */
+typedef void (*ajj_batch_done)( struct ajj* , void* , void* , int );
+
+/* Render a template file once for every item returned by the iterator.
+ * The template is resolved once and the runtime , value stack and gc
+ * scopes are reused across items , so the per item cost is close to the
+ * cost of the template itself. The last argument is the number of
+ * threads , 0 means one thread per processor. When more than one thread
+ * is used , each thread renders with an engine forked from the given one
+ * ( see ajj_fork ). Includes of every item go to the include pool of
+ * the given engine if it has one ( see ajj_set_include_pool ) , for the
+ * forked engines as well. The callback is optional. Returns -1 if the
+ * template cannot be loaded or any item fails , the error of a failed
+ * item is kept in the engine */
+int ajj_render_batch( struct ajj* , const char* , ajj_batch_next ,
+    ajj_batch_done , void* , size_t );
+
+/* Limit the cost of every rendering of the engine : the number of VM
+ * instructions and the wall clock time in milliseconds , 0 means
+ * unlimited. They are checked at loop jumps and calls and includes share
+ * the budget of the including template. A rendering that runs out of
+ * budget fails , except that a resumable rendering ( see
+ * ajj_render_create ) is suspended when it uses up its instructions and
+ * gets a new budget once it is resumed , so long renderings take turns
+ * with others. Forked engines inherit the budget */
+void ajj_set_budget( struct ajj* , size_t , size_t );
+
+/* Autoescape mode */
+enum {
+  AJJ_ESCAPE_NONE,
+  AJJ_ESCAPE_HTML
+};
+
+/* Escape the output of every {{ expression }} in the templates compiled
+ * from now on , like Jinja2's autoescape. The characters & < > " ' are
+ * replaced with HTML entities , template text and strings passed
+ * through the safe filter are printed as they are. Concatenating a safe
+ * string with ~ or + escapes the other side and the result stays safe ,
+ * as Jinja2's Markup does. The mode is decided
+ * when a template is compiled , a template can still switch it for a
+ * part of itself with {% autoescape true/false %}. Compiled templates
+ * are shared with the forked engines , which inherit the mode , so set
+ * it before forking and rendering */
+void ajj_set_autoescape( struct ajj* , int );
+
+/* Register an in memory template with the given name. The source is
+ * copied and compiled only once, after registration the template can
+ * be rendered with ajj_render_file or used by include/import/extends
+ * with its name. Registering a template with existed name replaces it.
+ * Returns -1 if the template cannot be compiled */
+int ajj_add_template( struct ajj* , const char* , const char* );
+
+/* ===============================================================
+ * Template cache
+ * =============================================================*/
+
+/* Every template loaded by the ajj engine is kept in a template cache
+ * to avoid parsing it multiple times. By default the cache is unbounded,
+ * user could set a memory budget for it and then the least recently used
+ * templates will be evicted once the cached templates occupy more memory
+ * than the budget. Templates that are being used by a rendering and
+ * templates registered by ajj_add_template are never evicted */
+struct ajj_cache_stat {
+  size_t hit;   /* number of lookups served from the cache */
+  size_t miss;  /* number of lookups that need loading template */
+  size_t evict; /* number of templates evicted */
+  size_t size;  /* number of templates inside of the cache */
+  size_t mem;   /* approximate memory occupied by the cached templates */
+  size_t limit; /* memory budget , 0 means unbounded */
+};
+
+/* Set the memory budget in bytes for the template cache , 0 means
+ * unbounded */
+void ajj_cache_set_limit( struct ajj* , size_t );
+
+/* Get the statistics of the template cache */
+void ajj_cache_get_stat( struct ajj* , struct ajj_cache_stat* );
+
+/* Compile a list of template files in parallel and put them into the
+ * template cache. The last argument is the number of threads , 0 means
+ * one thread per processor. The compiled templates are published only
+ * if all of them compile successfully, otherwise nothing is changed and
+ * -1 is returned. The user provided vfs must be thread safe since it is
+ * invoked from multiple threads */
+int ajj_compile_all( struct ajj* , const char** , size_t , size_t );
+
+/* Compile all the files under a directory ( recursively ) in parallel.
+ * Same as ajj_compile_all except the list of files is collected from
+ * the directory */
+int ajj_compile_dir( struct ajj* , const char* , size_t );
+
+/* ===============================================================
+ * Render worker pool
+ * =============================================================*/
+
+/* A pool runs render jobs on a fixed number of worker threads. Each
+ * worker renders with its own engine forked from the engine passed to
+ * ajj_pool_create ( see ajj_fork ) , so the same rules apply : the
+ * engine must not be destroyed while the pool is alive and the vfs
+ * must be thread safe. Changes to the environment of that engine are
+ * seen by the jobs that start afterwards */
+struct ajj_pool;
+struct ajj_job;
+
+/* Callback invoked by the worker thread once a job is rendered. The
+ * first argument is the worker's engine which can be used to retrieve
+ * the error message , the second one is the result of the rendering */
+typedef void (*ajj_job_callback)( struct ajj* , int , void* );
+
+/* Create a pool with the number of threads , 0 means one thread per
+ * processor. Returns NULL if no thread can be created */
+struct ajj_pool* ajj_pool_create( struct ajj* , size_t );
+
+/* Wait for all the submitted jobs to be done and destroy the pool.
+ * All the job handles must be freed before destroying the pool */
+void ajj_pool_destroy( struct ajj_pool* );
+
+/* Number of running worker threads */
+size_t ajj_pool_size( struct ajj_pool* );
+
+/* Submit a job that renders the template file into the IO object , the
+ * user data is retrieved by ajj_runtime_get_udata during rendering. The
+ * IO object must not be touched until the job is done. Callback is
+ * optional. It is safe to submit jobs from multiple threads. Returns a
+ * handle of the job which must be freed by ajj_job_free */
+struct ajj_job* ajj_pool_submit( struct ajj_pool* , struct ajj_io* ,
+    const char* , void* , ajj_job_callback , void* );
+
+/* Poll whether the job is done , returns 1 if it is done */
+int ajj_job_done( struct ajj_job* );
+
+/* Wait until the job is done and return the result of the rendering */
+int ajj_job_wait( struct ajj_job* );
+
+/* Wait until the job is done and return the error message if the job
+ * fails , otherwise NULL is returned */
+const char* ajj_job_error( struct ajj_job* );
+
+/* Free the handle of a job. If the job is not done yet , it is released
+ * once it is done , so a job can be fired and forgotten */
+void ajj_job_free( struct ajj_job* );
+
+/* Render includes in parallel with the pool , NULL turns it off. Once
+ * it is set , an include without any context ( {% include name %} )
+ * is rendered by the pool into a private buffer while the engine keeps
+ * rendering the rest of the template , and the outputs are stitched in
+ * source order after the whole template is rendered. The output before
+ * the first such include is still written as it is rendered , the rest
+ * is only written when the rendering finishes. Such an include only sees
+ * the environment snapshot and the user data of the including rendering
+ * , so it must not rely on the side effects of the including template.
+ * Its instructions are charged to what is left of the budget of the
+ * including rendering. The items of ajj_render_batch use the pool of the
+ * given engine the same way. The pool should be created from the same
+ * engine ( or its parent ) so the templates are shared , and it must be
+ * alive as long as it is set */
+void ajj_set_include_pool( struct ajj* , struct ajj_pool* );
+
+/* ===============================================================
+ * Resumable rendering
+ * =============================================================*/
+
+/* A resumable rendering can be suspended by a host function and resumed
+ * later , so a few threads can serve lots of renderings that wait for
+ * slow data sources without blocking. Renderings of the same engine
+ * can be interleaved , but an engine is still used by one thread at a
+ * time.
+ *
+ * Each of them runs on its own stack : AJJ_RENDER_STACK_SIZE ( 2MB ) plus
+ * a guard page is mapped per rendering until it is freed. It is address
+ * space , only the pages the rendering touches are committed , the
+ * deepest include/call nesting takes a few hundred KB. Keep it in mind
+ * when lots of renderings are parked on a 32 bits host. The stack
+ * switch uses ucontext , a libc without it ( e.g. musl ) cannot build
+ * resumable renderings */
+struct ajj_render;
+
+/* Returned by ajj_render_resume when the rendering is suspended */
+#define AJJ_RENDER_PENDING 1
+
+/* Create a resumable rendering of the template file into the IO object.
+ * Nothing is executed until ajj_render_resume is called. The IO object
+ * must not be touched until the rendering is done */
+struct ajj_render* ajj_render_create( struct ajj* , struct ajj_io* ,
+    const char* , void* );
+
+/* Run the rendering until it is suspended or done. Returns
+ * AJJ_RENDER_PENDING if it is suspended , otherwise the result of the
+ * rendering ( 0 or -1 ) */
+int ajj_render_resume( struct ajj_render* );
+
+/* Suspend the current resumable rendering from a host function , it
+ * returns once the rendering is resumed. Returns -1 if it is not
+ * called inside of a resumable rendering or the rendering is cancelled ,
+ * then the host function should fail */
+int ajj_suspend( struct ajj* );
+
+/* Returns 1 if the rendering is done */
+int ajj_render_done( struct ajj_render* );
+
+/* Error message if the rendering is done and failed , otherwise NULL */
+const char* ajj_render_error( struct ajj_render* );
+
+/* Free the rendering. A suspended rendering is cancelled : it is resumed
+ * and every ajj_suspend fails until it unwinds */
+void ajj_render_free( struct ajj_render* );
+
 #endif /* _AJJ_H_ */
@@ -1,3 +1,10 @@
+/* ucontext of the resumable rendering is only declared with it on OSX ,
+ * and the BSD extensions are kept visible */
+#if defined __APPLE__ && !defined _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+#define _DARWIN_C_SOURCE
+#endif
+
 #include "ajj.c"
 #include "object.c"
 #include "lex.c"
@@ -9,10 +16,17 @@
 #include "bc.c"
 #include "utf.c"
 #include "util.c"
+#include "escape.c"
+#include "deflate.c"
+#include "tee.c"
 #include "builtin.c"
+#include "pool.c"
 
 #if defined __APPLE__ || defined __linux__
 #include "unix-vfs.c"
+#include "bundle.c"
+#include "unix-io.c"
+#include "render.c"
 #else
 #error "Doesn't support this platform ???"
 #endif /* __linux__  || __OSX__ */
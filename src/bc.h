@@ -100,6 +100,9 @@ extern struct string LOOP;
   X(VM_RET,0,"ret") \
   X(VM_BCALL,2,"bcall") \
   X(VM_PRINT,0,"print") \
+  X(VM_PSTR,1,"pstr") \
+  X(VM_FLUSH,0,"flush") \
+  X(VM_EPRINT,0,"eprint") \
   X(VM_POP,1,"pop") \
   X(VM_TPUSH,1,"tpush") \
   X(VM_BPUSH,1,"bpush") \
@@ -28,7 +28,7 @@
 
 #define IS_A(val,T)  \
   (((val)->type == AJJ_VALUE_OBJECT) && \
-   ((val)->value.object->tp = T))
+   ((val)->value.object->tp == T))
 
 #define OBJECT(V) ((V)->value.object->val.obj.data)
 
@@ -312,31 +312,21 @@ void list_move( struct ajj* a, struct ajj_value* obj ) {
 }
 
 static
-const char*
-list_display( struct ajj* a ,
+int list_display_io( struct ajj* a ,
     const struct ajj_value* obj,
-    size_t* len ) {
+    struct ajj_io* output ) {
   struct list* lst;
   size_t i;
-  struct strbuf sbuf;
 
   assert( IS_A(obj,LIST_TYPE) );
   lst = LIST(obj);
-  strbuf_init(&sbuf);
   for( i = 0 ; i < lst->len ; ++i ) {
-    struct ajj_value* val = lst->entry + i;
-    int own;
-    size_t l;
-    const char* c;
-    c = ajj_display(a,val,&l,&own);
-    if(!c) continue; /* skip */
-    strbuf_append(&sbuf,c,l);
-    if(own) free((void*)c); /* free the memory */
-    if( i < lst->len-1 )
-      strbuf_append(&sbuf," ",1);
+    if(ajj_display_io(a,lst->entry+i,output))
+      return -1;
+    if( i < lst->len-1 && ajj_io_write(output," ",1) < 0 )
+      return -1;
   }
-  *len = sbuf.len;
-  return sbuf.str;
+  return 0;
 }
 
 /* comparison */
@@ -457,14 +447,15 @@ static struct ajj_class LIST_CLASS  = {
     list_attr_set,
     list_attr_push,
     list_move,
-    list_display,
+    NULL,
     list_in,
     list_eq,
     list_ne,
     NULL,
     NULL,
     NULL,
-    NULL
+    NULL,
+    list_display_io
   },
   NULL
 };
@@ -777,44 +768,29 @@ void dict_move( struct ajj* a, struct ajj_value* obj ) {
 }
 
 static
-const char*
-dict_display( struct ajj* a ,
+int dict_display_io( struct ajj* a ,
     const struct ajj_value* obj,
-    size_t* len ) {
-  struct strbuf sbuf;
+    struct ajj_io* output ) {
   size_t i;
   struct map* mp;
   int itr;
 
   assert( IS_A(obj,DICT_TYPE) );
-  strbuf_init(&sbuf);
   mp = DICT(obj);
 
   /* loop to dump all the content out */
   i = 0 ; itr = map_iter_start(mp);
   while( map_iter_has(mp,itr) ) {
     struct map_pair ret = map_iter_deref(mp,itr);
-    size_t l;
-    int own;
-    const char* c;
-
-    c = ajj_display(a,
-        (struct ajj_value*)(ret.val),&l,&own);
-    if(c) {
-      /* append key */
-      strbuf_append(&sbuf,ret.key->str,ret.key->len);
-      strbuf_append(&sbuf,"=",1);
-      strbuf_append(&sbuf,c,l);
-
-      if(own) free((void*)(c));
-      if( i < mp->len-1 ) {
-        strbuf_append(&sbuf,";",1);
-      }
-    }
+    if( ajj_io_write(output,ret.key->str,ret.key->len) < 0 ||
+        ajj_io_write(output,"=",1) < 0 ||
+        ajj_display_io(a,(struct ajj_value*)(ret.val),output) )
+      return -1;
+    if( i < mp->len-1 && ajj_io_write(output,";",1) < 0 )
+      return -1;
     ++i; itr = map_iter_move(mp,itr);
   }
-  *len = sbuf.len;
-  return sbuf.str;
+  return 0;
 }
 
 /* comparision */
@@ -976,14 +952,15 @@ static struct ajj_class DICT_CLASS = {
     dict_attr_set,
     NULL,
     dict_move,
-    dict_display,
+    NULL,
     dict_in,
     dict_eq,
     dict_ne,
     NULL,
     NULL,
     NULL,
-    NULL
+    NULL,
+    dict_display_io
   },
   NULL
 };
@@ -1090,16 +1067,13 @@ int xrange_empty( struct ajj* a ,
 }
 
 static
-const char*
-xrange_display( struct ajj* a ,
+int xrange_display_io( struct ajj* a ,
     const struct ajj_value* val,
-    size_t* len ) {
-  char buf[256];
+    struct ajj_io* output ) {
   UNUSE_ARG(a);
   assert( IS_A(val,XRANGE_TYPE) );
-  *len = (size_t)sprintf(buf,"xrange(" SIZEF ")",
-      SIZEP(XRANGE(val)->len));
-  return strdup(buf);
+  return ajj_io_printf(output,"xrange(" SIZEF ")",
+      SIZEP(XRANGE(val)->len)) < 0 ? -1 : 0;
 }
 
 /* comparison */
@@ -1148,14 +1122,15 @@ struct ajj_class XRANGE_CLASS = {
     NULL,
     NULL,
     NULL,
-    xrange_display,
+    NULL,
     NULL,
     xrange_eq,
     xrange_ne,
     xrange_lt,
     xrange_le,
     xrange_gt,
-    xrange_ge
+    xrange_ge,
+    xrange_display_io
   },
   NULL,
 };
@@ -1250,14 +1225,14 @@ struct ajj_value loop_attr_get( struct ajj* a,
   }
 }
 
-const char*
-loop_display( struct ajj* a, const struct ajj_value* obj,
-    size_t* len ) {
-  char buf[1024];
+static
+int loop_display_io( struct ajj* a, const struct ajj_value* obj,
+    struct ajj_io* output ) {
   struct loop* l;
+  UNUSE_ARG(a);
   assert(IS_A(obj,LOOP_TYPE));
   l = LOOP(obj);
-  *len = (size_t)sprintf(buf,"loop(index:"
+  return ajj_io_printf(output,"loop(index:"
       SIZEF
       ";index0:"
       SIZEF
@@ -1273,8 +1248,7 @@ loop_display( struct ajj* a, const struct ajj_value* obj,
       SIZEP(l->revindex0),
       l->first,
       l->last,
-      SIZEP(l->length));
-  return strdup(buf);
+      SIZEP(l->length)) < 0 ? -1 : 0;
 }
 
 void builtin_loop_move( struct ajj_value* loop ) {
@@ -1310,14 +1284,15 @@ struct ajj_class LOOP_CLASS = {
     NULL,
     NULL,
     NULL,
-    loop_display,
     NULL,
     NULL,
     NULL,
     NULL,
     NULL,
     NULL,
-    NULL
+    NULL,
+    NULL,
+    loop_display_io
   },
   NULL
 };
@@ -1457,22 +1432,19 @@ void cycler_move( struct ajj* a, struct ajj_value* obj ) {
 }
 
 static
-const char* cycler_display( struct ajj* a,
+int cycler_display_io( struct ajj* a,
     const struct ajj_value* obj ,
-    size_t* len ) {
-  char buf[1024];
+    struct ajj_io* output ) {
   struct cycler* c;
 
   UNUSE_ARG(a);
   assert( IS_A(obj,CYCLER_TYPE) );
   c = CYCLER(obj);
 
-  *len = (size_t)sprintf(buf,
+  return ajj_io_printf(output,
       "cycler(current:%d"
       ";length:" SIZEF
-      ")", c->cur,c->len);
-
-  return strdup(buf);
+      ")", c->cur,c->len) < 0 ? -1 : 0;
 }
 
 static
@@ -1500,14 +1472,15 @@ struct ajj_class CYCLER_CLASS = {
     NULL,
     NULL,
     cycler_move,
-    cycler_display,
     NULL,
     NULL,
     NULL,
     NULL,
     NULL,
     NULL,
-    NULL
+    NULL,
+    NULL,
+    cycler_display_io
   },
   NULL
 };
@@ -1861,8 +1834,8 @@ void json_report_error(struct ajj* a, struct json_lexer* jl,
   size_t start = jl->pos;
   size_t end = strlen(jl->pos+jl->src);
   char cbuf[ JSON_ERROR_CODE_SNIPPET_SIZE + 1 ];
-  char* buf = a->err;
-  char* bend= a->err + ERROR_BUFFER_SIZE;
+  char* buf = ajj_err_buf(a);
+  char* bend= buf + ERROR_BUFFER_SIZE;
   va_list vl;
   int lnum;
   int ccnt;
@@ -2989,6 +2962,49 @@ int filter_lower( struct ajj* a,
       udata,arg,arg_len,ret,tolowerrune,"lower");
 }
 
+/* Mark the value as safe so autoescape leaves it alone. A string is
+ * never marked in place since other references to it are not safe */
+static
+int filter_safe( struct ajj* a,
+    void* udata,
+    struct ajj_value* arg,
+    size_t arg_len,
+    struct ajj_value* ret ) {
+  struct ajj_object* obj;
+  UNUSE_ARG(udata);
+  if(arg_len != 1) {
+    EXEC_FAIL1(a,"%s","Function::safe requires 1 argument!");
+  }
+  if( arg->type == AJJ_VALUE_STRING ) {
+    obj = arg->value.object;
+    if( obj->safe ) {
+      *ret = *arg;
+      return AJJ_EXEC_OK;
+    }
+    if( obj->tp == AJJ_VALUE_CONST_STRING ) {
+      /* constant memory outlives the rendering , share it */
+      obj = ajj_object_create_const_string(a,ajj_cur_gc_scope(a),
+          &(obj->val.str));
+    } else {
+      obj = ajj_object_create_string(a,ajj_cur_gc_scope(a),
+          obj->val.str.str,obj->val.str.len,0);
+    }
+  } else if( arg->type == AJJ_VALUE_OBJECT ) {
+    size_t len;
+    int own;
+    const char* str = ajj_display(a,arg,&len,&own);
+    obj = ajj_object_create_string(a,ajj_cur_gc_scope(a),
+        str,len,own);
+  } else {
+    /* numbers , booleans and none have nothing to escape */
+    *ret = *arg;
+    return AJJ_EXEC_OK;
+  }
+  obj->safe = 1;
+  *ret = ajj_value_assign(obj);
+  return AJJ_EXEC_OK;
+}
+
 static
 int filter_default( struct ajj* a,
     void* udata,
@@ -3098,6 +3114,11 @@ void ajj_builtin_load( struct ajj* a ) {
       filter_default,
       NULL);
 
+  ajj_add_filter(a,&(a->builtins),
+      "safe",
+      filter_safe,
+      NULL);
+
   ajj_add_filter(a,&(a->builtins),
       "slice",
       filter_slice,
@@ -0,0 +1,283 @@
+/* INCLUDE ME WHEN YOU ARE IN LINUX SYSTEM */
+#include "ajj.h"
+#include "util.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+
+/* =============================================================
+ * Template bundle
+ * A bundle is a single file that packs many templates together
+ * so the vfs doesn't need to touch the file system for each
+ * template. The layout is :
+ *
+ * | header | slots[bucket] | entries[count] | names and sources |
+ *
+ * Slots is an open addressing hash table ( linear probing ) that
+ * maps template name to the entry , each slot stores the index of
+ * the entry plus one , zero means empty slot. All names and sources
+ * are null terminated. Integers are stored in native byte order.
+ * ===========================================================*/
+
+#define BUNDLE_MAGIC "AJJB"
+#define BUNDLE_VERSION 1
+
+/* Entry kind , only the template source is supported now */
+#define BUNDLE_ENTRY_SOURCE 0
+
+struct bundle_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t count;  /* number of entries */
+  uint32_t bucket; /* number of slots , power of 2 */
+};
+
+struct bundle_entry {
+  uint32_t hash;
+  uint32_t name_off;
+  uint32_t name_len;
+  uint32_t data_off;
+  uint32_t data_len;
+  uint32_t kind;
+  int64_t ts;
+};
+
+struct ajj_bundle {
+  const char* base;
+  size_t size;
+  const struct bundle_header* hdr;
+  const uint32_t* slot;
+  const struct bundle_entry* ent;
+};
+
+static
+const struct bundle_entry*
+bundle_find( const struct ajj_bundle* b , const char* name ) {
+  size_t len = strlen(name);
+  unsigned int h = data_hash(name,len);
+  uint32_t mask = b->hdr->bucket - 1;
+  uint32_t idx = h & mask;
+  uint32_t i;
+  for( i = 0 ; i < b->hdr->bucket ; ++i ) {
+    const struct bundle_entry* e;
+    uint32_t s = b->slot[idx];
+    if(s == 0) break;
+    e = b->ent + (s-1);
+    if( e->hash == h && e->name_len == len &&
+        memcmp(b->base + e->name_off,name,len) == 0 )
+      return e;
+    idx = (idx + 1) & mask;
+  }
+  return NULL;
+}
+
+static
+int bundle_check( const struct ajj_bundle* b ) {
+  const struct bundle_header* hdr = b->hdr;
+  size_t off = sizeof(*hdr);
+  uint32_t i;
+  if( memcmp(hdr->magic,BUNDLE_MAGIC,4) != 0 ||
+      hdr->version != BUNDLE_VERSION ||
+      hdr->bucket == 0 || (hdr->bucket & (hdr->bucket-1)) != 0 ||
+      hdr->count > hdr->bucket )
+    return -1;
+  off += sizeof(uint32_t)*hdr->bucket +
+    sizeof(struct bundle_entry)*hdr->count;
+  if( off > b->size ) return -1;
+  for( i = 0 ; i < hdr->bucket ; ++i ) {
+    if(b->slot[i] > hdr->count) return -1;
+  }
+  for( i = 0 ; i < hdr->count ; ++i ) {
+    const struct bundle_entry* e = b->ent + i;
+    if( (size_t)e->name_off + e->name_len >= b->size ||
+        (size_t)e->data_off + e->data_len >= b->size ||
+        b->base[e->data_off + e->data_len] != 0 )
+      return -1;
+  }
+  return 0;
+}
+
+struct ajj_bundle* ajj_bundle_open( const char* path ) {
+  struct stat st;
+  struct ajj_bundle* b;
+  void* mem;
+  int fd = open(path,O_RDONLY);
+  if(fd <0) return NULL;
+  if(fstat(fd,&st) || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  mem = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if(mem == MAP_FAILED) return NULL;
+
+  b = malloc(sizeof(*b));
+  b->base = mem;
+  b->size = st.st_size;
+  b->hdr = mem;
+  if(b->size < sizeof(struct bundle_header)) {
+    ajj_bundle_close(b);
+    return NULL;
+  }
+  b->slot = (const uint32_t*)(b->base + sizeof(struct bundle_header));
+  b->ent = (const struct bundle_entry*)(b->slot + b->hdr->bucket);
+  if(bundle_check(b)) {
+    ajj_bundle_close(b);
+    return NULL;
+  }
+  return b;
+}
+
+void ajj_bundle_close( struct ajj_bundle* b ) {
+  munmap((void*)b->base,b->size);
+  free(b);
+}
+
+static
+int bundle_read_file( const char* path , struct strbuf* buf ,
+    int64_t* ts ) {
+  struct stat st;
+  char tmp[4096];
+  size_t ret;
+  FILE* f;
+  if(stat(path,&st)) return -1;
+  *ts = st.st_mtime;
+  f = fopen(path,"rb");
+  if(!f) return -1;
+  while( (ret = fread(tmp,1,sizeof(tmp),f)) > 0 ) {
+    strbuf_append(buf,tmp,ret);
+  }
+  ret = ferror(f);
+  fclose(f);
+  return ret ? -1 : 0;
+}
+
+int ajj_bundle_create( const char* path , const char** files ,
+    size_t len ) {
+  struct bundle_header hdr;
+  struct bundle_entry* ent;
+  uint32_t* slot;
+  struct strbuf blob;
+  size_t off;
+  size_t i;
+  int ret = -1;
+  FILE* out;
+
+  memcpy(hdr.magic,BUNDLE_MAGIC,4);
+  hdr.version = BUNDLE_VERSION;
+  hdr.count = (uint32_t)len;
+  hdr.bucket = 2;
+  while( hdr.bucket < len * 2 ) hdr.bucket *= 2;
+
+  slot = calloc(hdr.bucket,sizeof(uint32_t));
+  ent = calloc(len ? len : 1,sizeof(struct bundle_entry));
+  strbuf_init(&blob);
+  off = sizeof(hdr) + sizeof(uint32_t)*hdr.bucket +
+    sizeof(struct bundle_entry)*len;
+
+  for( i = 0 ; i < len ; ++i ) {
+    struct bundle_entry* e = ent + i;
+    size_t nlen = strlen(files[i]);
+    uint32_t idx;
+    e->hash = data_hash(files[i],nlen);
+    e->name_off = (uint32_t)(off + blob.len);
+    e->name_len = (uint32_t)nlen;
+    e->kind = BUNDLE_ENTRY_SOURCE;
+    strbuf_append(&blob,files[i],nlen+1);
+    e->data_off = (uint32_t)(off + blob.len);
+    if(bundle_read_file(files[i],&blob,&(e->ts))) goto done;
+    e->data_len = (uint32_t)(off + blob.len - e->data_off);
+    strbuf_append(&blob,"",1);
+    if( off + blob.len > UINT32_MAX ) goto done;
+
+    /* insert into the index */
+    idx = e->hash & (hdr.bucket-1);
+    while( slot[idx] ) {
+      const struct bundle_entry* o = ent + (slot[idx]-1);
+      if( o->name_len == nlen &&
+          memcmp(files[slot[idx]-1],files[i],nlen) == 0 )
+        goto done; /* duplicated name */
+      idx = (idx + 1) & (hdr.bucket-1);
+    }
+    slot[idx] = (uint32_t)(i + 1);
+  }
+
+  out = fopen(path,"wb");
+  if(!out) goto done;
+  if( fwrite(&hdr,sizeof(hdr),1,out) == 1 &&
+      fwrite(slot,sizeof(uint32_t),hdr.bucket,out) == hdr.bucket &&
+      (len == 0 || fwrite(ent,sizeof(struct bundle_entry),len,out) == len) &&
+      (blob.len == 0 || fwrite(blob.str,1,blob.len,out) == blob.len) )
+    ret = 0;
+  if(fclose(out)) ret = -1;
+
+done:
+  strbuf_destroy(&blob);
+  free(slot);
+  free(ent);
+  return ret;
+}
+
+/* =============================================================
+ * Bundle VFS
+ * Templates are served directly from the mapping , nothing is
+ * copied and nothing needs to be released. Bundle is immutable
+ * so the timestamp is always current
+ * ===========================================================*/
+static void*
+bundle_vfs_load( struct ajj* a , const char* path ,
+    size_t* len , time_t* ts , void* udata ) {
+  struct ajj_bundle* b = (struct ajj_bundle*)udata;
+  const struct bundle_entry* e = bundle_find(b,path);
+  if(!e) {
+    ajj_error(a,"Cannot find file:%s in bundle",path);
+    return NULL;
+  }
+  assert(len);
+  *len = e->data_len;
+  if(ts) *ts = (time_t)e->ts;
+  return (void*)(b->base + e->data_off);
+}
+
+static int
+bundle_vfs_timestamp( struct ajj* a , const char* path ,
+    time_t* ts , void* udata ) {
+  struct ajj_bundle* b = (struct ajj_bundle*)udata;
+  const struct bundle_entry* e = bundle_find(b,path);
+  if(!e) {
+    ajj_error(a,"Cannot find file:%s in bundle",path);
+    return -1;
+  }
+  *ts = (time_t)e->ts;
+  return 0;
+}
+
+static int
+bundle_vfs_timestamp_is_current( struct ajj* a , const char* path ,
+    time_t ts , void* udata ) {
+  time_t new_ts;
+  if(bundle_vfs_timestamp(a,path,&new_ts,udata)) return -1;
+  return new_ts == ts;
+}
+
+static void
+bundle_vfs_free( struct ajj* a , void* mem , size_t len , void* udata ) {
+  (void)a;
+  (void)mem;
+  (void)len;
+  (void)udata;
+}
+
+struct ajj_vfs AJJ_BUNDLE_VFS = {
+  bundle_vfs_load,
+  bundle_vfs_timestamp,
+  bundle_vfs_timestamp_is_current,
+  bundle_vfs_free,
+  NULL
+};
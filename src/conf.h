@@ -10,5 +10,15 @@
 #define AJJ_MAX_CALL_STACK 128
 #define AJJ_MAX_NESTED_INCLUDE_SIZE 128
 #define AJJ_INIT_VALUE_STACK_SIZE 1024
+#define AJJ_RENDER_STACK_SIZE (1024*1024*2)
+#define AJJ_BUDGET_CLOCK_INTERVAL 4096
+#define AJJ_IO_PRINTF_BUF_SIZE 256
+#define AJJ_IO_GATHER_IOV_SIZE 64
+#define AJJ_IO_FD_BUF_SIZE (1024*64)
+#define AJJ_IO_FD_BUF_ALIGN 4096
+#define AJJ_OUTPUT_SIZE_DECAY 3
+#define AJJ_DEFLATE_OUT_SIZE (1024*16)
+#define AJJ_DEFLATE_MAX_CHAIN 32
+#define AJJ_CACHE_LINE_SIZE 64
 
 #endif /* _CONF_H_ */
@@ -0,0 +1,525 @@
+#include "ajj-priv.h"
+
+/* =============================================================
+ * Deflate IO
+ * The output is compressed while the VM writes it and the compressed
+ * bytes go to another IO , so the uncompressed page never sits in
+ * memory as a whole. The encoder is a small self-contained one : LZ77
+ * with hash chains over a 32KB window and the fixed Huffman codes of
+ * RFC 1951 , which suits the repetitive markup of a page well. The
+ * input is encoded every time the window fills up , and a flush ends
+ * the block with an empty stored block ( a sync point ) so the client
+ * can decode everything sent so far. Each piece of input is parsed into
+ * symbols first , and it is sent as stored blocks instead when the
+ * fixed codes would take more bits than the raw bytes , so the output
+ * of incompressible data only grows by a few header bytes.
+ * ===========================================================*/
+
+#define DEFLATE_WSIZE 32768
+#define DEFLATE_WMASK (DEFLATE_WSIZE-1)
+#define DEFLATE_HBITS 15
+#define DEFLATE_HSIZE (1<<DEFLATE_HBITS)
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_EOB 256
+#define DEFLATE_STORED_MAX 65535
+
+/* A parsed symbol is a literal byte or a match , the length sits in the
+ * low 9 bits and the distance above it , literals have no distance */
+#define DEFLATE_SYM(LEN,DIST) (((uint32_t)(DIST) << 9) | (uint32_t)(LEN))
+#define DEFLATE_SYM_LEN(S) ((S) & 0x1ff)
+#define DEFLATE_SYM_DIST(S) ((S) >> 9)
+
+#define DEFLATE_HASH(P) \
+  ((((unsigned int)(P)[0] << 10) ^ \
+    ((unsigned int)(P)[1] << 5) ^ \
+    (unsigned int)(P)[2]) & (DEFLATE_HSIZE-1))
+
+static const unsigned short DEFLATE_LEN_BASE[29] = {
+  3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,
+  35,43,51,59,67,83,99,115,131,163,195,227,258
+};
+
+static const unsigned char DEFLATE_LEN_EXTRA[29] = {
+  0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,
+  3,3,3,3,4,4,4,4,5,5,5,5,0
+};
+
+static const unsigned short DEFLATE_DIST_BASE[30] = {
+  1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
+  257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577
+};
+
+static const unsigned char DEFLATE_DIST_EXTRA[30] = {
+  0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,
+  7,7,8,8,9,9,10,10,11,11,12,12,13,13
+};
+
+struct deflate_sink {
+  struct ajj_io* out;
+  int fmt;
+  int err;
+  int block; /* inside of a fixed Huffman block */
+
+  unsigned char* win; /* history plus the pending input , 2 windows */
+  size_t start; /* first byte not encoded yet */
+  size_t end;   /* end of the input */
+  int* head;    /* hash => latest position , -1 for none */
+  int* prev;    /* position => previous position with the same hash */
+  uint32_t* sym; /* symbols parsed from the pending input */
+
+  uint32_t bits; /* bits not written yet , LSB first */
+  int nbits;
+  unsigned char* obuf;
+  size_t olen;
+
+  /* fixed codes , already bit reversed since they are sent MSB first */
+  unsigned short lcode[288];
+  unsigned char llen[288];
+  unsigned char dcode[30];
+
+  uint32_t crc_tbl[256];
+  uint32_t crc;
+  uint32_t adler_a;
+  uint32_t adler_b;
+  uint32_t size; /* input size modulo 2^32 */
+};
+
+static
+unsigned int bit_reverse( unsigned int code , int len ) {
+  unsigned int r = 0;
+  while( len-- > 0 ) {
+    r = (r << 1) | (code & 1);
+    code >>= 1;
+  }
+  return r;
+}
+
+static
+void deflate_init_codes( struct deflate_sink* s ) {
+  int i;
+  for( i = 0 ; i < 288 ; ++i ) {
+    unsigned int code;
+    int len;
+    if( i < 144 ) {
+      code = 0x30 + i; len = 8;
+    } else if( i < 256 ) {
+      code = 0x190 + (i-144); len = 9;
+    } else if( i < 280 ) {
+      code = i-256; len = 7;
+    } else {
+      code = 0xc0 + (i-280); len = 8;
+    }
+    s->lcode[i] = (unsigned short)bit_reverse(code,len);
+    s->llen[i] = (unsigned char)len;
+  }
+  for( i = 0 ; i < 30 ; ++i ) {
+    s->dcode[i] = (unsigned char)bit_reverse(i,5);
+  }
+  for( i = 0 ; i < 256 ; ++i ) {
+    uint32_t c = (uint32_t)i;
+    int k;
+    for( k = 0 ; k < 8 ; ++k )
+      c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+    s->crc_tbl[i] = c;
+  }
+}
+
+/* Adler-32 sums stay below 2^32 for this many bytes */
+#define ADLER_NMAX 5552
+
+static
+void deflate_checksum( struct deflate_sink* s , const unsigned char* p ,
+    size_t len ) {
+  if( s->fmt == AJJ_DEFLATE_GZIP ) {
+    uint32_t c = s->crc ^ 0xffffffffU;
+    while( len-- > 0 )
+      c = s->crc_tbl[(c ^ *p++) & 0xff] ^ (c >> 8);
+    s->crc = c ^ 0xffffffffU;
+  } else {
+    uint32_t a = s->adler_a;
+    uint32_t b = s->adler_b;
+    while( len > 0 ) {
+      size_t n = len < ADLER_NMAX ? len : ADLER_NMAX;
+      len -= n;
+      while( n-- > 0 ) {
+        a += *p++;
+        b += a;
+      }
+      a %= 65521;
+      b %= 65521;
+    }
+    s->adler_a = a;
+    s->adler_b = b;
+  }
+}
+
+/* Hand the compressed bytes to the output */
+static
+void deflate_drain( struct deflate_sink* s ) {
+  if( s->olen > 0 && !s->err &&
+      ajj_io_write(s->out,s->obuf,s->olen) < 0 )
+    s->err = 1;
+  s->olen = 0;
+}
+
+static
+void deflate_put_byte( struct deflate_sink* s , unsigned char c ) {
+  if( s->olen == AJJ_DEFLATE_OUT_SIZE )
+    deflate_drain(s);
+  s->obuf[s->olen++] = c;
+}
+
+static
+void deflate_put_bits( struct deflate_sink* s , uint32_t v , int n ) {
+  s->bits |= v << s->nbits;
+  s->nbits += n;
+  while( s->nbits >= 8 ) {
+    deflate_put_byte(s,(unsigned char)(s->bits & 0xff));
+    s->bits >>= 8;
+    s->nbits -= 8;
+  }
+}
+
+static
+void deflate_align( struct deflate_sink* s ) {
+  if( s->nbits > 0 )
+    deflate_put_bits(s,0,8 - s->nbits);
+}
+
+#define deflate_put_sym(S,SYM) \
+  deflate_put_bits((S),(S)->lcode[(SYM)],(S)->llen[(SYM)])
+
+static
+int deflate_len_code( size_t len ) {
+  int i = 28;
+  while( DEFLATE_LEN_BASE[i] > len ) --i;
+  return i;
+}
+
+static
+int deflate_dist_code( size_t dist ) {
+  int i = 29;
+  while( DEFLATE_DIST_BASE[i] > dist ) --i;
+  return i;
+}
+
+/* Bits taken by a match with the fixed codes */
+static
+size_t deflate_match_bits( struct deflate_sink* s , size_t len ,
+    size_t dist ) {
+  int l = deflate_len_code(len);
+  int d = deflate_dist_code(dist);
+  return s->llen[257+l] + DEFLATE_LEN_EXTRA[l] + 5 + DEFLATE_DIST_EXTRA[d];
+}
+
+static
+void deflate_put_match( struct deflate_sink* s , size_t len ,
+    size_t dist ) {
+  int i = deflate_len_code(len);
+  deflate_put_sym(s,257+i);
+  deflate_put_bits(s,(uint32_t)(len - DEFLATE_LEN_BASE[i]),
+      DEFLATE_LEN_EXTRA[i]);
+  i = deflate_dist_code(dist);
+  deflate_put_bits(s,s->dcode[i],5);
+  deflate_put_bits(s,(uint32_t)(dist - DEFLATE_DIST_BASE[i]),
+      DEFLATE_DIST_EXTRA[i]);
+}
+
+static
+void deflate_block_end( struct deflate_sink* s ) {
+  if( s->block ) {
+    deflate_put_sym(s,DEFLATE_EOB);
+    s->block = 0;
+  }
+}
+
+static
+void deflate_insert( struct deflate_sink* s , size_t pos ) {
+  unsigned int h = DEFLATE_HASH(s->win+pos);
+  s->prev[pos & DEFLATE_WMASK] = s->head[h];
+  s->head[h] = (int)pos;
+}
+
+/* Longest match for pos inside of the window , the length is returned
+ * and the distance is stored in dist */
+static
+size_t deflate_longest( struct deflate_sink* s , size_t pos ,
+    size_t avail , size_t* dist ) {
+  size_t max = avail < DEFLATE_MAX_MATCH ? avail : DEFLATE_MAX_MATCH;
+  const unsigned char* cur = s->win + pos;
+  int chain = AJJ_DEFLATE_MAX_CHAIN;
+  int cand = s->head[DEFLATE_HASH(cur)];
+  size_t best = 0;
+  while( cand >= 0 && pos - (size_t)cand <= DEFLATE_WSIZE &&
+         chain-- > 0 ) {
+    const unsigned char* m = s->win + cand;
+    int next;
+    if( m[best] == cur[best] ) {
+      size_t l = 0;
+      while( l < max && m[l] == cur[l] ) ++l;
+      if( l > best ) {
+        best = l;
+        *dist = pos - (size_t)cand;
+        if( l == max ) break;
+      }
+    }
+    next = s->prev[cand & DEFLATE_WMASK];
+    /* the slot is reused by a newer position , the chain ends */
+    if( next >= cand ) break;
+    cand = next;
+  }
+  return best;
+}
+
+/* Send the raw bytes as stored blocks , the fixed block is ended first */
+static
+void deflate_put_stored( struct deflate_sink* s ,
+    const unsigned char* p , size_t len ) {
+  deflate_block_end(s);
+  while( len > 0 ) {
+    size_t n = len < DEFLATE_STORED_MAX ? len : DEFLATE_STORED_MAX;
+    size_t i;
+    deflate_put_bits(s,0,3); /* not final , stored */
+    deflate_align(s);
+    deflate_put_byte(s,(unsigned char)(n & 0xff));
+    deflate_put_byte(s,(unsigned char)(n >> 8));
+    deflate_put_byte(s,(unsigned char)(~n & 0xff));
+    deflate_put_byte(s,(unsigned char)((~n >> 8) & 0xff));
+    for( i = 0 ; i < n ; ++i )
+      deflate_put_byte(s,p[i]);
+    p += n;
+    len -= n;
+  }
+}
+
+/* Encode the pending input. Unless it is a flush , the last bytes are
+ * kept since a match starting there could still grow. The symbols are
+ * parsed first and the cheaper of the fixed codes and stored blocks is
+ * sent , the hash chains are updated either way so later input can
+ * still refer to the bytes */
+static
+void deflate_encode( struct deflate_sink* s , int flush ) {
+  size_t pos = s->start;
+  size_t stop;
+  size_t nsym = 0;
+  size_t fixed , stored;
+  size_t i;
+  if(flush)
+    stop = s->end;
+  else
+    stop = s->end > DEFLATE_MAX_MATCH ? s->end - DEFLATE_MAX_MATCH : 0;
+  if( pos >= stop ) return;
+
+  /* a new fixed block needs a header , a stored one ends the open block
+   * and each of its chunks takes a header , padding and the lengths */
+  fixed = s->block ? 0 : 3;
+  stored = (s->block ? s->llen[DEFLATE_EOB] : 0) +
+    ((stop - pos + DEFLATE_STORED_MAX - 1)/DEFLATE_STORED_MAX) *
+    (3 + 7 + 32) + 8*(stop - pos);
+
+  while( pos < stop ) {
+    size_t avail = s->end - pos;
+    size_t len = 0;
+    size_t dist = 0;
+    if( avail >= DEFLATE_MIN_MATCH ) {
+      len = deflate_longest(s,pos,avail,&dist);
+      deflate_insert(s,pos);
+    }
+    if( len >= DEFLATE_MIN_MATCH ) {
+      fixed += deflate_match_bits(s,len,dist);
+      s->sym[nsym++] = DEFLATE_SYM(len,dist);
+      for( i = 1 ; i < len ; ++i ) {
+        if( s->end - (pos+i) >= DEFLATE_MIN_MATCH )
+          deflate_insert(s,pos+i);
+      }
+      pos += len;
+    } else {
+      fixed += s->llen[s->win[pos]];
+      s->sym[nsym++] = DEFLATE_SYM(s->win[pos],0);
+      ++pos;
+    }
+  }
+
+  if( stored < fixed ) {
+    deflate_put_stored(s,s->win+s->start,pos-s->start);
+  } else {
+    if( !s->block ) {
+      deflate_put_bits(s,2,3); /* not final , fixed Huffman codes */
+      s->block = 1;
+    }
+    for( i = 0 ; i < nsym ; ++i ) {
+      uint32_t sym = s->sym[i];
+      if( DEFLATE_SYM_DIST(sym) )
+        deflate_put_match(s,DEFLATE_SYM_LEN(sym),DEFLATE_SYM_DIST(sym));
+      else
+        deflate_put_sym(s,DEFLATE_SYM_LEN(sym));
+    }
+  }
+  s->start = pos;
+}
+
+/* Drop the older window , the positions are shifted along */
+static
+void deflate_slide( struct deflate_sink* s ) {
+  size_t i;
+  assert( s->start >= DEFLATE_WSIZE );
+  memmove(s->win,s->win+DEFLATE_WSIZE,s->end-DEFLATE_WSIZE);
+  s->start -= DEFLATE_WSIZE;
+  s->end -= DEFLATE_WSIZE;
+  for( i = 0 ; i < DEFLATE_HSIZE ; ++i ) {
+    s->head[i] = s->head[i] >= DEFLATE_WSIZE ?
+      s->head[i] - DEFLATE_WSIZE : -1;
+  }
+  for( i = 0 ; i < DEFLATE_WSIZE ; ++i ) {
+    s->prev[i] = s->prev[i] >= DEFLATE_WSIZE ?
+      s->prev[i] - DEFLATE_WSIZE : -1;
+  }
+}
+
+static
+int deflate_sink_write( void* udata , const void* mem , size_t len ) {
+  struct deflate_sink* s = (struct deflate_sink*)udata;
+  const unsigned char* p = (const unsigned char*)mem;
+  if(s->err) return -1;
+  deflate_checksum(s,p,len);
+  s->size += (uint32_t)len;
+  while( len > 0 ) {
+    size_t n;
+    if( s->end == 2*DEFLATE_WSIZE ) {
+      deflate_encode(s,0);
+      deflate_slide(s);
+    }
+    n = 2*DEFLATE_WSIZE - s->end;
+    if( n > len ) n = len;
+    memcpy(s->win+s->end,p,n);
+    s->end += n;
+    p += n;
+    len -= n;
+  }
+  return s->err ? -1 : 0;
+}
+
+/* Sync flush , the same as zlib's Z_SYNC_FLUSH */
+static
+int deflate_sink_flush( void* udata ) {
+  struct deflate_sink* s = (struct deflate_sink*)udata;
+  if(s->err) return -1;
+  deflate_encode(s,1);
+  deflate_block_end(s);
+  deflate_put_bits(s,0,3); /* empty stored block */
+  deflate_align(s);
+  deflate_put_byte(s,0x00);
+  deflate_put_byte(s,0x00);
+  deflate_put_byte(s,0xff);
+  deflate_put_byte(s,0xff);
+  deflate_drain(s);
+  if(s->err) return -1;
+  return ajj_io_flush(s->out);
+}
+
+static
+void deflate_put_be32( struct deflate_sink* s , uint32_t v ) {
+  deflate_put_byte(s,(unsigned char)(v >> 24));
+  deflate_put_byte(s,(unsigned char)(v >> 16));
+  deflate_put_byte(s,(unsigned char)(v >> 8));
+  deflate_put_byte(s,(unsigned char)v);
+}
+
+static
+void deflate_put_le32( struct deflate_sink* s , uint32_t v ) {
+  deflate_put_byte(s,(unsigned char)v);
+  deflate_put_byte(s,(unsigned char)(v >> 8));
+  deflate_put_byte(s,(unsigned char)(v >> 16));
+  deflate_put_byte(s,(unsigned char)(v >> 24));
+}
+
+/* Finish the stream with an empty final block and the trailer */
+static
+void deflate_sink_release( void* udata ) {
+  struct deflate_sink* s = (struct deflate_sink*)udata;
+  if(!s->err) {
+    deflate_encode(s,1);
+    deflate_block_end(s);
+    deflate_put_bits(s,3,3); /* final , fixed Huffman codes */
+    deflate_put_sym(s,DEFLATE_EOB);
+    deflate_align(s);
+    if( s->fmt == AJJ_DEFLATE_GZIP ) {
+      deflate_put_le32(s,s->crc);
+      deflate_put_le32(s,s->size);
+    } else {
+      deflate_put_be32(s,(s->adler_b << 16) | s->adler_a);
+    }
+    deflate_drain(s);
+  }
+  free(s->win);
+  free(s->head);
+  free(s->prev);
+  free(s->sym);
+  free(s->obuf);
+  free(s);
+}
+
+static const struct ajj_io_sink DEFLATE_SINK = {
+  deflate_sink_write,
+  NULL,
+  deflate_sink_flush,
+  NULL,
+  NULL
+};
+
+struct ajj_io*
+ajj_io_create_deflate( struct ajj* a , struct ajj_io* output , int fmt ) {
+  static const unsigned char GZIP_HEADER[10] = {
+    0x1f,0x8b, /* magic */
+    8, /* deflate */
+    0, /* no flags */
+    0,0,0,0, /* no modification time */
+    0, /* no extra flags */
+    0xff /* unknown OS */
+  };
+  static const unsigned char ZLIB_HEADER[2] = {
+    0x78,0x01 /* deflate with 32KB window , check bits */
+  };
+  struct deflate_sink* s;
+  struct ajj_io* io;
+  size_t i;
+
+  if( fmt != AJJ_DEFLATE_GZIP && fmt != AJJ_DEFLATE_ZLIB ) {
+    ajj_error(a,"Unknown compressed format:%d!",fmt);
+    return NULL;
+  }
+  s = malloc(sizeof(*s));
+  s->out = output;
+  s->fmt = fmt;
+  s->err = 0;
+  s->block = 0;
+  s->win = malloc(2*DEFLATE_WSIZE);
+  s->start = s->end = 0;
+  s->head = malloc(sizeof(int)*DEFLATE_HSIZE);
+  s->prev = malloc(sizeof(int)*DEFLATE_WSIZE);
+  s->sym = malloc(sizeof(uint32_t)*2*DEFLATE_WSIZE);
+  for( i = 0 ; i < DEFLATE_HSIZE ; ++i ) s->head[i] = -1;
+  for( i = 0 ; i < DEFLATE_WSIZE ; ++i ) s->prev[i] = -1;
+  s->bits = 0;
+  s->nbits = 0;
+  s->obuf = malloc(AJJ_DEFLATE_OUT_SIZE);
+  s->olen = 0;
+  s->crc = 0;
+  s->adler_a = 1;
+  s->adler_b = 0;
+  s->size = 0;
+  deflate_init_codes(s);
+
+  if( fmt == AJJ_DEFLATE_GZIP ) {
+    for( i = 0 ; i < ARRAY_SIZE(GZIP_HEADER) ; ++i )
+      deflate_put_byte(s,GZIP_HEADER[i]);
+  } else {
+    for( i = 0 ; i < ARRAY_SIZE(ZLIB_HEADER) ; ++i )
+      deflate_put_byte(s,ZLIB_HEADER[i]);
+  }
+
+  io = ajj_io_create_sink(a,&DEFLATE_SINK,s);
+  io->out.sink.release = deflate_sink_release;
+  return io;
+}
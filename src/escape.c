@@ -0,0 +1,162 @@
+#include "escape.h"
+#include "ajj-priv.h"
+
+/* SSE2 is always there on x86-64 , AVX2 is picked at runtime */
+#if defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define ESCAPE_SSE2
+#include <emmintrin.h>
+#if defined(__clang__) || __GNUC__ >= 5
+#define ESCAPE_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+#define NEED_ESCAPE(C) \
+  ((C) == '&' || (C) == '<' || (C) == '>' || (C) == '"' || (C) == '\'')
+
+static
+size_t escape_scan_scalar( const char* str , size_t len ) {
+  size_t i;
+  for( i = 0 ; i < len ; ++i ) {
+    if(NEED_ESCAPE(str[i])) break;
+  }
+  return i;
+}
+
+#ifdef ESCAPE_SSE2
+static
+size_t escape_scan_sse2( const char* str , size_t len ) {
+  const __m128i amp = _mm_set1_epi8('&');
+  const __m128i lt = _mm_set1_epi8('<');
+  const __m128i gt = _mm_set1_epi8('>');
+  const __m128i dq = _mm_set1_epi8('"');
+  const __m128i sq = _mm_set1_epi8('\'');
+  size_t i = 0;
+  for( ; len - i >= 16 ; i += 16 ) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(str+i));
+    __m128i m = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v,amp),_mm_cmpeq_epi8(v,lt)),
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v,gt),
+            _mm_cmpeq_epi8(v,dq)),_mm_cmpeq_epi8(v,sq)));
+    int mask = _mm_movemask_epi8(m);
+    if(mask) return i + (size_t)__builtin_ctz((unsigned int)mask);
+  }
+  return i + escape_scan_scalar(str+i,len-i);
+}
+#endif /* ESCAPE_SSE2 */
+
+#ifdef ESCAPE_AVX2
+__attribute__((target("avx2")))
+static
+size_t escape_scan_avx2( const char* str , size_t len ) {
+  const __m256i amp = _mm256_set1_epi8('&');
+  const __m256i lt = _mm256_set1_epi8('<');
+  const __m256i gt = _mm256_set1_epi8('>');
+  const __m256i dq = _mm256_set1_epi8('"');
+  const __m256i sq = _mm256_set1_epi8('\'');
+  size_t i = 0;
+  for( ; len - i >= 32 ; i += 32 ) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(str+i));
+    __m256i m = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v,amp),_mm256_cmpeq_epi8(v,lt)),
+        _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v,gt),
+            _mm256_cmpeq_epi8(v,dq)),_mm256_cmpeq_epi8(v,sq)));
+    int mask = _mm256_movemask_epi8(m);
+    if(mask) return i + (size_t)__builtin_ctz((unsigned int)mask);
+  }
+  return i + escape_scan_sse2(str+i,len-i);
+}
+#endif /* ESCAPE_AVX2 */
+
+#ifdef ESCAPE_AVX2
+/* The CPU is checked once when the library is loaded */
+static int ESCAPE_HAS_AVX2;
+
+__attribute__((constructor))
+static
+void escape_init( void ) {
+  __builtin_cpu_init(); /* required before any check in a constructor */
+  ESCAPE_HAS_AVX2 = __builtin_cpu_supports("avx2");
+}
+#endif /* ESCAPE_AVX2 */
+
+size_t html_escape_scan( const char* str , size_t len ) {
+#ifdef ESCAPE_AVX2
+  if( len >= 32 && ESCAPE_HAS_AVX2 )
+    return escape_scan_avx2(str,len);
+#endif
+#ifdef ESCAPE_SSE2
+  if( len >= 16 )
+    return escape_scan_sse2(str,len);
+#endif
+  return escape_scan_scalar(str,len);
+}
+
+static const struct string HTML_AMP = CONST_STRING("&amp;");
+static const struct string HTML_LT = CONST_STRING("&lt;");
+static const struct string HTML_GT = CONST_STRING("&gt;");
+static const struct string HTML_DQ = CONST_STRING("&#34;");
+static const struct string HTML_SQ = CONST_STRING("&#39;");
+
+static
+const struct string* html_entity( char c ) {
+  switch(c) {
+    case '&': return &HTML_AMP;
+    case '<': return &HTML_LT;
+    case '>': return &HTML_GT;
+    case '"': return &HTML_DQ;
+    default:
+      assert( c == '\'' );
+      return &HTML_SQ;
+  }
+}
+
+int html_escape_write( struct ajj_io* io , const char* str , size_t len ) {
+  while( len > 0 ) {
+    size_t n = html_escape_scan(str,len);
+    const struct string* e;
+    if( n > 0 && ajj_io_write(io,str,n) < 0 )
+      return -1;
+    if( n == len )
+      break;
+    /* entities are static , so they are referenced when gathering */
+    e = html_entity(str[n]);
+    if( ajj_io_write_ref(io,e->str,e->len) < 0 )
+      return -1;
+    str += n+1;
+    len -= n+1;
+  }
+  return 0;
+}
+
+void html_escape_buf( struct strbuf* buf , const char* str , size_t len ) {
+  while( len > 0 ) {
+    size_t n = html_escape_scan(str,len);
+    const struct string* e;
+    strbuf_append(buf,str,n);
+    if( n == len )
+      break;
+    e = html_entity(str[n]);
+    strbuf_append(buf,e->str,e->len);
+    str += n+1;
+    len -= n+1;
+  }
+}
+
+static
+int escape_sink_write( void* udata , const void* mem , size_t len ) {
+  return html_escape_write((struct ajj_io*)udata,(const char*)mem,len);
+}
+
+static const struct ajj_io_sink ESCAPE_SINK = {
+  escape_sink_write,
+  NULL,
+  NULL,
+  NULL,
+  NULL
+};
+
+void html_escape_io_init( struct ajj_io* io , struct ajj_io* output ) {
+  ajj_io_init_sink(io,&ESCAPE_SINK,output);
+}
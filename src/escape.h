@@ -0,0 +1,30 @@
+#ifndef _ESCAPE_H_
+#define _ESCAPE_H_
+#include <stddef.h>
+
+struct ajj_io;
+struct strbuf;
+
+/* =============================================================
+ * HTML escape
+ * The characters & < > " ' are replaced with their entities , the
+ * same set as Jinja2's autoescape. Runs of safe bytes are found with
+ * SSE2 or AVX2 when the CPU has them and go out as they are.
+ * ===========================================================*/
+
+/* Index of the first byte that needs escaping , len if there is none */
+size_t html_escape_scan( const char* , size_t );
+
+/* Write the text into the IO with the special characters escaped.
+ * Returns 0 on success and -1 if the output fails */
+int html_escape_write( struct ajj_io* , const char* , size_t );
+
+/* Append the text to the buffer with the special characters escaped */
+void html_escape_buf( struct strbuf* , const char* , size_t );
+
+/* Initialize an IO in place that escapes everything written into it
+ * and forwards it to the given IO , used to escape the display of
+ * objects. It needs no ajj_io_destroy */
+void html_escape_io_init( struct ajj_io* , struct ajj_io* );
+
+#endif /* _ESCAPE_H_ */
@@ -245,7 +245,7 @@ int tk_lex_rmlead( struct tokenizer* tk , int pos ) {
 static
 int tk_keyword_check( struct tokenizer* tk , const char* str , int i ) {
   int k;
-  for( k = 0 ; k < 10 ; ++k ) {
+  for( k = 0 ; k < 16 ; ++k ) {
     const unsigned char t = str[k];
     Rune c; int o;
     if(!t) return k;
@@ -319,7 +319,7 @@ int check_not_id_rchar( const char* src , size_t offset ) {
  * E: elif,else,endfor,endmacro,endcall,
  *    endfilter,endset,endblock,endwith,
  *    endupvalue,endinclude,extends
- * F: filter,false,False,fix
+ * F: filter,false,False,fix,flush
  * G: -
  * H: -
  * I: if,in,is,include,import
@@ -360,6 +360,9 @@ token_id tk_lex_keyword_or_id( struct tokenizer* tk ) {
       else if( (len=tk_keyword_check(tk,"s",i+1)) == 1 &&
           check_not_id_rchar(tk->src,i+2) )
         RETURN(TK_AS,2);
+      else if( (len=tk_keyword_check(tk,"utoescape",i+1)) == 9 &&
+          check_not_id_rchar(tk->src,i+10) )
+        RETURN(TK_AUTOESCAPE,10);
       else
         return tk_lex_keyword(tk,len+1);
     case 'b': assert(o == 1);
@@ -421,6 +424,9 @@ token_id tk_lex_keyword_or_id( struct tokenizer* tk ) {
         else if( (len=tk_keyword_check(tk,"import",k))==6 &&
             check_not_id_rchar(tk->src,k+6))
           RETURN(TK_ENDIMPORT,9);
+        else if( (len=tk_keyword_check(tk,"autoescape",k))==10 &&
+            check_not_id_rchar(tk->src,k+10))
+          RETURN(TK_ENDAUTOESCAPE,13);
         else
           return tk_lex_keyword(tk,len+3);
       } else if ((len = tk_keyword_check(tk,"lif",i+1)) == 3 &&
@@ -445,6 +451,9 @@ token_id tk_lex_keyword_or_id( struct tokenizer* tk ) {
       else if( (len = tk_keyword_check(tk,"or",i+1)) == 2 &&
           check_not_id_rchar(tk->src,i+3))
         RETURN(TK_FOR,3);
+      else if( (len = tk_keyword_check(tk,"lush",i+1)) == 4 &&
+          check_not_id_rchar(tk->src,i+5))
+        RETURN(TK_FLUSH,5);
       else
         return tk_lex_keyword(tk,len+1);
     case 'F': assert( o == 1 );
@@ -41,6 +41,9 @@ enum {
   X(TK_AS,"as") \
   X(TK_CONTINUE,"continue") \
   X(TK_BREAK,"break") \
+  X(TK_FLUSH,"flush") \
+  X(TK_AUTOESCAPE,"autoescape") \
+  X(TK_ENDAUTOESCAPE,"endautoescape") \
   X(TK_UPVALUE,"upvalue") \
   X(TK_ENDUPVALUE,"endupvalue") \
   X(TK_JSON,"json") \
@@ -267,6 +267,7 @@ ajj_object_create( struct ajj* a , struct gc_scope* scope ) {
   struct ajj_object* ret = slab_malloc(&(a->obj_slab));
   LINSERT(ret,&(scope->gc_tail));
   ret->scp = scope;
+  ret->safe = 0;
   return ret;
 }
 
@@ -325,9 +326,9 @@ ajj_object_jinja( struct ajj* a , struct ajj_object* obj ,
 }
 
 struct ajj_object*
-ajj_object_create_jinja( struct ajj* a , const char* name ,
-    const char* src , int own ) {
-  struct ajj_object* obj = ajj_object_create(a,&(a->gc_root));
+ajj_object_create_jinja( struct ajj* a , struct gc_scope* scp ,
+    const char* name , const char* src , int own ) {
+  struct ajj_object* obj = ajj_object_create(a,scp);
   return ajj_object_jinja(a,obj,name,src,own);
 }
 
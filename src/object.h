@@ -123,6 +123,7 @@ struct ajj_object {
   struct ajj_object* prev;
   struct ajj_object* next;
   int tp;
+  int safe; /* string that needs no escaping when autoescape is on */
   union {
     struct string str; /* string */
     struct object obj; /* object */
@@ -243,8 +244,8 @@ ajj_object_jinja( struct ajj* , struct ajj_object* obj ,
     const char* name , const char* src , int own );
 
 struct ajj_object*
-ajj_object_create_jinja( struct ajj* a , const char* name ,
-    const char* src , int own );
+ajj_object_create_jinja( struct ajj* a , struct gc_scope* scp ,
+    const char* name , const char* src , int own );
 
 void ajj_object_destroy_jinja( struct ajj* a,
     struct ajj_object* obj );
@@ -647,7 +647,7 @@ int fold_bin( struct opt* o , instructions instr ) {
           return -1;
         }
         val = str_concate(&ls,&rs);
-        i_val = program_const_str(o->prg,&val,1);
+        i_val = program_const_literal(o->prg,&val,1);
         bin_emit1(o,sref,VM_LSTR,i_val);
         str_destroy(&ls);
         str_destroy(&rs);
@@ -681,7 +681,7 @@ int fold_bin( struct opt* o , instructions instr ) {
         val = str_mul(&lv,rv);
         str_destroy(&lv);
 
-        i_val = program_const_str(o->prg,&val,1);
+        i_val = program_const_literal(o->prg,&val,1);
         bin_emit1(o,sref,VM_LSTR,i_val);
       } else {
         double lv,rv;
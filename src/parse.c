@@ -129,6 +129,8 @@ struct parser {
                 * allowed and also BLOCK is not automatically
                 * called */
   struct gc_scope* root_gc; /* root gc */
+  int escape; /* emit escaped print for expressions , decided when the
+               * template is compiled like Jinja2 does */
 };
 
 static
@@ -144,6 +146,7 @@ void parser_init( struct parser* p , const char* src_key,
   p->scp_tp = 0;
   p->extends= 0;
   p->root_gc = scp;
+  p->escape = a->autoescape == AJJ_ESCAPE_HTML;
   assert(tp->scp);
 }
 
@@ -775,7 +778,7 @@ int parse_atomic( struct parser* p, struct emitter* em ) {
       break;
     case TK_STRING:
       strbuf_move(&(tk->lexeme),&str);
-      idx=program_const_str(em->prg,&str,1);
+      idx=program_const_literal(em->prg,&str,1);
       EMIT1(em,VM_LSTR,idx);
       tk_move(tk);
       break;
@@ -1266,7 +1269,7 @@ int parse_print( struct parser* p, struct emitter* em ) {
     tk_move(tk);
   } else {
     TRY(parse_expr(p,em));
-    EMIT0(em,VM_PRINT);
+    EMIT0(em,p->escape ? VM_EPRINT : VM_PRINT);
     CONSUME(TK_REXP);
   }
   return 0;
@@ -1958,7 +1961,7 @@ parse_filter( struct parser* p , struct emitter* em ) {
   }
   CONSUME(TK_RSTMT);
   strbuf_move(&(tk->lexeme),&text);
-  text_idx=program_const_str(em->prg,&text,1);
+  text_idx=program_const_text(em->prg,&text,1);
   EMIT1_AT(em,vm_lstr,VM_LSTR,text_idx);
   tk_move(tk);
   TRY(finish_scope_tag(p,TK_ENDFILTER));
@@ -2002,7 +2005,8 @@ int parse_set( struct parser* p, struct emitter* em ) {
     tk_move(tk);
     EXPECT(TK_TEXT);
     strbuf_move(&(tk->lexeme),&str);
-    txt_idx=program_const_str(em->prg,&str,1);
+    /* the text is markup , it is not escaped when printed */
+    txt_idx=program_const_text(em->prg,&str,1);
     tk_move(tk);
     /* load the text on to stack */
     EMIT1(em,VM_LSTR,txt_idx);
@@ -2038,6 +2042,43 @@ parse_do( struct parser* p , struct emitter* em ) {
   return 0;
 }
 
+/* Flush , hands the output rendered so far to the consumer */
+static int
+parse_flush( struct parser* p , struct emitter* em ) {
+  struct tokenizer* tk = &(p->tk);
+  assert( tk->tk == TK_FLUSH );
+  tk_move(tk);
+  EMIT0(em,VM_FLUSH);
+  CONSUME(TK_RSTMT);
+  return 0;
+}
+
+/* Autoescape , turns escaping on or off for the expressions inside of
+ * it. It only changes what code is emitted , so it costs nothing when
+ * rendering */
+static int
+parse_autoescape( struct parser* p , struct emitter* em ) {
+  struct tokenizer* tk = &(p->tk);
+  int escape = p->escape;
+  assert( tk->tk == TK_AUTOESCAPE );
+  tk_move(tk);
+  if( tk->tk == TK_TRUE ) {
+    p->escape = 1;
+  } else if( tk->tk == TK_FALSE ) {
+    p->escape = 0;
+  } else {
+    parser_rpt_err(p,"Autoescape expects true or false!");
+    return -1;
+  }
+  tk_move(tk);
+  CONSUME(TK_RSTMT);
+  TRY(parse_scope(p,em,0,0,0));
+  CONSUME(TK_ENDAUTOESCAPE);
+  CONSUME(TK_RSTMT);
+  p->escape = escape;
+  return 0;
+}
+
 /* Move */
 static int
 parse_move( struct parser* p , struct emitter* em ) {
@@ -2427,9 +2468,8 @@ parse_scope( struct parser* p , struct emitter* em ,
         struct string text;
         int text_id;
         strbuf_move(&(tk->lexeme),&text);
-        text_id = program_const_str(em->prg,&text,1);
-        EMIT1(em,VM_LSTR,text_id);
-        EMIT0(em,VM_PRINT);
+        text_id = program_const_text(em->prg,&text,1);
+        EMIT1(em,VM_PSTR,text_id);
         tk_move(tk);
       }
     }
@@ -2454,6 +2494,7 @@ parse_scope( struct parser* p , struct emitter* em ,
           HANDLE_CASE(MACRO,macro)
           HANDLE_CASE(BLOCK,block)
           HANDLE_CASE(WITH,with)
+          HANDLE_CASE(AUTOESCAPE,autoescape)
           case TK_INCLUDE:
             if( is_in_main(p) )
               TRY(parse_include(p,em));
@@ -2481,6 +2522,9 @@ parse_scope( struct parser* p , struct emitter* em ,
           case TK_MOVE:
             TRY(parse_move(p,em));
             break;
+          case TK_FLUSH:
+            TRY(parse_flush(p,em));
+            break;
           case TK_BREAK:
             if( lex_scope_top(p)->in_loop ) {
               TRY(parse_break(p,em));
@@ -2549,14 +2593,16 @@ parse( struct ajj* a, const char* key,
   struct gc_scope temp_scp; /* temporary gc scope , which enable us
                              * to delete all the garbage if we parse
                              * failed */
+  struct ajj* s = a->store; /* template is compiled into the store ,
+                             * no lock is held */
 
-  tmpl = ajj_new_template(a,key,src,own,ts);
+  tmpl = ajj_new_template(s,key,src,own,ts);
   assert(tmpl);
 
   /* init the temporary gc scope */
   gc_init_temp(&temp_scp,tmpl->scp);
   /* start parsing */
-  parser_init(&p,key,src,a,tmpl,&temp_scp);
+  parser_init(&p,key,src,s,tmpl,&temp_scp);
   /* enter the lexical scope for function */
   CHECK(lex_scope_jump(&p)!=NULL);
   /* STARTS for parsing main */
@@ -2568,12 +2614,13 @@ parse( struct ajj* a, const char* key,
   alloc_func_builtin_var(&p);
   if(parse_scope(&p,&em,1,1,0)) {
     /* delete all the data in temporary gc scope */
-    gc_scope_exit(a,&temp_scp);
+    gc_scope_exit(s,&temp_scp);
     /* destroy the parser, it will delete all the stacked
      * lexical scope  as well */
     parser_destroy(&p);
     /* we can only delete *this* template */
-    ajj_delete_template(a,key);
+    ajj_delete_template(s,key);
+    if(s != a) memcpy(ajj_err_buf(a),s->err,ERROR_BUFFER_SIZE);
     return NULL;
   }
   /* EMIT a return instruction */
@@ -0,0 +1,357 @@
+#include "ajj-priv.h"
+
+/* =============================================================
+ * Render worker pool
+ * Each worker owns an engine forked from the engine that creates
+ * the pool , so the slabs and the error buffer of a worker are reused
+ * by all the jobs it runs. Each worker also owns a job deque , the
+ * submitted jobs are spread over the deques in round robin order. A
+ * worker runs the oldest job in its own deque and an idle worker
+ * steals the newest job from the other end of a busy worker's deque ,
+ * so the owner and the thief rarely meet each other.
+ * ===========================================================*/
+
+struct ajj_job {
+  char* file;
+  struct ajj_io* output;
+  void* udata;
+  ajj_job_callback cb;
+  void* cb_data;
+  struct ajj_pool* pool;
+  char* err;  /* error message if the render fails */
+  struct env_version* env; /* snapshot of the including rendering ,
+                            * NULL for the jobs submitted by the user */
+  struct vm_budget budget; /* budget of the including rendering */
+  int limited; /* whether the budget applies */
+  int ret;
+  int done;   /* protected by the pool lock */
+  int detach; /* handle is freed , job is released once it is done */
+};
+
+struct job_deque {
+  struct ajj_job** job;
+  size_t head;
+  size_t tail;
+  size_t cap;
+  mutex_t lock;
+};
+
+struct pool_worker {
+  struct ajj_pool* pool;
+  struct ajj* a; /* forked engine */
+  struct job_deque dq;
+  thread_t tid;
+};
+
+struct ajj_pool {
+  struct pool_worker* worker;
+  size_t len;
+  size_t nspawn; /* number of workers started */
+  size_t next; /* deque for next submitted job */
+  size_t pending; /* number of jobs submitted but not taken , atomic */
+  size_t idle; /* number of workers waiting for jobs , atomic */
+  int stop;
+  mutex_t lock;
+  cond_t wake; /* signaled when a job is submitted to idle workers */
+  cond_t done; /* signaled when a job is done */
+};
+
+static
+void deque_init( struct job_deque* d ) {
+  d->job = NULL;
+  d->head = d->tail = d->cap = 0;
+  mutex_init(&(d->lock));
+}
+
+static
+void deque_destroy( struct job_deque* d ) {
+  assert(d->head == d->tail);
+  free(d->job);
+  mutex_destroy(&(d->lock));
+}
+
+static
+void deque_push( struct job_deque* d , struct ajj_job* job ) {
+  mutex_lock(&(d->lock));
+  if( d->tail == d->cap ) {
+    if( d->head > 0 ) {
+      /* reuse the space of the jobs already taken */
+      memmove(d->job,d->job+d->head,
+          sizeof(struct ajj_job*)*(d->tail-d->head));
+      d->tail -= d->head;
+      d->head = 0;
+    } else {
+      d->job = mem_grow(d->job,sizeof(struct ajj_job*),0,&(d->cap));
+    }
+  }
+  d->job[d->tail++] = job;
+  mutex_unlock(&(d->lock));
+}
+
+/* Take a job from the front ( oldest ) or the back ( newest ) */
+static
+struct ajj_job* deque_take( struct job_deque* d , int back ) {
+  struct ajj_job* ret = NULL;
+  mutex_lock(&(d->lock));
+  if( d->head < d->tail ) {
+    ret = back ? d->job[--d->tail] : d->job[d->head++];
+    if( d->head == d->tail ) d->head = d->tail = 0;
+  }
+  mutex_unlock(&(d->lock));
+  return ret;
+}
+
+static
+struct ajj_job* pool_take( struct ajj_pool* p , struct pool_worker* w ) {
+  struct ajj_job* job = deque_take(&(w->dq),0);
+  if(!job) {
+    size_t idx = (size_t)(w - p->worker);
+    size_t i;
+    for( i = 1 ; i < p->len && !job ; ++i ) {
+      job = deque_take(&(p->worker[(idx+i)%p->len].dq),1);
+    }
+  }
+  if(job) atomic_add(&(p->pending),-1);
+  return job;
+}
+
+static
+void job_free( struct ajj_job* job ) {
+  ajj_env_release(job->env);
+  free(job->file);
+  free(job->err);
+  free(job);
+}
+
+static
+void job_run( struct pool_worker* w , struct ajj_job* job ) {
+  struct ajj_pool* p = w->pool;
+  int detach;
+  int ret;
+  if(job->env) {
+    struct ajj_object* jinja = ajj_parse_template(w->a,job->file);
+    if(jinja) {
+      ret = vm_run_include(w->a,jinja,job->output,job->udata,job->env,
+          job->limited ? &(job->budget) : NULL);
+      ajj_unpin_template(w->a,jinja);
+    } else {
+      ret = -1;
+    }
+  } else {
+    ret = ajj_render_file(w->a,job->output,job->file,job->udata);
+  }
+  if(ret) {
+    const char* err = ajj_last_error(w->a);
+    job->err = strldup(err,strlen(err));
+  }
+  if(job->cb) job->cb(w->a,ret,job->cb_data);
+
+  mutex_lock(&(p->lock));
+  job->ret = ret;
+  job->done = 1;
+  detach = job->detach;
+  cond_broadcast(&(p->done));
+  mutex_unlock(&(p->lock));
+  /* nobody else touches a detached job once it is done */
+  if(detach) job_free(job);
+}
+
+static
+void* pool_worker_main( void* arg ) {
+  struct pool_worker* w = (struct pool_worker*)arg;
+  struct ajj_pool* p = w->pool;
+  for( ;; ) {
+    struct ajj_job* job = pool_take(p,w);
+    if(job) {
+      job_run(w,job);
+      continue;
+    }
+    if(atomic_get(&(p->pending))) {
+      /* counted but not pushed yet */
+      thread_yield();
+      continue;
+    }
+    /* a submitter either sees us idle and signals with the lock held ,
+     * or we see its job pending before waiting */
+    mutex_lock(&(p->lock));
+    atomic_add(&(p->idle),1);
+    while( atomic_get(&(p->pending)) == 0 && !p->stop )
+      cond_wait(&(p->wake),&(p->lock));
+    atomic_add(&(p->idle),-1);
+    if( atomic_get(&(p->pending)) == 0 ) {
+      /* stopped and all the jobs are drained */
+      mutex_unlock(&(p->lock));
+      break;
+    }
+    mutex_unlock(&(p->lock));
+  }
+  return NULL;
+}
+
+struct ajj_pool* ajj_pool_create( struct ajj* a , size_t nthread ) {
+  struct ajj_pool* p;
+  size_t i;
+  if( nthread == 0 ) {
+    long n = thread_cpu_count();
+    nthread = n <= 0 ? 1 : (size_t)n;
+  }
+  p = malloc(sizeof(*p));
+  p->worker = malloc(sizeof(struct pool_worker)*nthread);
+  p->len = 0;
+  p->nspawn = 0;
+  p->next = 0;
+  p->pending = 0;
+  p->idle = 0;
+  p->stop = 0;
+  mutex_init(&(p->lock));
+  cond_init(&(p->wake));
+  cond_init(&(p->done));
+
+  for( i = 0 ; i < nthread ; ++i ) {
+    struct pool_worker* w = p->worker + i;
+    w->pool = p;
+    w->a = ajj_fork(a);
+    deque_init(&(w->dq));
+  }
+  p->len = nthread;
+
+  /* If some workers cannot be started, their deques are still used and
+   * drained by the running workers through stealing */
+  for( p->nspawn = 0 ; p->nspawn < nthread ; ++p->nspawn ) {
+    struct pool_worker* w = p->worker + p->nspawn;
+    if(thread_create(&(w->tid),pool_worker_main,w))
+      break;
+  }
+
+  if( p->nspawn == 0 ) {
+    ajj_error(a,"Cannot create any worker thread for pool!");
+    ajj_pool_destroy(p);
+    return NULL;
+  }
+  return p;
+}
+
+void ajj_pool_destroy( struct ajj_pool* p ) {
+  size_t i;
+  mutex_lock(&(p->lock));
+  p->stop = 1;
+  cond_broadcast(&(p->wake));
+  mutex_unlock(&(p->lock));
+  for( i = 0 ; i < p->nspawn ; ++i ) {
+    thread_join(p->worker[i].tid);
+  }
+  for( i = 0 ; i < p->len ; ++i ) {
+    deque_destroy(&(p->worker[i].dq));
+    ajj_destroy(p->worker[i].a);
+  }
+  mutex_destroy(&(p->lock));
+  cond_destroy(&(p->wake));
+  cond_destroy(&(p->done));
+  free(p->worker);
+  free(p);
+}
+
+size_t ajj_pool_size( struct ajj_pool* p ) {
+  return p->nspawn;
+}
+
+static
+struct ajj_job*
+job_create( struct ajj_pool* p , struct ajj_io* output ,
+    const char* file , void* udata ,
+    ajj_job_callback cb , void* cb_data ) {
+  struct ajj_job* job = malloc(sizeof(*job));
+  job->file = strldup(file,strlen(file));
+  job->output = output;
+  job->udata = udata;
+  job->cb = cb;
+  job->cb_data = cb_data;
+  job->pool = p;
+  job->err = NULL;
+  job->env = NULL;
+  job->limited = 0;
+  job->ret = 0;
+  job->done = 0;
+  job->detach = 0;
+  return job;
+}
+
+/* The job is counted before it is pushed , so a worker taking it never
+ * sees the counter below zero. The pool lock is only taken when some
+ * worker is waiting */
+static
+void job_submit( struct ajj_pool* p , struct ajj_job* job ) {
+  size_t idx = atomic_add(&(p->next),1) % p->len;
+  atomic_add(&(p->pending),1);
+  deque_push(&(p->worker[idx].dq),job);
+  if(atomic_get(&(p->idle))) {
+    mutex_lock(&(p->lock));
+    cond_signal(&(p->wake));
+    mutex_unlock(&(p->lock));
+  }
+}
+
+struct ajj_job*
+ajj_pool_submit( struct ajj_pool* p , struct ajj_io* output ,
+    const char* file , void* udata ,
+    ajj_job_callback cb , void* cb_data ) {
+  struct ajj_job* job = job_create(p,output,file,udata,cb,cb_data);
+  job_submit(p,job);
+  return job;
+}
+
+struct ajj_job*
+pool_submit_include( struct ajj_pool* p , struct ajj_io* output ,
+    const char* file , void* udata , struct env_version* env ,
+    const struct vm_budget* budget ) {
+  struct ajj_job* job = job_create(p,output,file,udata,NULL,NULL);
+  atomic_add(&(env->ref),1);
+  job->env = env;
+  if(budget) {
+    job->budget = *budget;
+    job->limited = 1;
+  }
+  job_submit(p,job);
+  return job;
+}
+
+size_t pool_include_step( struct ajj_job* job ) {
+  ajj_job_wait(job);
+  return job->budget.step;
+}
+
+int ajj_job_done( struct ajj_job* job ) {
+  struct ajj_pool* p = job->pool;
+  int ret;
+  mutex_lock(&(p->lock));
+  ret = job->done;
+  mutex_unlock(&(p->lock));
+  return ret;
+}
+
+int ajj_job_wait( struct ajj_job* job ) {
+  struct ajj_pool* p = job->pool;
+  mutex_lock(&(p->lock));
+  while( !job->done )
+    cond_wait(&(p->done),&(p->lock));
+  mutex_unlock(&(p->lock));
+  return job->ret;
+}
+
+const char* ajj_job_error( struct ajj_job* job ) {
+  return ajj_job_wait(job) ? job->err : NULL;
+}
+
+void ajj_job_free( struct ajj_job* job ) {
+  struct ajj_pool* p = job->pool;
+  int done;
+  mutex_lock(&(p->lock));
+  done = job->done;
+  if(!done) job->detach = 1;
+  mutex_unlock(&(p->lock));
+  if(done) job_free(job);
+}
+
+void ajj_set_include_pool( struct ajj* a , struct ajj_pool* p ) {
+  a->inc_pool = p;
+}
@@ -0,0 +1,283 @@
+#include "ajj-priv.h"
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* =============================================================
+ * Resumable rendering
+ * A resumable rendering runs on its own stack ( a coroutine ). When a
+ * host function suspends , the whole rendering : call frames , value
+ * stack and the VM's C frames that link the nested runtimes of
+ * include/extends , is parked on that stack and the control goes back
+ * to the caller of ajj_render_resume. Resuming switches back onto the
+ * stack and the host function continues as if nothing happened. The
+ * current runtime of the engine is swapped on each switch , so
+ * renderings of the same engine can be interleaved by a single thread.
+ *
+ * The VM still recurses on the C stack for include , extends and calls ,
+ * and a host function suspends from the middle of its own C frame , so
+ * the rendering cannot be parked on the heap alone. The recursion is
+ * bounded by AJJ_MAX_NESTED_INCLUDE_SIZE and AJJ_MAX_CALL_STACK , the
+ * nested runtimes themselves live on the heap , so the deepest nesting
+ * takes well below AJJ_RENDER_STACK_SIZE.
+ *
+ * The coroutine is built on top of ucontext. It is obsolescent and gone
+ * from POSIX.1-2008 , but glibc and OSX still ship it ( OSX needs
+ * _XOPEN_SOURCE which is defined by all-in-one.c ) , a libc without it
+ * ( e.g. musl ) cannot build this file. The stack is mapped with a guard
+ * page at its low end , so overflowing it faults instead of corrupting
+ * the heap.
+ * ===========================================================*/
+
+enum {
+  RENDER_READY,
+  RENDER_RUNNING,
+  RENDER_SUSPENDED,
+  RENDER_DONE
+};
+
+struct ajj_render {
+  struct ajj* a;
+  char* file;
+  struct ajj_io* output;
+  void* udata;
+  struct runtime* rt; /* runtime of the rendering while it is parked */
+  char* stack; /* mapping of the stack , the guard page included */
+  size_t stack_size;
+  size_t guard; /* size of the guard page */
+  char* err; /* error message if the rendering fails */
+  int state;
+  int cancel; /* set when the handle is freed before it is done */
+  int ret;
+  ucontext_t ctx;
+  ucontext_t caller;
+};
+
+/* Rendering entering its stack for the first time. makecontext only
+ * passes int arguments , so the handle is handed over through this
+ * instead and read before anything else runs on the thread */
+static __thread struct ajj_render* render_enter;
+
+static
+void render_main( void ) {
+  struct ajj_render* r = render_enter;
+  struct ajj* a = r->a;
+  struct ajj_object* jinja = ajj_parse_template(a,r->file);
+  if(!jinja) {
+    r->ret = -1;
+  } else {
+    /* bind the output , so a sink pushed back suspends this rendering */
+    struct ajj* o_render = r->output->render;
+    r->output->render = a;
+    r->ret = vm_run_jinja(a,jinja,r->output,r->udata);
+    r->output->render = o_render;
+    ajj_unpin_template(a,jinja);
+  }
+  if(r->ret) {
+    const char* err = ajj_last_error(a);
+    r->err = strldup(err,strlen(err));
+  }
+  r->state = RENDER_DONE;
+  /* returns to r->caller through uc_link */
+}
+
+/* Map the stack with an inaccessible page below it , the stack grows
+ * down so an overflow hits the guard page */
+static
+int render_stack_map( struct ajj_render* r ) {
+  long pgsz = sysconf(_SC_PAGESIZE);
+  size_t page = pgsz > 0 ? (size_t)pgsz : 4096;
+  size_t sz = (AJJ_RENDER_STACK_SIZE + page - 1) / page * page + page;
+  char* stk = mmap(NULL,sz,PROT_READ|PROT_WRITE,
+      MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  if( stk == MAP_FAILED ) return -1;
+  if( mprotect(stk,page,PROT_NONE) ) {
+    munmap(stk,sz);
+    return -1;
+  }
+  r->stack = stk;
+  r->stack_size = sz;
+  r->guard = page;
+  return 0;
+}
+
+static
+void render_destroy( struct ajj_render* r ) {
+  if(r->stack) munmap(r->stack,r->stack_size);
+  free(r->file);
+  free(r->err);
+  free(r);
+}
+
+struct ajj_render*
+ajj_render_create( struct ajj* a , struct ajj_io* output ,
+    const char* file , void* udata ) {
+  struct ajj_render* r = malloc(sizeof(*r));
+  size_t len = strlen(file);
+  if(!r) {
+    ajj_error(a,"Cannot create rendering:%s , out of memory!",file);
+    return NULL;
+  }
+  r->a = a;
+  r->file = malloc(len+1);
+  r->output = output;
+  r->udata = udata;
+  r->rt = NULL;
+  r->stack = NULL;
+  r->err = NULL;
+  r->state = RENDER_READY;
+  r->cancel = 0;
+  r->ret = 0;
+  if(!r->file) {
+    ajj_error(a,"Cannot create rendering:%s , out of memory!",file);
+    render_destroy(r);
+    return NULL;
+  }
+  memcpy(r->file,file,len+1);
+  if(render_stack_map(r)) {
+    ajj_error(a,"Cannot map the stack for rendering:%s with errno:%s!",
+        file,strerror(errno));
+    render_destroy(r);
+    return NULL;
+  }
+  if(getcontext(&(r->ctx))) {
+    ajj_error(a,"Cannot create context for rendering:%s!",file);
+    render_destroy(r);
+    return NULL;
+  }
+  r->ctx.uc_stack.ss_sp = r->stack + r->guard;
+  r->ctx.uc_stack.ss_size = r->stack_size - r->guard;
+  r->ctx.uc_link = &(r->caller);
+  makecontext(&(r->ctx),render_main,0);
+  return r;
+}
+
+int ajj_render_resume( struct ajj_render* r ) {
+  struct ajj* a = r->a;
+  struct runtime* o_rt = a->rt;
+  struct ajj_render* o_render = a->render;
+  assert( r->state != RENDER_RUNNING );
+  if( r->state == RENDER_DONE ) return r->ret;
+
+  a->rt = r->rt;
+  a->render = r;
+  if( r->state == RENDER_READY ) render_enter = r;
+  r->state = RENDER_RUNNING;
+  swapcontext(&(r->caller),&(r->ctx));
+  /* back from ajj_suspend or the rendering is done */
+  r->rt = a->rt;
+  a->rt = o_rt;
+  a->render = o_render;
+  return r->state == RENDER_DONE ? r->ret : AJJ_RENDER_PENDING;
+}
+
+int ajj_suspend( struct ajj* a ) {
+  struct ajj_render* r = a->render;
+  if(!r) {
+    ajj_error(a,"Cannot suspend outside of a resumable rendering!");
+    return -1;
+  }
+  assert( r->state == RENDER_RUNNING );
+  /* a cancelled rendering is unwinding , it never parks again even if
+   * the host ignores the failure and suspends once more */
+  if(!r->cancel) {
+    r->state = RENDER_SUSPENDED;
+    swapcontext(&(r->ctx),&(r->caller));
+  }
+  if(r->cancel) {
+    ajj_error(a,"Rendering is cancelled!");
+    return -1;
+  }
+  return 0;
+}
+
+int ajj_render_done( struct ajj_render* r ) {
+  return r->state == RENDER_DONE;
+}
+
+const char* ajj_render_error( struct ajj_render* r ) {
+  return r->state == RENDER_DONE && r->ret ? r->err : NULL;
+}
+
+void ajj_render_free( struct ajj_render* r ) {
+  assert( r->state != RENDER_RUNNING );
+  if( r->state == RENDER_SUSPENDED ) {
+    /* unwind the rendering , ajj_suspend keeps failing from now on */
+    r->cancel = 1;
+    ajj_render_resume(r);
+    assert( r->state == RENDER_DONE );
+  }
+  render_destroy(r);
+}
+
+/* =============================================================
+ * Asynchronous template loading
+ * The handle of a pending load is shared by the vfs and the parked
+ * rendering , whoever releases it last frees it. So a rendering that
+ * is cancelled while its load is in flight just walks away.
+ * ===========================================================*/
+
+struct ajj_load {
+  struct ajj* a;
+  void* udata; /* user data of the waiting rendering */
+  void* src;
+  size_t len;
+  time_t ts;
+  int done; /* set once the vfs finishes the load */
+  int ref;
+};
+
+static
+void load_release( struct ajj_load* l ) {
+  if( atomic_add(&(l->ref),-1) == 1 ) {
+    if(l->src) ajj_vfs_free(l->a,l->src,l->len);
+    free(l);
+  }
+}
+
+const char* ajj_load_async( struct ajj* a , const char* filename ,
+    size_t* len , time_t* ts ) {
+  struct ajj_load* l = malloc(sizeof(*l));
+  const char* src;
+  assert( a->render != NULL );
+  l->a = a;
+  l->udata = a->render->udata;
+  l->src = NULL;
+  l->len = 0;
+  l->ts = 0;
+  l->done = 0;
+  l->ref = 2;
+  if(a->vfs.vfs_load_async(a,filename,l,a->vfs_udata)) {
+    free(l);
+    ajj_error(a,"Cannot load file with name:%s!",filename);
+    return NULL;
+  }
+  /* a spurious resume just parks the rendering again */
+  while( !atomic_get(&(l->done)) ) {
+    if(ajj_suspend(a)) {
+      load_release(l);
+      return NULL;
+    }
+  }
+  src = l->src;
+  *len = l->len;
+  *ts = l->ts;
+  l->src = NULL;
+  load_release(l);
+  if(!src) ajj_error(a,"Cannot load file with name:%s!",filename);
+  return src;
+}
+
+void ajj_load_finish( struct ajj_load* l , void* src , size_t len ,
+    time_t ts ) {
+  l->src = src;
+  l->len = len;
+  l->ts = ts;
+  atomic_swap(&(l->done),1);
+  load_release(l);
+}
+
+void* ajj_load_get_udata( struct ajj_load* l ) {
+  return l->udata;
+}
@@ -0,0 +1,235 @@
+#include "ajj-priv.h"
+
+/* =============================================================
+ * Tee IO
+ * Every write is forwarded to each of the child IO in order , so one
+ * rendering can go to the client , a cache and a hash at once instead
+ * of being rendered into memory and copied around.
+ * ===========================================================*/
+
+struct tee_sink {
+  struct ajj_io** child;
+  size_t cnt;
+};
+
+static
+int tee_sink_write( void* udata , const void* mem , size_t len ) {
+  struct tee_sink* s = (struct tee_sink*)udata;
+  size_t i;
+  for( i = 0 ; i < s->cnt ; ++i ) {
+    if( ajj_io_write(s->child[i],mem,len) < 0 )
+      return -1;
+  }
+  return 0;
+}
+
+static
+int tee_sink_writev( void* udata , const struct ajj_iovec* iov ,
+    size_t cnt ) {
+  struct tee_sink* s = (struct tee_sink*)udata;
+  size_t i;
+  for( i = 0 ; i < s->cnt ; ++i ) {
+    if( ajj_io_writev(s->child[i],iov,cnt) < 0 )
+      return -1;
+  }
+  return 0;
+}
+
+/* Every child is flushed even if one of them is busy , so a retry only
+ * waits for the busy ones */
+static
+int tee_sink_flush( void* udata ) {
+  struct tee_sink* s = (struct tee_sink*)udata;
+  int busy = 0;
+  size_t i;
+  for( i = 0 ; i < s->cnt ; ++i ) {
+    int ret = ajj_io_flush(s->child[i]);
+    if( ret < 0 ) return -1;
+    if( ret == AJJ_IO_BUSY ) busy = 1;
+  }
+  return busy ? AJJ_IO_BUSY : 0;
+}
+
+static
+void tee_sink_release( void* udata ) {
+  struct tee_sink* s = (struct tee_sink*)udata;
+  free(s->child);
+  free(s);
+}
+
+static const struct ajj_io_sink TEE_SINK = {
+  tee_sink_write,
+  tee_sink_writev,
+  tee_sink_flush,
+  NULL,
+  NULL
+};
+
+struct ajj_io*
+ajj_io_create_tee( struct ajj* a , struct ajj_io** child , size_t cnt ) {
+  struct tee_sink* s = malloc(sizeof(*s));
+  struct ajj_io* io;
+  s->child = malloc(sizeof(struct ajj_io*)*(cnt ? cnt : 1));
+  if(cnt) memcpy(s->child,child,sizeof(struct ajj_io*)*cnt);
+  s->cnt = cnt;
+  io = ajj_io_create_sink(a,&TEE_SINK,s);
+  io->out.sink.release = tee_sink_release;
+  return io;
+}
+
+/* =============================================================
+ * Hash IO
+ * The output is hashed with XXH64 ( seed 0 ) while it is written and
+ * dropped , so a cache key or an ETag needs no second pass over the
+ * bytes. Input is consumed in 32 bytes stripes , the tail of a write
+ * is kept until the next one fills the stripe.
+ * ===========================================================*/
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+#define XXH_ROTL(X,R) (((X) << (R)) | ((X) >> (64-(R))))
+
+struct hash_sink {
+  uint64_t v[4];
+  uint64_t total;
+  unsigned char buf[32];
+  size_t len;
+};
+
+static
+uint64_t xxh_read64( const unsigned char* p ) {
+  return (uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+    ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+    ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+    ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static
+uint32_t xxh_read32( const unsigned char* p ) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+    ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static
+uint64_t xxh_round( uint64_t acc , uint64_t in ) {
+  acc += in * XXH_P2;
+  acc = XXH_ROTL(acc,31);
+  return acc * XXH_P1;
+}
+
+static
+uint64_t xxh_merge( uint64_t acc , uint64_t v ) {
+  acc ^= xxh_round(0,v);
+  return acc * XXH_P1 + XXH_P4;
+}
+
+static
+void xxh_stripe( struct hash_sink* s , const unsigned char* p ) {
+  s->v[0] = xxh_round(s->v[0],xxh_read64(p));
+  s->v[1] = xxh_round(s->v[1],xxh_read64(p+8));
+  s->v[2] = xxh_round(s->v[2],xxh_read64(p+16));
+  s->v[3] = xxh_round(s->v[3],xxh_read64(p+24));
+}
+
+static
+int hash_sink_write( void* udata , const void* mem , size_t len ) {
+  struct hash_sink* s = (struct hash_sink*)udata;
+  const unsigned char* p = (const unsigned char*)mem;
+  s->total += len;
+  if( s->len + len < 32 ) {
+    memcpy(s->buf+s->len,p,len);
+    s->len += len;
+    return 0;
+  }
+  if( s->len ) {
+    size_t n = 32 - s->len;
+    memcpy(s->buf+s->len,p,n);
+    xxh_stripe(s,s->buf);
+    p += n;
+    len -= n;
+    s->len = 0;
+  }
+  for( ; len >= 32 ; p += 32 , len -= 32 )
+    xxh_stripe(s,p);
+  memcpy(s->buf,p,len);
+  s->len = len;
+  return 0;
+}
+
+static
+uint64_t hash_sink_digest( const struct hash_sink* s ) {
+  const unsigned char* p = s->buf;
+  size_t len = s->len;
+  uint64_t h;
+  if( s->total >= 32 ) {
+    h = XXH_ROTL(s->v[0],1) + XXH_ROTL(s->v[1],7) +
+      XXH_ROTL(s->v[2],12) + XXH_ROTL(s->v[3],18);
+    h = xxh_merge(h,s->v[0]);
+    h = xxh_merge(h,s->v[1]);
+    h = xxh_merge(h,s->v[2]);
+    h = xxh_merge(h,s->v[3]);
+  } else {
+    h = s->v[2] + XXH_P5; /* v[2] still holds the seed */
+  }
+  h += s->total;
+  for( ; len >= 8 ; p += 8 , len -= 8 ) {
+    h ^= xxh_round(0,xxh_read64(p));
+    h = XXH_ROTL(h,27) * XXH_P1 + XXH_P4;
+  }
+  if( len >= 4 ) {
+    h ^= (uint64_t)xxh_read32(p) * XXH_P1;
+    h = XXH_ROTL(h,23) * XXH_P2 + XXH_P3;
+    p += 4;
+    len -= 4;
+  }
+  for( ; len > 0 ; ++p , --len ) {
+    h ^= (*p) * XXH_P5;
+    h = XXH_ROTL(h,11) * XXH_P1;
+  }
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  h ^= h >> 32;
+  return h;
+}
+
+static
+void hash_sink_release( void* udata ) {
+  free(udata);
+}
+
+static const struct ajj_io_sink HASH_SINK = {
+  hash_sink_write,
+  NULL,
+  NULL,
+  NULL,
+  NULL
+};
+
+struct ajj_io* ajj_io_create_hash( struct ajj* a ) {
+  struct hash_sink* s = malloc(sizeof(*s));
+  struct ajj_io* io;
+  s->v[0] = XXH_P1 + XXH_P2;
+  s->v[1] = XXH_P2;
+  s->v[2] = 0;
+  s->v[3] = 0 - XXH_P1;
+  s->total = 0;
+  s->len = 0;
+  io = ajj_io_create_sink(a,&HASH_SINK,s);
+  io->out.sink.release = hash_sink_release;
+  return io;
+}
+
+int ajj_io_get_hash( struct ajj_io* io , uint64_t* hash ) {
+  if( io->tp != AJJ_IO_SINK ||
+      io->out.sink.release != hash_sink_release )
+    return -1;
+  ajj_io_sync(io);
+  *hash = hash_sink_digest((const struct hash_sink*)io->out.sink.udata);
+  return 0;
+}
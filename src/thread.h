@@ -0,0 +1,52 @@
+#ifndef _THREAD_H_
+#define _THREAD_H_
+
+/* Minimum threading layer used by the library. An ajj engine is still
+ * single threaded, multiple threads work on their own engine forked
+ * from the same parent and the only shared object is the template store
+ * which is protected by a lock. Currently only the POSIX thread is
+ * supported */
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sched.h>
+
+#define thread_t pthread_t
+#define thread_create(T,F,A) pthread_create((T),NULL,(F),(A))
+#define thread_join(T) pthread_join((T),NULL)
+
+#define mutex_t pthread_mutex_t
+#define mutex_init(M) pthread_mutex_init((M),NULL)
+#define mutex_destroy(M) pthread_mutex_destroy((M))
+#define mutex_lock(M) pthread_mutex_lock((M))
+#define mutex_unlock(M) pthread_mutex_unlock((M))
+/* returns 0 if the lock is taken */
+#define mutex_trylock(M) pthread_mutex_trylock((M))
+
+#define cond_t pthread_cond_t
+#define cond_init(C) pthread_cond_init((C),NULL)
+#define cond_destroy(C) pthread_cond_destroy((C))
+#define cond_wait(C,M) pthread_cond_wait((C),(M))
+#define cond_signal(C) pthread_cond_signal((C))
+#define cond_broadcast(C) pthread_cond_broadcast((C))
+
+/* Atomic operation , full memory barrier is implied */
+#define atomic_add(P,V) __sync_fetch_and_add((P),(V))
+#define atomic_get(P) __sync_fetch_and_add((P),0)
+/* Store a new value and return the old one , with a full barrier as
+ * well : __sync_lock_test_and_set is only an acquire barrier , so the
+ * writes before it could be seen after the new value */
+#define atomic_swap(P,V) __atomic_exchange_n((P),(V),__ATOMIC_SEQ_CST)
+/* Plain load/store , they never take the cache line exclusively for a
+ * read. The relaxed ones imply no barrier at all */
+#define atomic_load(P) __atomic_load_n((P),__ATOMIC_SEQ_CST)
+#define atomic_store(P,V) __atomic_store_n((P),(V),__ATOMIC_SEQ_CST)
+#define atomic_load_relaxed(P) __atomic_load_n((P),__ATOMIC_RELAXED)
+#define atomic_store_relaxed(P,V) __atomic_store_n((P),(V),__ATOMIC_RELAXED)
+
+#define thread_yield() sched_yield()
+
+/* Number of online processors , return value <= 0 means unknown */
+#define thread_cpu_count() sysconf(_SC_NPROCESSORS_ONLN)
+
+#endif /* _THREAD_H_ */
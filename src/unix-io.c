@@ -0,0 +1,165 @@
+/* INCLUDE ME WHEN YOU ARE IN LINUX SYSTEM */
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+
+/* =============================================================
+ * File descriptor IO
+ * The output is buffered in a large aligned buffer owned by the IO
+ * object and goes out with write/writev , so small writes never touch
+ * stdio or its lock. Once the buffered bytes reach the high water mark
+ * they are written out , which lets a client see the page while it is
+ * still being rendered. The descriptor is expected to be blocking.
+ * ===========================================================*/
+
+struct fd_sink {
+  int fd;
+  char* buf;
+  size_t len;
+  size_t cap;
+  size_t hwm; /* flush once this many bytes are buffered */
+};
+
+/* Write all the chunks , writev can stop in the middle of a chunk */
+static
+int fd_writev_all( int fd , struct iovec* iov , int cnt ) {
+  while( cnt > 0 ) {
+    ssize_t ret = writev(fd,iov,cnt);
+    size_t done;
+    if( ret < 0 ) {
+      if( errno == EINTR ) continue;
+      return -1;
+    }
+    done = (size_t)ret;
+    while( cnt > 0 && done >= iov->iov_len ) {
+      done -= iov->iov_len;
+      ++iov;
+      --cnt;
+    }
+    if( cnt > 0 ) {
+      iov->iov_base = (char*)iov->iov_base + done;
+      iov->iov_len -= done;
+    }
+  }
+  return 0;
+}
+
+static
+int fd_sink_flush( void* udata ) {
+  struct fd_sink* s = (struct fd_sink*)udata;
+  struct iovec iov;
+  if( s->len == 0 ) return 0;
+  iov.iov_base = s->buf;
+  iov.iov_len = s->len;
+  s->len = 0;
+  return fd_writev_all(s->fd,&iov,1);
+}
+
+static
+int fd_sink_check( struct fd_sink* s ) {
+  return s->len >= s->hwm ? fd_sink_flush(s) : 0;
+}
+
+/* Chunks that do not fit into the buffer go out with the buffered
+ * bytes in one writev */
+static
+int fd_sink_writev( void* udata , const struct ajj_iovec* iov ,
+    size_t cnt ) {
+  struct fd_sink* s = (struct fd_sink*)udata;
+  struct iovec vec[AJJ_IO_GATHER_IOV_SIZE+1];
+  size_t total = 0;
+  size_t i;
+  for( i = 0 ; i < cnt ; ++i ) total += iov[i].len;
+
+  if( total <= s->cap - s->len ) {
+    for( i = 0 ; i < cnt ; ++i ) {
+      memcpy(s->buf+s->len,iov[i].base,iov[i].len);
+      s->len += iov[i].len;
+    }
+    return fd_sink_check(s);
+  }
+
+  while( cnt > 0 ) {
+    int n = 0;
+    if( s->len > 0 ) {
+      vec[n].iov_base = s->buf;
+      vec[n].iov_len = s->len;
+      ++n;
+      s->len = 0;
+    }
+    for( ; n < (int)ARRAY_SIZE(vec) && cnt > 0 ; ++n , ++iov , --cnt ) {
+      vec[n].iov_base = (void*)iov->base;
+      vec[n].iov_len = iov->len;
+    }
+    if(fd_writev_all(s->fd,vec,n)) return -1;
+  }
+  return 0;
+}
+
+static
+int fd_sink_write( void* udata , const void* mem , size_t len ) {
+  struct ajj_iovec iov;
+  iov.base = mem;
+  iov.len = len;
+  return fd_sink_writev(udata,&iov,1);
+}
+
+static
+void* fd_sink_reserve( void* udata , size_t len , size_t* cap ) {
+  struct fd_sink* s = (struct fd_sink*)udata;
+  if( s->cap - s->len < len && fd_sink_flush(s) )
+    return NULL;
+  if( s->cap - s->len < len )
+    return NULL;
+  *cap = s->cap - s->len;
+  return s->buf + s->len;
+}
+
+static
+int fd_sink_commit( void* udata , size_t len ) {
+  struct fd_sink* s = (struct fd_sink*)udata;
+  assert( len <= s->cap - s->len );
+  s->len += len;
+  return fd_sink_check(s);
+}
+
+/* Write out whatever is left , the descriptor is not closed */
+static
+void fd_sink_release( void* udata ) {
+  struct fd_sink* s = (struct fd_sink*)udata;
+  fd_sink_flush(s);
+  free(s->buf);
+  free(s);
+}
+
+static const struct ajj_io_sink FD_SINK = {
+  fd_sink_write,
+  fd_sink_writev,
+  fd_sink_flush,
+  fd_sink_reserve,
+  fd_sink_commit
+};
+
+struct ajj_io*
+ajj_io_create_fd( struct ajj* a , int fd , size_t cap , size_t hwm ) {
+  struct fd_sink* s;
+  void* buf;
+  struct ajj_io* io;
+  if( cap == 0 ) cap = AJJ_IO_FD_BUF_SIZE;
+  if( hwm == 0 || hwm > cap ) hwm = cap;
+  if( posix_memalign(&buf,AJJ_IO_FD_BUF_ALIGN,cap) ) {
+    ajj_error(a,"Cannot allocate output buffer with size:%zu!",cap);
+    return NULL;
+  }
+  s = malloc(sizeof(*s));
+  s->fd = fd;
+  s->buf = buf;
+  s->len = 0;
+  s->cap = cap;
+  s->hwm = hwm;
+  io = ajj_io_create_sink(a,&FD_SINK,s);
+  io->out.sink.release = fd_sink_release;
+  return io;
+}
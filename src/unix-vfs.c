@@ -1,10 +1,58 @@
 /* INCLUDE ME WHEN YOU ARE IN LINUX SYSTEM */
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <dirent.h>
+
+/* Read the whole file into the buffer , read can return less than what
+ * we ask for, so loop until we get all of it */
+static int
+unix_vfs_read( struct ajj* a , const char* path , int fd ,
+    char* buf , size_t len ) {
+  size_t pos = 0;
+  while( pos < len ) {
+    ssize_t ret = read(fd,buf+pos,len-pos);
+    if(ret <0 && errno == EINTR) continue;
+    if(ret <=0) {
+      ajj_error(a,"Cannot read file:%s with errno:%s",
+          path,ret == 0 ? "unexpected end of file" : strerror(errno));
+      return -1;
+    }
+    pos += (size_t)ret;
+  }
+  buf[len] = 0;
+  return 0;
+}
+
+static int
+unix_vfs_open( struct ajj* a , const char* path , struct stat* st ,
+    time_t* ts ) {
+  int fd = open(path,O_RDONLY);
+  if(fd<0) {
+    ajj_error(a,"Cannot open file:%s with errno:%s",
+        path,strerror(errno));
+    return -1;
+  }
+  if(fstat(fd,st)) {
+    ajj_error(a,"Cannot state file:%s with errno:%s",
+        path,strerror(errno));
+    close(fd);
+    return -1;
+  }
+  if(st->st_size == 0) {
+    ajj_error(a,"Cannot read file:%s since it is empty",path);
+    close(fd);
+    return -1;
+  }
+  if(ts) {
+    *ts = st->st_mtime;
+  }
+  return fd;
+}
 
 static void*
 unix_vfs_load( struct ajj* a , const char* path ,
@@ -12,49 +60,79 @@ unix_vfs_load( struct ajj* a , const char* path ,
   struct stat st;
   int fd;
   char* buf;
-  ssize_t ret;
 
   (void)udata;
-  if(stat(path,&st)) {
-    ajj_error(a,"Cannot state file:%s with errno:%s",
-        path,strerror(errno));
+  if((fd = unix_vfs_open(a,path,&st,ts)) <0)
     return NULL;
-  }
-  if(ts) {
-    *ts = st.st_mtime;
-  }
 
-  /* open file */
-  fd = open(path,O_RDONLY);
-  if(fd<0) {
-    ajj_error(a,"Cannot open file:%s with errno:%s",
-        path,strerror(errno));
+  buf = malloc(st.st_size+1);
+  if(unix_vfs_read(a,path,fd,buf,st.st_size)) {
+    close(fd);
+    free(buf);
     return NULL;
   }
+  close(fd);
+  assert(len);
+  *len = st.st_size;
+  return buf;
+}
 
-  buf = malloc(st.st_size+1);
+/* Map the file read only. If the file size is not multiple of page size
+ * the rest of the last page is filled with zero by the kernel which is
+ * the null terminator we need. Otherwise the file is read into a read
+ * only anonymous mapping , so the memory is always released by munmap */
+static void*
+unix_vfs_map( struct ajj* a , const char* path ,
+    size_t* len , time_t* ts , void* udata ) {
+  struct stat st;
+  int fd;
+  size_t sz;
+  char* buf;
+  long pgsz = sysconf(_SC_PAGESIZE);
+
+  (void)udata;
+  if((fd = unix_vfs_open(a,path,&st,ts)) <0)
+    return NULL;
+  sz = (size_t)st.st_size;
 
-  /* read the data into buffer */
-  ret = read(fd,buf,st.st_size);
-  if(ret >0) {
-    buf[ret] = 0;
-    goto done;
+  if( pgsz > 0 && sz % (size_t)pgsz != 0 ) {
+    buf = mmap(NULL,sz,PROT_READ,MAP_PRIVATE,fd,0);
   } else {
-    ajj_error(a,"Cannot read file:%s with errno:%s",
-        path,strerror(errno));
-    goto fail;
+    buf = mmap(NULL,sz+1,PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if(buf != MAP_FAILED) {
+      if(unix_vfs_read(a,path,fd,buf,sz)) {
+        munmap(buf,sz+1);
+        close(fd);
+        return NULL;
+      }
+      mprotect(buf,sz+1,PROT_READ);
+    }
   }
-
-done:
   close(fd);
+  if(buf == MAP_FAILED) {
+    ajj_error(a,"Cannot map file:%s with errno:%s",
+        path,strerror(errno));
+    return NULL;
+  }
+  /* The length of the mapping is recovered by the length of the
+   * null terminated content, so file must not contain any null */
+  if(memchr(buf,0,sz)) {
+    ajj_error(a,"Cannot map file:%s since it contains null character",
+        path);
+    munmap(buf,sz+1);
+    return NULL;
+  }
   assert(len);
-  *len = st.st_size;
+  *len = sz;
   return buf;
+}
 
-fail:
-  close(fd);
-  free(buf);
-  return NULL;
+static void
+unix_vfs_unmap( struct ajj* a , void* mem , size_t len , void* udata ) {
+  (void)a;
+  (void)udata;
+  munmap(mem,len+1);
 }
 
 static int
@@ -82,6 +160,74 @@ unix_vfs_timestamp_is_current( struct ajj* a , const char* path ,
 struct ajj_vfs AJJ_DEFAULT_VFS = {
   unix_vfs_load,
   unix_vfs_timestamp,
-  unix_vfs_timestamp_is_current
+  unix_vfs_timestamp_is_current,
+  NULL,
+  NULL
 };
 
+struct ajj_vfs AJJ_MMAP_VFS = {
+  unix_vfs_map,
+  unix_vfs_timestamp,
+  unix_vfs_timestamp_is_current,
+  unix_vfs_unmap,
+  NULL
+};
+
+
+/* Collect all the regular files under a directory recursively , hidden
+ * files are skipped */
+static int
+unix_list_dir( struct ajj* a , const char* dir ,
+    char*** files , size_t* len , size_t* cap ) {
+  DIR* d = opendir(dir);
+  struct dirent* e;
+  if(!d) {
+    ajj_error(a,"Cannot open directory:%s with errno:%s",
+        dir,strerror(errno));
+    return -1;
+  }
+  while((e = readdir(d))) {
+    struct stat st;
+    struct strbuf path;
+    if(e->d_name[0] == '.') continue;
+    strbuf_init(&path);
+    strbuf_append(&path,dir,strlen(dir));
+    strbuf_append(&path,"/",1);
+    strbuf_append(&path,e->d_name,strlen(e->d_name));
+    if(stat(path.str,&st)) {
+      strbuf_destroy(&path);
+      continue;
+    }
+    if(S_ISDIR(st.st_mode)) {
+      int ret = unix_list_dir(a,path.str,files,len,cap);
+      strbuf_destroy(&path);
+      if(ret) {
+        closedir(d);
+        return -1;
+      }
+    } else if(S_ISREG(st.st_mode)) {
+      if(*len == *cap) {
+        *files = mem_grow(*files,sizeof(char*),0,cap);
+      }
+      (*files)[(*len)++] = strbuf_detach(&path,NULL,NULL);
+    } else {
+      strbuf_destroy(&path);
+    }
+  }
+  closedir(d);
+  return 0;
+}
+
+int ajj_compile_dir( struct ajj* a , const char* dir , size_t nthread ) {
+  char** files = NULL;
+  size_t len = 0;
+  size_t cap = 0;
+  size_t i;
+  int ret = unix_list_dir(a,dir,&files,&len,&cap);
+  if(!ret) {
+    ret = ajj_compile_all(a,(const char**)files,len,nthread);
+  }
+  for( i = 0 ; i < len ; ++i ) free(files[i]);
+  free(files);
+  return ret;
+}
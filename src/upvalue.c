@@ -15,6 +15,7 @@ upvalue_table_add( struct ajj* a,
    * we just link a value on top of it */
   if( (slot = map_find(&(tb->d),key)) == NULL ) {
     ret = slab_malloc(&(a->upval_slab));
+    ret->shared = 0;
     /* store the pointer */
     CHECK( !map_insert(&(tb->d),key,own,&ret) );
     ret->prev = NULL;
@@ -25,6 +26,7 @@ upvalue_table_add( struct ajj* a,
       return NULL;
     }
     ret = slab_malloc(&(a->upval_slab));
+    ret->shared = 0;
     ret->fixed = fixed;
     ret->prev = *slot;
     (*slot) = ret;
@@ -43,6 +45,7 @@ upvalue_table_add_c( struct ajj* a,
   struct upvalue** slot;
   if( (slot = map_find_c(&(tb->d),key)) == NULL ) {
     ret = slab_malloc(&(a->upval_slab));
+    ret->shared = 0;
     CHECK( !map_insert_c(&(tb->d),key,&ret) );
     ret->prev = NULL;
   } else {
@@ -50,6 +53,7 @@ upvalue_table_add_c( struct ajj* a,
       return NULL;
     }
     ret = slab_malloc(&(a->upval_slab));
+    ret->shared = 0;
     ret->fixed = fixed;
     ret->prev = *slot;
     (*slot) = ret;
@@ -60,18 +64,26 @@ upvalue_table_add_c( struct ajj* a,
 struct upvalue*
 upvalue_table_overwrite( struct ajj* a ,
     struct upvalue_table* tb,
-    const struct string* key ,
+    struct string* key ,
     int own ,
     int fixed ) {
   struct upvalue** slot;
-  if( (slot = map_find(&(tb->d),key)) == NULL ) {
+  const struct string* stored;
+  if( (slot = map_find_key(&(tb->d),key,&stored)) == NULL ) {
     struct upvalue* ret = slab_malloc(&(a->upval_slab));
+    ret->shared = 0;
     CHECK( !map_insert(&(tb->d),key,own,&ret));
     ret->prev = NULL;
     return ret;
   } else {
     assert(*slot);
     (*slot)->fixed = fixed;
+    if(own) {
+      /* the key already in the map stays , so the caller's key now
+       * refers to it */
+      string_destroy(key);
+      *key = *stored;
+    }
     return *slot;
   }
 }
@@ -84,6 +96,7 @@ upvalue_table_overwrite_c( struct ajj* a ,
   struct upvalue** slot;
   if( (slot = map_find_c(&(tb->d),key)) == NULL ) {
     struct upvalue* ret = slab_malloc(&(a->upval_slab));
+    ret->shared = 0;
     CHECK( !map_insert_c(&(tb->d),key,&ret));
     ret->prev = NULL;
     return ret;
@@ -170,8 +183,8 @@ upvalue_table_find_c( struct upvalue_table* tb,
   return NULL;
 }
 
-void
-upvalue_table_clear( struct ajj* a, struct upvalue_table* m ) {
+static
+void upvalue_table_free_all( struct ajj* a, struct upvalue_table* m ) {
   int itr;
   itr = map_iter_start(&(m->d));
   while( map_iter_has(&(m->d),itr) ) {
@@ -192,9 +205,20 @@ upvalue_table_clear( struct ajj* a, struct upvalue_table* m ) {
     }
     itr = map_iter_move(&(m->d),itr);
   }
+}
+
+void
+upvalue_table_clear( struct ajj* a, struct upvalue_table* m ) {
+  upvalue_table_free_all(a,m);
   map_destroy(&(m->d));
 }
 
+void
+upvalue_table_reset( struct ajj* a, struct upvalue_table* m ) {
+  upvalue_table_free_all(a,m);
+  map_clear(&(m->d));
+}
+
 struct upvalue_table*
 upvalue_table_destroy_one( struct ajj* a ,
     struct upvalue_table* m ) {
@@ -35,9 +35,13 @@ struct upvalue {
     struct ajj_value val;    /* value , could contain whatever */
     struct function gfunc;   /* function, global executable entry */
   } gut;
-  int type : 31;
+  int type : 30;
   int fixed: 1; /* indicate whether this upvalue is not
                  * chainable. */
+  int shared; /* referenced by an environment snapshot , so it must not
+               * be modified or freed in place. Set before the snapshot
+               * is published , and kept out of the bit field above since
+               * renderings read that word from other threads */
 };
 
 struct upvalue_table {
@@ -60,6 +64,10 @@ upvalue_table_destroy_one( struct ajj* a,
 void
 upvalue_table_clear( struct ajj* , struct upvalue_table * );
 
+/* Remove all the upvalues but keep the table for reusing */
+void
+upvalue_table_reset( struct ajj* , struct upvalue_table * );
+
 /* this function will recursively clean each
  * upvalue table layer and delete the table
  * itself. */
@@ -84,10 +92,13 @@ upvalue_table_add_c( struct ajj* a,
     int force,
     int fixed );
 
+/* Overwrite the upvalue with the key. If the key is owned and is already
+ * inside of the table , it is released and replaced with the one stored
+ * in the table */
 struct upvalue*
 upvalue_table_overwrite( struct ajj* a,
     struct upvalue_table* ,
-    const struct string* ,
+    struct string* ,
     int own ,
     int fixed );
 
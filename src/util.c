@@ -1,5 +1,6 @@
 #include "util.h"
 #include <stdio.h>
+#include <float.h>
 #include "memmem.c" /* for memmem */
 
 /* char string table */
@@ -345,8 +346,10 @@ void strbuf_reserve( struct strbuf* buf , size_t cap ) {
   nbuf = malloc(cap);
   if( buf->str ) {
     memcpy(nbuf,buf->str,buf->len);
-    buf->str[buf->len] = 0;
+    nbuf[buf->len] = 0;
     free(buf->str);
+  } else {
+    nbuf[0] = 0;
   }
   buf->str = nbuf;
   buf->cap = cap;
@@ -378,7 +381,7 @@ int strbuf_push_rune( struct strbuf* buf , Rune c ) {
 
 void strbuf_append( struct strbuf* buf , const char* str , size_t len ) {
   if( buf->cap == 0 || buf->cap <= buf->len + len + 1 ) {
-    buf->str = mem_grow(buf->str,sizeof(0),len,&(buf->cap));
+    buf->str = mem_grow(buf->str,sizeof(char),len,&(buf->cap));
   }
   memcpy(buf->str+buf->len,str,len);
   buf->len += len;
@@ -804,6 +807,17 @@ void* map_find( struct map* d , const struct string* key ) {
   }
 }
 
+void* map_find_key( struct map* d , const struct string* key ,
+    const struct string** stored ) {
+  struct map_entry* e = map_insert_entry(d,key,map_hash(key),0);
+  if( e ) {
+    *stored = &(e->key);
+    return MAP_VALUE(d,e);
+  } else {
+    return NULL;
+  }
+}
+
 void* map_find_c( struct map* d , const char* key ) {
   struct string k;
   struct map_entry* e;
@@ -968,6 +982,26 @@ void slab_free( struct slab* sl , void* ptr ) {
   }
 }
 
+void slab_merge( struct slab* sl , struct slab* other ) {
+  struct chunk* c = other->ck;
+  struct freelist* f = other->fl;
+  assert(sl->obj_sz == other->obj_sz);
+  if(c) {
+    while(c->next) c = c->next;
+    c->next = sl->ck;
+    sl->ck = other->ck;
+  }
+  if(f) {
+    while(f->next) f = f->next;
+    f->next = sl->fl;
+    sl->fl = other->fl;
+  }
+  sl->all_cap += other->all_cap;
+  other->ck = NULL;
+  other->fl = NULL;
+  other->all_cap = 0;
+}
+
 void slab_destroy( struct slab* sl ) {
   struct chunk* c = sl->ck;
   struct chunk* n;
@@ -984,6 +1018,16 @@ void slab_destroy( struct slab* sl ) {
 /* ===============================
  * Other
  * =============================*/
+unsigned int data_hash( const char* data , size_t len ) {
+  unsigned int h = 2166136261U;
+  size_t i;
+  for( i = 0 ; i < len ; ++i ) {
+    h ^= (unsigned char)data[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
 int is_int( double val ) {
   double i;
   modf(val,&i);
@@ -993,21 +1037,590 @@ int is_int( double val ) {
     return 0;
 }
 
-char* dtoc( double val , size_t* len ) {
-  char buf[256];
-  if( is_int(val) ) {
-    int r;
-    r = sprintf(buf,"%d",(int)(val)); /* very slow :( */
-    assert( r> 0 && r < 256 );
-    *len = (size_t)r;
-    return strdup(buf);
+/* Two digits at a time , halves the number of divisions */
+static const char DIGIT_PAIRS[] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+static const double POW10[] = {
+  1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,
+  1e8,1e9,1e10,1e11,1e12,1e13,1e14,1e15
+};
+
+/* Numbers below this are exact in a double together with all the
+ * scaled values we try for the fraction part */
+#define DTOC_EXACT_MAX 1e15
+/* Below this Python switches to exponent form , so do we */
+#define DTOC_FIXED_MIN 1e-4
+
+/* Write digits of v backwards , end points one past the last digit */
+static
+char* utoa_rev( uint64_t v , char* end ) {
+  while( v >= 100 ) {
+    const char* d = DIGIT_PAIRS + (v % 100)*2;
+    v /= 100;
+    *--end = d[1];
+    *--end = d[0];
+  }
+  if( v >= 10 ) {
+    const char* d = DIGIT_PAIRS + v*2;
+    *--end = d[1];
+    *--end = d[0];
+  } else {
+    *--end = (char)('0' + v);
+  }
+  return end;
+}
+
+/* Fixed size unsigned big integer , large enough for the scaled values
+ * of any double ( about 2^1132 at most ) , so no heap is involved */
+#define BIGNUM_LIMBS 40
+
+struct bignum {
+  uint32_t d[BIGNUM_LIMBS]; /* little endian */
+  int len;
+};
+
+static
+void bignum_set( struct bignum* b , uint64_t v ) {
+  b->len = 0;
+  while( v ) {
+    b->d[b->len++] = (uint32_t)v;
+    v >>= 32;
+  }
+}
+
+static
+void bignum_mul( struct bignum* b , uint32_t m ) {
+  uint64_t c = 0;
+  int i;
+  for( i = 0 ; i < b->len ; ++i ) {
+    c += (uint64_t)b->d[i] * m;
+    b->d[i] = (uint32_t)c;
+    c >>= 32;
+  }
+  if(c) {
+    assert( b->len < BIGNUM_LIMBS );
+    b->d[b->len++] = (uint32_t)c;
+  }
+}
+
+static
+void bignum_pow10( struct bignum* b , int n ) {
+  for( ; n >= 9 ; n -= 9 ) bignum_mul(b,1000000000);
+  if( n > 0 ) bignum_mul(b,(uint32_t)POW10[n]);
+}
+
+static
+void bignum_shl( struct bignum* b , int n ) {
+  int w = n / 32;
+  int s = n % 32;
+  int i;
+  if( b->len == 0 ) return;
+  if(s) {
+    uint32_t c = 0;
+    for( i = 0 ; i < b->len ; ++i ) {
+      uint32_t x = b->d[i];
+      b->d[i] = (x << s) | c;
+      c = x >> (32-s);
+    }
+    if(c) b->d[b->len++] = c;
+  }
+  assert( b->len + w <= BIGNUM_LIMBS );
+  if(w) {
+    for( i = b->len-1 ; i >= 0 ; --i ) b->d[i+w] = b->d[i];
+    for( i = 0 ; i < w ; ++i ) b->d[i] = 0;
+    b->len += w;
+  }
+}
+
+static
+int bignum_cmp( const struct bignum* l , const struct bignum* r ) {
+  int i;
+  if( l->len != r->len ) return l->len < r->len ? -1 : 1;
+  for( i = l->len-1 ; i >= 0 ; --i ) {
+    if( l->d[i] != r->d[i] ) return l->d[i] < r->d[i] ? -1 : 1;
+  }
+  return 0;
+}
+
+/* Compare l+r against s */
+static
+int bignum_add_cmp( const struct bignum* l , const struct bignum* r ,
+    const struct bignum* s ) {
+  struct bignum t;
+  uint64_t c = 0;
+  int n = l->len > r->len ? l->len : r->len;
+  int i;
+  for( i = 0 ; i < n ; ++i ) {
+    c += (uint64_t)(i < l->len ? l->d[i] : 0) +
+      (i < r->len ? r->d[i] : 0);
+    t.d[i] = (uint32_t)c;
+    c >>= 32;
+  }
+  if(c) t.d[n++] = (uint32_t)c;
+  t.len = n;
+  return bignum_cmp(&t,s);
+}
+
+/* l -= r , l must not be less than r */
+static
+void bignum_sub( struct bignum* l , const struct bignum* r ) {
+  int64_t c = 0;
+  int i;
+  for( i = 0 ; i < l->len ; ++i ) {
+    c += (int64_t)l->d[i] - (i < r->len ? r->d[i] : 0);
+    l->d[i] = (uint32_t)c;
+    c = c < 0 ? -1 : 0;
+  }
+  while( l->len > 0 && l->d[l->len-1] == 0 ) --l->len;
+}
+
+/* Shortest digits of a positive finite double that read back as the same
+ * double , the closest one if there are several. This is the free format
+ * algorithm of Burger and Dybvig run on exact integers : v lies in
+ * r/s , and the halfway points to its neighbours are (r-m-)/s and
+ * (r+m+)/s. The value is 0.DIGITS * 10^k , the number of digits is
+ * returned. It is the slow path for the few numbers Grisu3 gives up on */
+static
+int dtoa_exact( double v , char* digit , int* k ) {
+  struct bignum r , s , mp , mm;
+  uint64_t bits , f;
+  int e , ok , n = 0;
+  memcpy(&bits,&v,sizeof(bits));
+  f = bits & ((UINT64_C(1) << 52) - 1);
+  e = (int)((bits >> 52) & 0x7ff);
+  /* the neighbour below is closer when f is a power of 2 */
+  ok = ( e > 1 && f == 0 );
+  if(e) {
+    f |= UINT64_C(1) << 52;
+    e -= 1075;
+  } else {
+    e = -1074;
+  }
+  bignum_set(&r,f);
+  bignum_set(&mm,1);
+  if( e >= 0 ) {
+    bignum_shl(&r,e+1+ok);
+    bignum_set(&s,2 << ok);
+    bignum_shl(&mm,e);
+  } else {
+    bignum_shl(&r,1+ok);
+    bignum_set(&s,1);
+    bignum_shl(&s,1+ok-e);
+  }
+  mp = mm;
+  if(ok) bignum_shl(&mp,1);
+  /* round half to even when reading back , so the halfway points are
+   * inside of the range for an even mantissa */
+  ok = !(f & 1);
+
+  /* an estimate no larger than the real exponent , fixed up below */
+  *k = (int)floor(log10(v)) - 1;
+  if( *k >= 0 ) {
+    bignum_pow10(&s,*k);
+  } else {
+    bignum_pow10(&r,-*k);
+    bignum_pow10(&mm,-*k);
+    bignum_pow10(&mp,-*k);
+  }
+  while( bignum_add_cmp(&r,&mp,&s) >= !ok ) {
+    bignum_mul(&s,10);
+    ++*k;
+  }
+
+  for( ;; ) {
+    int d = 0;
+    int low , high;
+    bignum_mul(&r,10);
+    bignum_mul(&mm,10);
+    bignum_mul(&mp,10);
+    while( bignum_cmp(&r,&s) >= 0 ) {
+      bignum_sub(&r,&s);
+      ++d;
+    }
+    low = bignum_cmp(&r,&mm) < ok;
+    high = bignum_add_cmp(&r,&mp,&s) >= !ok;
+    if( low || high ) {
+      if( high && !low ) {
+        ++d;
+      } else if( high ) {
+        /* both work , pick the closer one and the even one on a tie */
+        struct bignum h = r;
+        int c;
+        bignum_shl(&h,1);
+        c = bignum_cmp(&h,&s);
+        if( c > 0 || ( c == 0 && (d & 1) ) ) ++d;
+      }
+      digit[n++] = (char)('0' + d);
+      break;
+    }
+    digit[n++] = (char)('0' + d);
+  }
+  return n;
+}
+
+/* =========================================
+ * Grisu3 of Florian Loitsch , "Printing Floating-Point Numbers Quickly
+ * and Accurately with Integers". The digits are generated with 64 bits
+ * integers only , and it reports the rare cases where it cannot prove
+ * the result is the shortest and closest one
+ * =======================================*/
+
+/* Normalized 64 bits approximation of 10^k for every 8th k from -348 ,
+ * 10^k = f * 2^e */
+static const struct {
+  uint64_t f;
+  int e;
+  int k;
+} GRISU_POW10[] = {
+  { UINT64_C(0xfa8fd5a0081c0288) , -1220 , -348 },
+  { UINT64_C(0xbaaee17fa23ebf76) , -1193 , -340 },
+  { UINT64_C(0x8b16fb203055ac76) , -1166 , -332 },
+  { UINT64_C(0xcf42894a5dce35ea) , -1140 , -324 },
+  { UINT64_C(0x9a6bb0aa55653b2d) , -1113 , -316 },
+  { UINT64_C(0xe61acf033d1a45df) , -1087 , -308 },
+  { UINT64_C(0xab70fe17c79ac6ca) , -1060 , -300 },
+  { UINT64_C(0xff77b1fcbebcdc4f) , -1034 , -292 },
+  { UINT64_C(0xbe5691ef416bd60c) , -1007 , -284 },
+  { UINT64_C(0x8dd01fad907ffc3c) , -980 , -276 },
+  { UINT64_C(0xd3515c2831559a83) , -954 , -268 },
+  { UINT64_C(0x9d71ac8fada6c9b5) , -927 , -260 },
+  { UINT64_C(0xea9c227723ee8bcb) , -901 , -252 },
+  { UINT64_C(0xaecc49914078536d) , -874 , -244 },
+  { UINT64_C(0x823c12795db6ce57) , -847 , -236 },
+  { UINT64_C(0xc21094364dfb5637) , -821 , -228 },
+  { UINT64_C(0x9096ea6f3848984f) , -794 , -220 },
+  { UINT64_C(0xd77485cb25823ac7) , -768 , -212 },
+  { UINT64_C(0xa086cfcd97bf97f4) , -741 , -204 },
+  { UINT64_C(0xef340a98172aace5) , -715 , -196 },
+  { UINT64_C(0xb23867fb2a35b28e) , -688 , -188 },
+  { UINT64_C(0x84c8d4dfd2c63f3b) , -661 , -180 },
+  { UINT64_C(0xc5dd44271ad3cdba) , -635 , -172 },
+  { UINT64_C(0x936b9fcebb25c996) , -608 , -164 },
+  { UINT64_C(0xdbac6c247d62a584) , -582 , -156 },
+  { UINT64_C(0xa3ab66580d5fdaf6) , -555 , -148 },
+  { UINT64_C(0xf3e2f893dec3f126) , -529 , -140 },
+  { UINT64_C(0xb5b5ada8aaff80b8) , -502 , -132 },
+  { UINT64_C(0x87625f056c7c4a8b) , -475 , -124 },
+  { UINT64_C(0xc9bcff6034c13053) , -449 , -116 },
+  { UINT64_C(0x964e858c91ba2655) , -422 , -108 },
+  { UINT64_C(0xdff9772470297ebd) , -396 , -100 },
+  { UINT64_C(0xa6dfbd9fb8e5b88f) , -369 , -92 },
+  { UINT64_C(0xf8a95fcf88747d94) , -343 , -84 },
+  { UINT64_C(0xb94470938fa89bcf) , -316 , -76 },
+  { UINT64_C(0x8a08f0f8bf0f156b) , -289 , -68 },
+  { UINT64_C(0xcdb02555653131b6) , -263 , -60 },
+  { UINT64_C(0x993fe2c6d07b7fac) , -236 , -52 },
+  { UINT64_C(0xe45c10c42a2b3b06) , -210 , -44 },
+  { UINT64_C(0xaa242499697392d3) , -183 , -36 },
+  { UINT64_C(0xfd87b5f28300ca0e) , -157 , -28 },
+  { UINT64_C(0xbce5086492111aeb) , -130 , -20 },
+  { UINT64_C(0x8cbccc096f5088cc) , -103 , -12 },
+  { UINT64_C(0xd1b71758e219652c) , -77 , -4 },
+  { UINT64_C(0x9c40000000000000) , -50 , 4 },
+  { UINT64_C(0xe8d4a51000000000) , -24 , 12 },
+  { UINT64_C(0xad78ebc5ac620000) , 3 , 20 },
+  { UINT64_C(0x813f3978f8940984) , 30 , 28 },
+  { UINT64_C(0xc097ce7bc90715b3) , 56 , 36 },
+  { UINT64_C(0x8f7e32ce7bea5c70) , 83 , 44 },
+  { UINT64_C(0xd5d238a4abe98068) , 109 , 52 },
+  { UINT64_C(0x9f4f2726179a2245) , 136 , 60 },
+  { UINT64_C(0xed63a231d4c4fb27) , 162 , 68 },
+  { UINT64_C(0xb0de65388cc8ada8) , 189 , 76 },
+  { UINT64_C(0x83c7088e1aab65db) , 216 , 84 },
+  { UINT64_C(0xc45d1df942711d9a) , 242 , 92 },
+  { UINT64_C(0x924d692ca61be758) , 269 , 100 },
+  { UINT64_C(0xda01ee641a708dea) , 295 , 108 },
+  { UINT64_C(0xa26da3999aef774a) , 322 , 116 },
+  { UINT64_C(0xf209787bb47d6b85) , 348 , 124 },
+  { UINT64_C(0xb454e4a179dd1877) , 375 , 132 },
+  { UINT64_C(0x865b86925b9bc5c2) , 402 , 140 },
+  { UINT64_C(0xc83553c5c8965d3d) , 428 , 148 },
+  { UINT64_C(0x952ab45cfa97a0b3) , 455 , 156 },
+  { UINT64_C(0xde469fbd99a05fe3) , 481 , 164 },
+  { UINT64_C(0xa59bc234db398c25) , 508 , 172 },
+  { UINT64_C(0xf6c69a72a3989f5c) , 534 , 180 },
+  { UINT64_C(0xb7dcbf5354e9bece) , 561 , 188 },
+  { UINT64_C(0x88fcf317f22241e2) , 588 , 196 },
+  { UINT64_C(0xcc20ce9bd35c78a5) , 614 , 204 },
+  { UINT64_C(0x98165af37b2153df) , 641 , 212 },
+  { UINT64_C(0xe2a0b5dc971f303a) , 667 , 220 },
+  { UINT64_C(0xa8d9d1535ce3b396) , 694 , 228 },
+  { UINT64_C(0xfb9b7cd9a4a7443c) , 720 , 236 },
+  { UINT64_C(0xbb764c4ca7a44410) , 747 , 244 },
+  { UINT64_C(0x8bab8eefb6409c1a) , 774 , 252 },
+  { UINT64_C(0xd01fef10a657842c) , 800 , 260 },
+  { UINT64_C(0x9b10a4e5e9913129) , 827 , 268 },
+  { UINT64_C(0xe7109bfba19c0c9d) , 853 , 276 },
+  { UINT64_C(0xac2820d9623bf429) , 880 , 284 },
+  { UINT64_C(0x80444b5e7aa7cf85) , 907 , 292 },
+  { UINT64_C(0xbf21e44003acdd2d) , 933 , 300 },
+  { UINT64_C(0x8e679c2f5e44ff8f) , 960 , 308 },
+  { UINT64_C(0xd433179d9c8cb841) , 986 , 316 },
+  { UINT64_C(0x9e19db92b4e31ba9) , 1013 , 324 },
+  { UINT64_C(0xeb96bf6ebadf77d9) , 1039 , 332 },
+  { UINT64_C(0xaf87023b9bf0ee6b) , 1066 , 340 }
+};
+
+#define GRISU_POW10_MIN (-348)
+#define GRISU_POW10_STEP 8
+
+/* Lowest and highest binary exponent of the scaled numbers , so the
+ * integer part of them fits into 32 bits */
+#define GRISU_ALPHA (-60)
+#define GRISU_GAMMA (-32)
+
+struct diy_fp {
+  uint64_t f;
+  int e;
+};
+
+static
+struct diy_fp diy_fp_mul( struct diy_fp x , struct diy_fp y ) {
+  const uint64_t M32 = 0xffffffffU;
+  uint64_t a = x.f >> 32 , b = x.f & M32;
+  uint64_t c = y.f >> 32 , d = y.f & M32;
+  uint64_t ac = a*c , bc = b*c , ad = a*d , bd = b*d;
+  uint64_t t = (bd >> 32) + (ad & M32) + (bc & M32) + (UINT64_C(1) << 31);
+  struct diy_fp r;
+  r.f = ac + (ad >> 32) + (bc >> 32) + (t >> 32);
+  r.e = x.e + y.e + 64;
+  return r;
+}
+
+static
+struct diy_fp diy_fp_normalize( struct diy_fp x ) {
+  while( !(x.f & (UINT64_C(1) << 63)) ) {
+    x.f <<= 1;
+    --x.e;
+  }
+  return x;
+}
+
+/* Move the last digit towards w while it gets closer , fails when the
+ * imprecision of the scaled numbers could change the answer */
+static
+int grisu_round_weed( char* digit , int n , uint64_t dist_high ,
+    uint64_t unsafe , uint64_t rest , uint64_t ten_kappa , uint64_t unit ) {
+  uint64_t small = dist_high - unit;
+  uint64_t big = dist_high + unit;
+  while( rest < small && unsafe - rest >= ten_kappa &&
+         ( rest + ten_kappa < small ||
+           small - rest >= rest + ten_kappa - small ) ) {
+    --digit[n-1];
+    rest += ten_kappa;
+  }
+  if( rest < big && unsafe - rest >= ten_kappa &&
+      ( rest + ten_kappa < big ||
+        big - rest > rest + ten_kappa - big ) )
+    return 0;
+  return 2*unit <= rest && rest <= unsafe - 4*unit;
+}
+
+/* Same result as dtoa_exact or 0 when it gives up */
+static
+int dtoa_grisu3( double v , char* digit , int* k ) {
+  struct diy_fp w , lo , hi , c , one;
+  uint64_t bits , unit = 1 , unsafe , frac , rest;
+  uint32_t integral , div;
+  int e , i , kappa , n = 0;
+  memcpy(&bits,&v,sizeof(bits));
+  w.f = bits & ((UINT64_C(1) << 52) - 1);
+  e = (int)((bits >> 52) & 0x7ff);
+  if(e) {
+    w.f |= UINT64_C(1) << 52;
+    w.e = e - 1075;
   } else {
-    int r;
-    r = sprintf(buf,"%f",val);
-    assert( r> 0 && r < 256 );
-    *len = (size_t)r;
-    return strdup(buf);
+    w.e = -1074;
   }
+  /* halfway points to the neighbours */
+  hi.f = (w.f << 1) + 1;
+  hi.e = w.e - 1;
+  hi = diy_fp_normalize(hi);
+  if( e > 1 && w.f == (UINT64_C(1) << 52) ) {
+    lo.f = (w.f << 2) - 1;
+    lo.e = w.e - 2;
+  } else {
+    lo.f = (w.f << 1) - 1;
+    lo.e = w.e - 1;
+  }
+  lo.f <<= lo.e - hi.e;
+  lo.e = hi.e;
+  w = diy_fp_normalize(w);
+
+  /* cached power that brings the exponent into [alpha,gamma] */
+  i = (int)ceil((GRISU_ALPHA - (w.e + 64) + 63) * 0.30102999566398114);
+  i = (i - GRISU_POW10_MIN - 1) / GRISU_POW10_STEP + 1;
+  c.f = GRISU_POW10[i].f;
+  c.e = GRISU_POW10[i].e;
+  w = diy_fp_mul(w,c);
+  lo = diy_fp_mul(lo,c);
+  hi = diy_fp_mul(hi,c);
+
+  /* widen by one unit to cover the error of the multiplications */
+  --lo.f;
+  ++hi.f;
+  unsafe = hi.f - lo.f;
+  one.e = w.e;
+  one.f = UINT64_C(1) << -one.e;
+  integral = (uint32_t)(hi.f >> -one.e);
+  frac = hi.f & (one.f - 1);
+  div = 1;
+  kappa = 1;
+  while( div <= integral / 10 ) {
+    div *= 10;
+    ++kappa;
+  }
+
+  while( kappa > 0 ) {
+    digit[n++] = (char)('0' + integral / div);
+    integral %= div;
+    --kappa;
+    rest = ((uint64_t)integral << -one.e) + frac;
+    if( rest < unsafe ) {
+      if(!grisu_round_weed(digit,n,hi.f - w.f,unsafe,rest,
+            (uint64_t)div << -one.e,unit))
+        return 0;
+      *k = n + kappa - GRISU_POW10[i].k;
+      return n;
+    }
+    div /= 10;
+  }
+  for( ;; ) {
+    frac *= 10;
+    unit *= 10;
+    unsafe *= 10;
+    digit[n++] = (char)('0' + (frac >> -one.e));
+    frac &= one.f - 1;
+    --kappa;
+    if( frac < unsafe ) {
+      if(!grisu_round_weed(digit,n,(hi.f - w.f)*unit,unsafe,frac,
+            one.f,unit))
+        return 0;
+      *k = n + kappa - GRISU_POW10[i].k;
+      return n;
+    }
+  }
+}
+
+static
+int dtoa_shortest( double v , char* digit , int* k ) {
+  int n = dtoa_grisu3(v,digit,k);
+  return n ? n : dtoa_exact(v,digit,k);
+}
+
+/* Write the shortest digits like printf's %g with the precision needed
+ * by them but at least 15 , so the switch to the exponent form stays
+ * where it was when printf did the job */
+static
+size_t dtoc_shortest( double val , char* buf ) {
+  char digit[20];
+  int k;
+  int n = dtoa_shortest(val < 0 ? -val : val,digit,&k);
+  int x = k - 1; /* exponent of the first digit */
+  size_t len = 0;
+  if( val < 0 ) buf[len++] = '-';
+  if( x < -4 || x >= (n < 15 ? 15 : n) ) {
+    char tmp[8];
+    char* end = tmp + sizeof(tmp);
+    char* p;
+    buf[len++] = digit[0];
+    if( n > 1 ) {
+      buf[len++] = '.';
+      memcpy(buf+len,digit+1,n-1);
+      len += n-1;
+    }
+    buf[len++] = 'e';
+    buf[len++] = x < 0 ? '-' : '+';
+    p = utoa_rev((uint64_t)(x < 0 ? -x : x),end);
+    if( end - p < 2 ) *--p = '0';
+    memcpy(buf+len,p,end-p);
+    len += end-p;
+  } else if( x < 0 ) {
+    buf[len++] = '0';
+    buf[len++] = '.';
+    for( ; x < -1 ; ++x ) buf[len++] = '0';
+    memcpy(buf+len,digit,n);
+    len += n;
+  } else {
+    int i;
+    for( i = 0 ; i <= x ; ++i ) buf[len++] = i < n ? digit[i] : '0';
+    if( n > x+1 ) {
+      buf[len++] = '.';
+      memcpy(buf+len,digit+x+1,n-x-1);
+      len += n-x-1;
+    }
+  }
+  buf[len] = 0;
+  return len;
+}
+
+/* Integer and short fraction numbers are formatted by hand , the
+ * fraction uses the fewest digits that read back as the same double.
+ * Everything else gets the shortest round trip digits from the exact
+ * generator above , so 0.1+0.2 shows as 0.30000000000000004 like Jinja */
+size_t dtoc_buf( double val , char* buf ) {
+  char tmp[DTOC_BUF_SIZE];
+  char* end = tmp + DTOC_BUF_SIZE;
+  double v = val < 0 ? -val : val;
+
+  if( v < DTOC_EXACT_MAX ) {
+    uint64_t i = (uint64_t)v;
+    char* p = NULL;
+    size_t pos = 0;
+    if( (double)i == v ) {
+      p = utoa_rev(i,end);
+    } else if( v >= DTOC_FIXED_MIN ) {
+      int k;
+      for( k = 1 ; k < (int)ARRAY_SIZE(POW10) &&
+                   v*POW10[k] < DTOC_EXACT_MAX ; ++k ) {
+        uint64_t m = (uint64_t)(v*POW10[k] + 0.5);
+        if( (double)m / POW10[k] == v ) {
+          size_t frac = (size_t)k;
+          p = utoa_rev(m,end);
+          while( (size_t)(end-p) <= frac ) *--p = '0';
+          pos = (size_t)(end-p) - frac; /* digits before the point */
+          break;
+        }
+      }
+    }
+    if(p) {
+      size_t n = (size_t)(end-p);
+      size_t len = 0;
+      if( val < 0 ) buf[len++] = '-';
+      if( pos ) {
+        memcpy(buf+len,p,pos);
+        len += pos;
+        buf[len++] = '.';
+        memcpy(buf+len,p+pos,n-pos);
+        len += n-pos;
+      } else {
+        memcpy(buf+len,p,n);
+        len += n;
+      }
+      buf[len] = 0;
+      return len;
+    }
+  }
+
+  if( val != val ) {
+    strcpy(buf,"nan");
+    return 3;
+  } else if( v > DBL_MAX ) {
+    strcpy(buf,val < 0 ? "-inf" : "inf");
+    return val < 0 ? 4 : 3;
+  }
+  return dtoc_shortest(val,buf);
+}
+
+char* dtoc( double val , size_t* len ) {
+  char buf[DTOC_BUF_SIZE];
+  *len = dtoc_buf(val,buf);
+  return strldup(buf,*len);
 }
 
 const char* const_cstr( char c ) {
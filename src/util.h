@@ -95,6 +95,10 @@ void* mem_grow( void* , size_t obj_sz , size_t append, size_t* old_cap );
  * the null terminator but the length , however it will return a string that
  * has a null terminators */
 char* strldup( const char* str , size_t len );
+
+/* FNV-1a hash of a memory block */
+unsigned int data_hash( const char* , size_t );
+
 /* =======================================================
  * String
  * It is a one time composes object,
@@ -251,6 +255,10 @@ int map_insert_c( struct map* , const char* key , const void* val );
 int map_remove( struct map* , const struct string* , void* val );
 int map_remove_c( struct map* , const char* key , void* val );
 void* map_find  ( struct map* , const struct string* );
+/* Same as map_find , the key stored inside of the map is returned in the
+ * last argument */
+void* map_find_key( struct map* , const struct string* ,
+    const struct string** );
 void* map_find_c( struct map* , const char* key );
 void map_clear( struct map* );
 #define map_size(d) ((d)->use)
@@ -286,11 +294,24 @@ void slab_init( struct slab* , size_t cap ,
 void slab_destroy(struct slab* );
 void* slab_malloc( struct slab* );
 void slab_free( struct slab* , void* );
+/* Move all the memory owned by the second slab into the first one. After
+ * merging, objects allocated from the second slab can be freed back to
+ * the first one. The second slab becomes empty */
+void slab_merge( struct slab* , struct slab* );
 
 /* =========================================
  * Other helper functions
  * =======================================*/
 int is_int( double val );
+
+/* Large enough for any number written by dtoc_buf , including the
+ * null terminator */
+#define DTOC_BUF_SIZE 32
+
+/* Format a number into buf without touching the heap , with the fewest
+ * digits that read back as the same number. Returns the length of the
+ * null terminated text */
+size_t dtoc_buf( double val , char* buf );
 char* dtoc( double val , size_t* len );
 const char* const_cstr( char c );
 
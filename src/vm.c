@@ -7,6 +7,7 @@
 #include "lex.h"
 #include "upvalue.h"
 #include "builtin.h"
+#include "escape.h"
 
 #include <limits.h>
 #include <math.h>
@@ -46,7 +47,7 @@ int run_jinja(struct ajj*);
 #define del_upvalue(A,N) \
   do { \
     upvalue_table_del(A,(A)->rt->global, \
-        N,&((A)->env)); \
+        N,(A)->rt->env); \
   } while(0)
 
 /* This FUNC_CALL actually means we want a TAIL call of a
@@ -62,7 +63,8 @@ int run_jinja(struct ajj*);
  * will be used as the return value for the C function builtin */
 
 #define VM_FUNC_CALL 1 /* indicate we want to call a script
-                        * function recursively */
+                        * function recursively , must be different
+                        * from AJJ_EXEC_SUSPEND */
 
 #define cur_frame(a) (&(a->rt->call_stk[a->rt->cur_call_stk-1]))
 #define cur_function(a) (cur_frame(a)->entry)
@@ -98,32 +100,57 @@ int program_add_par( struct program* prg , struct string* name ,
   }
 }
 
-int program_const_str( struct program* prg , struct string* str ,
-    int own ) {
-  if( str->len > SMALL_STRING_THRESHOLD ) {
-insert:
-    if( prg->str_len == prg->str_cap ) {
-      prg->str_tbl = mem_grow(prg->str_tbl,
-          sizeof(struct string),
-          0,
-          &(prg->str_cap));
-    }
-    if(own) {
-      prg->str_tbl[prg->str_len] = *str;
-    } else {
-      prg->str_tbl[prg->str_len] = string_dup(str);
-    }
-    return prg->str_len++;
+static
+int program_str_insert( struct program* prg , struct string* str ,
+    int own , int safe ) {
+  if( prg->str_len == prg->str_cap ) {
+    prg->str_tbl = mem_grow(prg->str_tbl,
+        sizeof(struct string),
+        0,
+        &(prg->str_cap));
+    prg->str_safe = realloc(prg->str_safe,prg->str_cap);
+  }
+  if(own) {
+    prg->str_tbl[prg->str_len] = *str;
   } else {
+    prg->str_tbl[prg->str_len] = string_dup(str);
+  }
+  prg->str_safe[prg->str_len] = (unsigned char)safe;
+  return prg->str_len++;
+}
+
+static
+int program_const_find( struct program* prg , struct string* str ,
+    int own , int safe ) {
+  if( str->len <= SMALL_STRING_THRESHOLD ) {
     size_t i = 0 ;
     for( ; i < prg->str_len ; ++i ) {
-      if( string_eq(prg->str_tbl+i,str) ) {
+      if( string_eq(prg->str_tbl+i,str) && prg->str_safe[i] == safe ) {
         if(own) string_destroy(str);
         return i;
       }
     }
-    goto insert;
   }
+  return program_str_insert(prg,str,own,safe);
+}
+
+/* Names and such are never printed with escape , so they are not
+ * scanned and just marked as unsafe */
+int program_const_str( struct program* prg , struct string* str ,
+    int own ) {
+  return program_const_find(prg,str,own,0);
+}
+
+int program_const_literal( struct program* prg , struct string* str ,
+    int own ) {
+  /* scanned once here , so printing a literal never scans it */
+  int safe = html_escape_scan(str->str,str->len) == str->len;
+  return program_const_find(prg,str,own,safe);
+}
+
+int program_const_text( struct program* prg , struct string* str ,
+    int own ) {
+  return program_const_find(prg,str,own,1);
 }
 
 int program_const_num( struct program* prg , double num ) {
@@ -151,6 +178,7 @@ void program_init( struct program* prg ) {
   prg->str_cap = AJJ_LOCAL_CONSTANT_SIZE;
   prg->str_tbl = malloc(sizeof(
         struct string)*AJJ_LOCAL_CONSTANT_SIZE);
+  prg->str_safe = malloc(AJJ_LOCAL_CONSTANT_SIZE);
 
   prg->num_len = 0;
   prg->num_cap = AJJ_LOCAL_CONSTANT_SIZE;
@@ -168,7 +196,7 @@ int unwind_stack( struct ajj* a , char* buf ) {
   size_t ln;
   size_t pos;
   char* start = buf;
-  char* end = a->err + ERROR_BUFFER_SIZE -1 ;
+  char* end = ajj_err_buf(a) + ERROR_BUFFER_SIZE -1 ;
   struct func_frame* fr = a->rt->call_stk;
   const char* obj_name;
   if(buf>=end) return 0;
@@ -226,12 +254,18 @@ int unwind_stack( struct ajj* a , char* buf ) {
 
 static
 void vm_rpt_err( struct ajj* a , const char* fmt , ... ) {
-  char* b = a->err;
+  char* b = ajj_err_buf(a);
   va_list vl;
-  char* end = a->err + ERROR_BUFFER_SIZE;
+  int n;
   va_start(vl,fmt);
-  b += vsnprintf(b,end-b,fmt,vl);
+  /* a truncated message still leaves room for the newline */
+  n = vsnprintf(b,ERROR_BUFFER_SIZE-1,fmt,vl);
+  va_end(vl);
+  if( n < 0 ) n = 0;
+  if( n > ERROR_BUFFER_SIZE-2 ) n = ERROR_BUFFER_SIZE-2;
+  b += n;
   *b = '\n'; ++b;
+  *b = 0;
   unwind_stack(a,b);
 }
 
@@ -240,7 +274,7 @@ void vm_rpt_err( struct ajj* a , const char* fmt , ... ) {
 static
 void rewrite_error( struct ajj* a ) {
   char msg[ERROR_BUFFER_SIZE];
-  strcpy(msg,a->err);
+  strcpy(msg,ajj_err_buf(a));
   vm_rpt_err(a,"%s",msg);
 }
 
@@ -288,7 +322,7 @@ double const_num( struct ajj* a, int idx ) {
 static
 void runtime_init( struct ajj* a , struct runtime* rt,
     struct ajj_object* jinja, struct ajj_io* output ,
-    int cnt , void* udata ) {
+    int cnt , void* udata , struct upvalue_table* env ) {
   rt->inc_cnt = cnt;
   rt->next = NULL;
   rt->prev = NULL;
@@ -300,8 +334,29 @@ void runtime_init( struct ajj* a , struct runtime* rt,
   rt->val_stk = malloc(sizeof(struct ajj_value)*
       AJJ_INIT_VALUE_STACK_SIZE);
   rt->output = output;
-  rt->global = upvalue_table_create(&(a->env));
+  rt->env = env;
+  rt->global = upvalue_table_create(env);
+  rt->pin_tbl = NULL;
+  rt->pin_len = rt->pin_cap = 0;
+  rt->frag = NULL;
+  rt->budget = NULL;
+  rt->ctx = NULL;
   rt->udata = udata;
+  /* template cannot be evicted while we are rendering it */
+  ajj_pin_template(a,jinja);
+}
+
+/* Record a template returned by ajj_parse_template , the runtime takes
+ * over its pin and releases it in runtime_destroy */
+static
+void runtime_pin( struct ajj* a , struct runtime* rt ,
+    struct ajj_object* jinja ) {
+  UNUSE_ARG(a);
+  if( rt->pin_len == rt->pin_cap ) {
+    rt->pin_tbl = mem_grow(rt->pin_tbl,sizeof(struct ajj_object*),
+        0,&(rt->pin_cap));
+  }
+  rt->pin_tbl[rt->pin_len++] = jinja;
 }
 
 static
@@ -314,8 +369,41 @@ void runtime_destroy( struct ajj* a , struct runtime* rt ) {
     c = n;
   }
   /* destroy all the global variable scope */
-  upvalue_table_destroy(a,rt->global,&(a->env));
+  upvalue_table_destroy(a,rt->global,rt->env);
   free(rt->val_stk);
+  /* output may still reference the text of the templates */
+  ajj_io_sync(rt->output);
+  /* unpin all the templates after the gc scopes are gone, since they
+   * may still reference the imported templates */
+  while( rt->pin_len > 0 )
+    ajj_unpin_template(a,rt->pin_tbl[--rt->pin_len]);
+  free(rt->pin_tbl);
+  ajj_unpin_template(a,rt->jinja);
+}
+
+/* Reset the runtime for rendering its template again. Everything the
+ * last rendering creates is released , but the value stack , the root
+ * gc scope and the global table are kept for reusing */
+static
+void runtime_reset( struct ajj* a , struct runtime* rt ,
+    struct ajj_io* output , void* udata ) {
+  struct gc_scope* c = rt->cur_gc;
+  while(c != rt->root_gc) {
+    struct gc_scope* n = c->parent;
+    gc_scope_destroy(a,c);
+    c = n;
+  }
+  gc_scope_exit(a,rt->root_gc);
+  upvalue_table_reset(a,rt->global);
+  ajj_io_sync(rt->output);
+  while( rt->pin_len > 0 )
+    ajj_unpin_template(a,rt->pin_tbl[--rt->pin_len]);
+  rt->cur_gc = rt->root_gc;
+  rt->cur_call_stk = 0;
+  rt->next = NULL;
+  rt->prev = NULL;
+  rt->output = output;
+  rt->udata = udata;
 }
 
 static
@@ -346,6 +434,7 @@ void program_destroy( struct program* prg ) {
   free(prg->codes);
   free(prg->spos);
   free(prg->str_tbl);
+  free(prg->str_safe);
   free(prg->num_tbl);
 }
 
@@ -549,6 +638,76 @@ int vm_to_boolean( const struct ajj_value* val ) {
   }
 }
 
+/* Same as ajj_display , but a number is formatted into buf which
+ * must hold DTOC_BUF_SIZE bytes , so it never needs the heap */
+static
+const char* vm_display( struct ajj* a , const struct ajj_value* val ,
+    char* buf , size_t* len , int* own ) {
+  if( val->type == AJJ_VALUE_NUMBER ) {
+    *len = dtoc_buf(val->value.number,buf);
+    *own = 0;
+    return buf;
+  }
+  return ajj_display(a,val,len,own);
+}
+
+/* Print with HTML escape. Numbers , booleans and safe strings have
+ * nothing to escape , an object's display goes through an escaping IO
+ * on the stack */
+static
+int vm_print_escape( struct ajj* a , const struct ajj_value* val ) {
+  struct ajj_io* output = a->rt->output;
+  if( val->type == AJJ_VALUE_STRING && !val->value.object->safe ) {
+    const struct string* str = &(val->value.object->val.str);
+    return html_escape_write(output,str->str,str->len);
+  } else if( val->type == AJJ_VALUE_OBJECT ) {
+    struct ajj_io eio;
+    html_escape_io_init(&eio,output);
+    return ajj_display_io(a,val,&eio);
+  } else {
+    return ajj_display_io(a,val,output);
+  }
+}
+
+#define vm_is_markup(V) \
+  ((V)->type == AJJ_VALUE_STRING && (V)->value.object->safe)
+
+/* Escape an operand that is concatenated with a safe string */
+static
+void vm_markup_escape( struct string* str , int* own ) {
+  struct strbuf buf;
+  if( html_escape_scan(str->str,str->len) == str->len )
+    return;
+  strbuf_init_cap(&buf,str->len+16);
+  html_escape_buf(&buf,str->str,str->len);
+  if(*own) string_destroy(str);
+  *str = strbuf_tostring(&buf);
+  *own = 1;
+}
+
+/* Concatenate the display of two values. As Jinja2's Markup , if one
+ * side is a safe string the other side is escaped and the result stays
+ * safe , so it is not escaped again when printed */
+static
+struct ajj_value vm_concate( struct ajj* a ,
+    const struct ajj_value* l , const struct ajj_value* r ,
+    struct string* ls , int own_l ,
+    struct string* rs , int own_r ) {
+  struct string str;
+  struct ajj_object* obj;
+  int markup = vm_is_markup(l) || vm_is_markup(r);
+  if(markup) {
+    if(!vm_is_markup(l)) vm_markup_escape(ls,&own_l);
+    if(!vm_is_markup(r)) vm_markup_escape(rs,&own_r);
+  }
+  str = string_concate(ls,rs);
+  if(own_l) string_destroy(ls);
+  if(own_r) string_destroy(rs);
+  obj = ajj_object_create_string(a,a->rt->cur_gc,str.str,str.len,1);
+  obj->safe = markup;
+  return ajj_value_assign(obj);
+}
+
 /* =============================
  * Specific instruction handler
  * ============================*/
@@ -557,17 +716,13 @@ struct ajj_value vm_cat( struct ajj* a,
     const struct ajj_value* l,
     const struct ajj_value* r ) {
   int own_l , own_r;
+  char lbuf[DTOC_BUF_SIZE];
+  char rbuf[DTOC_BUF_SIZE];
   struct string ls ;
   struct string rs ;
-  struct string str;
-  ls.str = ajj_display(a,l,&(ls.len),&own_l);
-  rs.str = ajj_display(a,r,&(rs.len),&own_r);
-  str = string_concate(&ls,&rs);
-  if(own_l) string_destroy(&ls);
-  if(own_r) string_destroy(&rs);
-  return ajj_value_assign(
-      ajj_object_create_string(a,a->rt->cur_gc,
-        str.str,str.len,1));
+  ls.str = vm_display(a,l,lbuf,&(ls.len),&own_l);
+  rs.str = vm_display(a,r,rbuf,&(rs.len),&own_r);
+  return vm_concate(a,l,r,&ls,own_l,&rs,own_r);
 }
 
 static
@@ -580,7 +735,6 @@ struct ajj_value vm_add(struct ajj* a,
     int own_l , own_r;
     struct string ls ;
     struct string rs ;
-    struct string str;
     ls = to_string(a,l,&own_l,fail);
     if( *fail ) return AJJ_NONE;
     rs = to_string(a,r,&own_r,fail);
@@ -589,12 +743,7 @@ struct ajj_value vm_add(struct ajj* a,
         string_destroy(&ls);
       return AJJ_NONE;
     }
-    str = string_concate(&ls,&rs);
-    if(own_l) string_destroy(&ls);
-    if(own_r) string_destroy(&rs);
-    return ajj_value_assign(
-        ajj_object_create_string(a,a->rt->cur_gc,
-          str.str,str.len,1));
+    return vm_concate(a,l,r,&ls,own_l,&rs,own_r);
   } else {
     double ln , rn;
     ln = to_number(a,l,fail);
@@ -866,6 +1015,10 @@ vm_call(struct ajj* a, struct ajj_object* obj ,
       const struct c_closure* cc = &(entry->f.c_fn);
       assert( obj == NULL );
       rval = cc->func(a,cc->udata,par,par_sz,ret);
+      while(rval == AJJ_EXEC_SUSPEND) {
+        if(ajj_suspend(a)) { rval = AJJ_EXEC_FAIL; break; }
+        rval = cc->func(a,cc->udata,par,par_sz,ret);
+      }
       if(rval == AJJ_EXEC_FAIL) {
         rewrite_error(a);
       }
@@ -874,6 +1027,10 @@ vm_call(struct ajj* a, struct ajj_object* obj ,
       assert( obj != NULL );
       assert( IS_CMETHOD(fr->entry) );
       rval = entry->f.c_mt(a,&v_obj,par,par_sz,ret);
+      while(rval == AJJ_EXEC_SUSPEND) {
+        if(ajj_suspend(a)) { rval = AJJ_EXEC_FAIL; break; }
+        rval = entry->f.c_mt(a,&v_obj,par,par_sz,ret);
+      }
       if(rval == AJJ_EXEC_FAIL) {
         rewrite_error(a);
       }
@@ -956,6 +1113,7 @@ struct ajj_value vm_lstr( struct ajj* a, int idx ) {
   assert(prg->str_len > (size_t)idx);
   obj = ajj_object_create_const_string(
       a,a->rt->cur_gc,cstr);
+  obj->safe = prg->str_safe[idx];
   return ajj_value_assign(obj);
 }
 
@@ -1020,11 +1178,6 @@ void vm_attrstk_push( struct ajj* a , struct ajj_value* obj,
   }
 }
 
-#define vm_print(A,STR) \
-  do { \
-    ajj_io_write((A)->rt->output,(STR)->str,(STR)->len); \
-  } while(0)
-
 #define vm_enter(A) \
   do { \
     (A)->rt->cur_gc = gc_scope_create((A),(A)->rt->cur_gc); \
@@ -1066,7 +1219,7 @@ void setup_env( struct ajj* a , int cnt , struct runtime* nrt ) {
     symbol = const_str(a,isys);
     if(iopt == UPVALUE_OPTIONAL) {
       if( upvalue_table_find(nrt->global,
-            symbol,&(a->env)) != NULL )
+            symbol,nrt->env) != NULL )
         continue; /* just skip it since we don't care */
     }
     uv = upvalue_table_add(a,
@@ -1129,10 +1282,162 @@ int setup_json_env( struct ajj* a , int cnt ,struct runtime* nrt) {
   return 0;
 }
 
+/* Parallel include
+ * When the engine has an include pool , the output of a top level
+ * rendering goes through an IO of the fragments. Until the first
+ * include is deferred to the pool , the output is written through to
+ * the real output , so the page still streams. After that it goes into
+ * a private buffer , each deferred include records the position of the
+ * buffer where its output belongs to , and all of them are stitched in
+ * source order once the rendering is done. A fragment renders against
+ * the environment snapshot and the budget of the including rendering */
+struct include_frag {
+  size_t pos; /* position inside of the buffer */
+  struct ajj_io* output;
+  struct ajj_job* job;
+};
+
+struct include_frags {
+  struct ajj_io io; /* output of the runtimes */
+  struct ajj_io* output; /* real output */
+  struct strbuf buf; /* output after the first deferred include */
+  struct env_version* env;
+  struct vm_budget* budget; /* budget of the including rendering */
+  struct include_frag* arr;
+  size_t len;
+  size_t cap;
+};
+
+static
+int frag_sink_write( void* udata , const void* mem , size_t len ) {
+  struct include_frags* frags = (struct include_frags*)udata;
+  if( frags->len == 0 )
+    return ajj_io_write(frags->output,mem,len) < 0 ? -1 : 0;
+  strbuf_append(&(frags->buf),(const char*)mem,len);
+  return 0;
+}
+
+/* {% flush %} only reaches the output before the first deferral */
+static
+int frag_sink_flush( void* udata ) {
+  struct include_frags* frags = (struct include_frags*)udata;
+  return frags->len == 0 ? ajj_io_flush(frags->output) : 0;
+}
+
+static const struct ajj_io_sink FRAG_SINK = {
+  frag_sink_write,
+  NULL,
+  frag_sink_flush,
+  NULL,
+  NULL
+};
+
+static
+void include_frags_init( struct include_frags* frags ,
+    struct ajj_io* output , struct env_version* env ) {
+  ajj_io_init_sink(&(frags->io),&FRAG_SINK,frags);
+  frags->output = output;
+  strbuf_init(&(frags->buf));
+  frags->env = env;
+  frags->budget = NULL;
+  frags->arr = NULL;
+  frags->len = frags->cap = 0;
+}
+
+static
+void include_defer( struct ajj* a , struct include_frags* frags ,
+    const char* name ) {
+  struct include_frag* f;
+  struct vm_budget rest;
+  if( frags->len == frags->cap ) {
+    frags->arr = mem_grow(frags->arr,sizeof(struct include_frag),
+        0,&(frags->cap));
+  }
+  f = frags->arr + frags->len++;
+  f->pos = frags->buf.len;
+  f->output = ajj_io_create_mem(a,0);
+  /* a fragment can only use what is left of the including rendering */
+  if(frags->budget) {
+    rest = *(frags->budget);
+    if(rest.limit)
+      rest.limit = rest.step < rest.limit ? rest.limit - rest.step : 1;
+  }
+  f->job = pool_submit_include(a->inc_pool,f->output,name,
+      a->rt->udata,frags->env,frags->budget ? &rest : NULL);
+}
+
+/* Charge the instructions a fragment runs on the pool to the including
+ * rendering , a resumable one is suspended once it runs out just like
+ * budget_charge does */
+static
+int include_charge( struct ajj* a , struct vm_budget* b , size_t step ,
+    int fail ) {
+  if( fail || !b->limit ) return fail;
+  b->step += step;
+  if( b->step >= b->limit ) {
+    if( a->render && !ajj_suspend(a) ) {
+      b->step = 0;
+      return 0;
+    }
+    ajj_error(a,"Rendering runs out of its instruction budget!");
+    return -1;
+  }
+  return 0;
+}
+
+/* A failed write fails the rendering right here , the output stays
+ * failed so the rest of the writes fail fast */
+static
+int include_write( struct ajj* a , struct ajj_io* output ,
+    const char* mem , size_t len , int fail ) {
+  if( ajj_io_write(output,mem,len) < 0 && !fail ) {
+    ajj_error(a,"Cannot write to the output!");
+    fail = -1;
+  }
+  return fail;
+}
+
+/* Write the buffer and all the fragments into the output. The first
+ * error is reported if the rendering itself works , all the jobs are
+ * waited for even if the output fails. Instructions of the fragments
+ * are charged to the including rendering here */
+static
+int include_flush( struct ajj* a , struct include_frags* frags ,
+    int fail ) {
+  struct ajj_io* output = frags->output;
+  const char* buf = frags->buf.str;
+  size_t off = 0;
+  size_t i;
+  for( i = 0 ; i < frags->len ; ++i ) {
+    struct include_frag* f = frags->arr + i;
+    const char* err;
+    fail = include_write(a,output,buf+off,f->pos-off,fail);
+    off = f->pos;
+    if( (err = ajj_job_error(f->job)) != NULL ) {
+      if(!fail) ajj_error(a,"%s",err);
+      fail = -1;
+    } else {
+      size_t l;
+      const char* c = ajj_io_get_content(f->output,&l);
+      if(frags->budget)
+        fail = include_charge(a,frags->budget,pool_include_step(f->job),
+            fail);
+      fail = include_write(a,output,c,l,fail);
+    }
+    ajj_job_free(f->job);
+    ajj_io_destroy(a,f->output);
+  }
+  fail = include_write(a,output,buf+off,frags->buf.len-off,fail);
+  free(frags->arr);
+  strbuf_destroy(&(frags->buf));
+  return fail;
+}
+
 static
 void vm_include( struct ajj* a , int type,
     int cnt , int* fail ) {
-  struct runtime nrt; /* new runtime */
+  struct runtime* nrt; /* new runtime , on heap to keep the C stack of
+                       * nested includes small */
   struct runtime*ort = a->rt;
   struct ajj_object* jinja; /* jinja template */
   struct ajj_value* jinja_na; /* jinja template name */
@@ -1155,6 +1460,15 @@ void vm_include( struct ajj* a , int type,
     *fail = 1;
     return;
   }
+  /* include without any context only depends on the environment ,
+   * so it can be rendered by another thread */
+  if( ort->frag && type == INCLUDE_UPVALUE && cnt == 0 ) {
+    include_defer(a,ort->frag,ajj_value_to_cstr(jinja_na));
+    stk_pop(a,1);
+    *fail = 0;
+    return;
+  }
+
   /* now we get the jinja template file name,
    * so we just need to load it into the mem */
   jinja = ajj_parse_template(a,ajj_value_to_cstr(jinja_na));
@@ -1165,24 +1479,31 @@ void vm_include( struct ajj* a , int type,
   }
 
   /* create new runtime for vm_include */
-  runtime_init(a, &nrt,jinja,a->rt->output,ort->inc_cnt+1,ort->udata);
+  nrt = malloc(sizeof(*nrt));
+  runtime_init(a,nrt,jinja,a->rt->output,ort->inc_cnt+1,ort->udata,
+      ort->env);
+  ajj_unpin_template(a,jinja); /* runtime holds its own pin */
+  nrt->frag = ort->frag;
+  nrt->budget = ort->budget;
+  nrt->ctx = ort->ctx;
 
   /* Before we do the rendering , we need to setup the
    * environment accordingly here. All the C side or
    * user defined upvalue are passed into the global
    * table right now */
   if(type == INCLUDE_UPVALUE) {
-    setup_env(a,cnt,&nrt);
+    setup_env(a,cnt,nrt);
   } else {
-    if(setup_json_env(a,cnt,&nrt)) {
+    if(setup_json_env(a,cnt,nrt)) {
       *fail = 1;
       goto fail;
     }
   }
 
-  a->rt = &nrt; /* new runtime set up */
+  a->rt = nrt; /* new runtime set up */
   *fail = run_jinja(a); /* start run the jinja */
-  runtime_destroy(a,&nrt); /* destroy the new runtime */
+  runtime_destroy(a,nrt); /* destroy the new runtime */
+  free(nrt);
   a->rt = ort; /* restore the old runtime */
   if(*fail) {
     /* the error report happened when parsing
@@ -1199,7 +1520,8 @@ void vm_include( struct ajj* a , int type,
   return;
 
 fail:
-  runtime_destroy(a,&nrt);
+  runtime_destroy(a,nrt);
+  free(nrt);
   a->rt = ort;
 }
 
@@ -1221,6 +1543,7 @@ void vm_import( struct ajj* a, int arg1 , int* fail ) {
       *fail = 1;
       return;
     } else {
+      runtime_pin(a,a->rt,jinja);
       val = ajj_value_assign(jinja);
       set_upvalue(a,symbol,&val,0,0,fail);
       if(*fail) return;
@@ -1266,7 +1589,7 @@ static
 void vm_extends( struct ajj* a , int* fail ) {
   struct ajj_value* temp_na = stk_top(a,1);
   struct ajj_object* jinja;
-  struct runtime nrt;
+  struct runtime* nrt;
   struct runtime* ort = a->rt; /* old runtime */
 
   if(ort->inc_cnt == AJJ_MAX_NESTED_INCLUDE_SIZE) {
@@ -1286,14 +1609,21 @@ void vm_extends( struct ajj* a , int* fail ) {
     *fail = 1; return;
   }
 
-  runtime_init(a,&nrt,jinja,ort->output,ort->inc_cnt+1,ort->udata);
+  nrt = malloc(sizeof(*nrt));
+  runtime_init(a,nrt,jinja,ort->output,ort->inc_cnt+1,ort->udata,
+      ort->env);
+  ajj_unpin_template(a,jinja); /* runtime holds its own pin */
+  nrt->frag = ort->frag;
+  nrt->budget = ort->budget;
+  nrt->ctx = ort->ctx;
   /* build the correct inheritance chain */
-  nrt.next = ort;
-  ort->prev = &nrt;
+  nrt->next = ort;
+  ort->prev = nrt;
 
-  a->rt = &nrt;
+  a->rt = nrt;
   *fail = run_jinja(a); /* run jinja */
-  runtime_destroy(a,&nrt);
+  runtime_destroy(a,nrt);
+  free(nrt);
   a->rt = ort;
   if(*fail) rewrite_error(a);
   ort->prev = NULL; /* reset to NULL */
@@ -1394,7 +1724,7 @@ static
 const struct function*
 resolve_test_function( struct ajj* a, const struct string* name ) {
   struct upvalue* uv;
-  uv = upvalue_table_find( &(a->env), name , NULL );
+  uv = upvalue_table_find( a->rt->env, name , NULL );
   if(!uv||(uv->type != UPVALUE_FUNCTION &&
         !IS_TEST(&(uv->gut.gfunc)))) {
     return NULL;
@@ -1615,6 +1945,73 @@ int vm_super( struct ajj* a,
   return AJJ_EXEC_FAIL;
 }
 
+/* Monotonic clock in milliseconds */
+static
+double clock_ms( void ) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (double)ts.tv_sec*1000.0 + (double)ts.tv_nsec/1000000.0;
+}
+
+static
+void budget_init( struct ajj* a , struct vm_budget* b ) {
+  b->step = 0;
+  b->clock = 0;
+  b->limit = a->step_limit;
+  b->deadline = a->time_limit ? clock_ms() + (double)a->time_limit : 0;
+}
+
+/* Set up the context of a top level rendering for its runtime */
+static
+void context_init( struct ajj* a , struct ajj_context* ctx ,
+    struct runtime* rt , void* udata ) {
+  ctx->a = a;
+  ctx->udata = udata;
+  ctx->err[0] = 0;
+  rt->ctx = ctx;
+  if( a->step_limit || a->time_limit ) {
+    budget_init(a,&(ctx->budget));
+    rt->budget = &(ctx->budget);
+  } else {
+    rt->budget = NULL;
+  }
+}
+
+/* Charge the instructions executed since the last check to the budget.
+ * A resumable rendering that uses up its instructions is suspended and
+ * gets a new budget once it is resumed , the others fail */
+static
+int budget_charge( struct ajj* a , size_t* step ) {
+  struct vm_budget* b = a->rt->budget;
+  b->step += *step;
+  b->clock += *step;
+  *step = 0;
+  if( b->limit && b->step >= b->limit ) {
+    if(!a->render) {
+      vm_rpt_err(a,"Rendering runs out of its instruction budget!");
+      return -1;
+    }
+    if(ajj_suspend(a)) {
+      rewrite_error(a);
+      return -1;
+    }
+    b->step = 0;
+  }
+  if( b->deadline != 0 && b->clock >= AJJ_BUDGET_CLOCK_INTERVAL ) {
+    b->clock = 0;
+    if( clock_ms() >= b->deadline ) {
+      vm_rpt_err(a,"Rendering runs out of its time budget!");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+#define BUDGET_CHECK() \
+  do { \
+    if( a->rt->budget && budget_charge(a,&step) ) goto fail; \
+  } while(0)
+
 #define RCHECK &fail); \
   do { \
     if(fail) goto fail; \
@@ -1629,6 +2026,7 @@ static
 int vm_main( struct ajj* a ) {
   int c;
   int fail;
+  size_t step = 0; /* instructions not charged to the budget yet */
 
 #define vm_beg(X) case VM_##X:
 #define vm_end(X) break;
@@ -1637,6 +2035,7 @@ int vm_main( struct ajj* a ) {
     instructions instr;
     next_instr(c,a);
     instr = BC_INSTRUCTION(c);
+    ++step;
 
     switch(instr) {
       vm_beg(ADD) {
@@ -1830,6 +2229,7 @@ int vm_main( struct ajj* a ) {
         struct ajj_object* obj;
         const struct function* f =
           resolve_free_function(a,fn,&obj);
+        BUDGET_CHECK();
         if( f == NULL ) {
           vm_rpt_err(a,"Cannot find function:%s!",fn->str);
           goto fail;
@@ -1862,7 +2262,7 @@ int vm_main( struct ajj* a ) {
         /* After resolving, the object returned from resolve_obj_block
          * can be not the same template currently rendering, because
          * it could be some template that is extends */
-
+        BUDGET_CHECK();
         if( f == NULL ) {
           vm_rpt_err(a,"Cannot find block:%s in its inhertiance "
               "chain!",fn->str);
@@ -1889,6 +2289,7 @@ int vm_main( struct ajj* a ) {
         struct ajj_object* o;
         const struct function* f;
 
+        BUDGET_CHECK();
         if( obj.type != AJJ_VALUE_OBJECT ) {
           vm_rpt_err(a,"Cannot call a member function on type:%s!",
               ajj_value_get_type_name(&obj));
@@ -1948,22 +2349,43 @@ int vm_main( struct ajj* a ) {
       } vm_end(RET)
 
       vm_beg(PRINT) {
-        int own;
-        size_t l;
-        struct string t;
-        const char* text = ajj_display(
-            a,stk_top(a,1),&l,&own);
-
-        assert(text); /* should never fail */
-
-        t.str = text;
-        t.len = l;
-        if(!string_empty(&t))
-          vm_print(a,&t);
+        /* objects with display_io stream into the output directly */
+        fail = ajj_display_io(a,stk_top(a,1),a->rt->output);
         stk_pop(a,1);
-        if(own) free((void*)text);
+        if(fail) {
+          vm_rpt_err(a,"Cannot write to the output!");
+          goto fail;
+        }
       } vm_end(PRINT)
 
+      vm_beg(PSTR) {
+        int arg = instr_1st_arg(c);
+        const struct string* text = const_str(a,arg);
+        /* the template is pinned by the runtime , so its text is
+         * referenced until the runtime is gone */
+        if( text->len > 0 &&
+            ajj_io_write_ref(a->rt->output,text->str,text->len) < 0 ) {
+          vm_rpt_err(a,"Cannot write to the output!");
+          goto fail;
+        }
+      } vm_end(PSTR)
+
+      vm_beg(FLUSH) {
+        if( ajj_io_flush(a->rt->output) < 0 ) {
+          vm_rpt_err(a,"Cannot write to the output!");
+          goto fail;
+        }
+      } vm_end(FLUSH)
+
+      vm_beg(EPRINT) {
+        fail = vm_print_escape(a,stk_top(a,1));
+        stk_pop(a,1);
+        if(fail) {
+          vm_rpt_err(a,"Cannot write to the output!");
+          goto fail;
+        }
+      } vm_end(EPRINT)
+
       vm_beg(POP) {
         int arg = instr_1st_arg(c);
         stk_pop(a,arg);
@@ -2093,6 +2515,7 @@ int vm_main( struct ajj* a ) {
 
       vm_beg(JMP) {
         int pos =instr_1st_arg(c);
+        if( (size_t)pos <= cur_frame(a)->ppc ) BUDGET_CHECK();
         cur_frame(a)->pc = pos;
       } vm_end(JMP)
 
@@ -2100,6 +2523,7 @@ int vm_main( struct ajj* a ) {
         int loops = instr_1st_arg(c);
         int pos = instr_2nd_arg(a);
         assert(loops>0);
+        if( (size_t)pos <= cur_frame(a)->ppc ) BUDGET_CHECK();
         vm_exit(a,loops);
         cur_frame(a)->pc = pos;
       } vm_end(JMPC)
@@ -2332,16 +2756,147 @@ int run_jinja( struct ajj* a ) {
   return fail;
 }
 
-int vm_run_jinja( struct ajj* a , struct ajj_object* jj,
-    struct ajj_io* output , void* udata ) {
+/* Reserve the memory output from the average output size of the
+ * template , returns where the output of this rendering starts */
+static
+size_t output_predict( struct ajj_object* jj , struct ajj_io* output ) {
+  size_t avg;
+  if( output->tp != AJJ_IO_MEM ) return 0;
+  avg = atomic_get(&(jj_file_of(jj)->out_avg));
+  if(avg) ajj_io_reserve(output,avg + (avg >> AJJ_OUTPUT_SIZE_DECAY));
+  return output->out.m.len;
+}
+
+/* Fold the output size of a rendering into the average , the update
+ * can be lost when renderings of the template race but it is just a
+ * hint */
+static
+void output_learn( struct ajj_object* jj , struct ajj_io* output ,
+    size_t start ) {
+  struct jj_file* f = jj_file_of(jj);
+  size_t sz;
+  size_t avg;
+  if( output->tp != AJJ_IO_MEM ) return;
+  sz = output->out.m.len - start;
+  avg = atomic_get(&(f->out_avg));
+  if(avg) {
+    avg = avg - (avg >> AJJ_OUTPUT_SIZE_DECAY) +
+      (sz >> AJJ_OUTPUT_SIZE_DECAY);
+  } else {
+    avg = sz;
+  }
+  atomic_swap(&(f->out_avg),avg);
+}
+
+/* Run a top level rendering against the pinned environment snapshot ,
+ * the budget is the engine's own one unless it is inherited */
+static
+int vm_run( struct ajj* a , struct ajj_object* jj ,
+    struct ajj_io* output , void* udata , struct env_version* env ,
+    int inherit , struct vm_budget* budget ) {
   struct runtime rt;
   struct runtime* o_rt = a->rt;
+  struct include_frags frags;
+  struct ajj_context ctx;
+  size_t start = output_predict(jj,output);
   int fail;
-  runtime_init(a,&rt,jj,output,0,udata);
+  if(a->inc_pool) {
+    include_frags_init(&frags,output,env);
+    runtime_init(a,&rt,jj,&(frags.io),0,udata,ajj_env_table(env));
+    rt.frag = &frags;
+  } else {
+    runtime_init(a,&rt,jj,output,0,udata,ajj_env_table(env));
+  }
+  context_init(a,&ctx,&rt,udata);
+  if(inherit) {
+    if(budget) {
+      ctx.budget = *budget;
+      ctx.budget.step = ctx.budget.clock = 0;
+      rt.budget = &(ctx.budget);
+    } else {
+      rt.budget = NULL;
+    }
+  }
+  if(a->inc_pool) frags.budget = rt.budget;
   a->rt = &rt;
   fail = run_jinja(a);
   runtime_destroy(a,&rt);
   a->rt = o_rt; /* resume the old runtime since this
                  * function can be nested */
+  /* hand the error over to the engine or the calling rendering */
+  if(fail) strcpy(ajj_err_buf(a),ctx.err);
+  if(a->inc_pool)
+    fail = include_flush(a,&frags,fail);
+  /* nested fragments are already folded in by the flush */
+  if( inherit && budget ) budget->step = ctx.budget.step;
+  if( !fail && ajj_io_sync(output) ) {
+    ajj_error(a,"Cannot write to the output!");
+    fail = -1;
+  }
+  if(!fail) output_learn(jj,output,start);
+  return fail;
+}
+
+int vm_run_jinja( struct ajj* a , struct ajj_object* jj,
+    struct ajj_io* output , void* udata ) {
+  struct env_version* env = ajj_env_acquire(a);
+  int fail = vm_run(a,jj,output,udata,env,0,NULL);
+  ajj_env_release(env);
   return fail;
 }
+
+int vm_run_include( struct ajj* a , struct ajj_object* jj ,
+    struct ajj_io* output , void* udata , struct env_version* env ,
+    struct vm_budget* budget ) {
+  return vm_run(a,jj,output,udata,env,1,budget);
+}
+
+int vm_run_jinja_batch( struct ajj* a , struct ajj_object* jj,
+    ajj_batch_next next , ajj_batch_done done , void* data ) {
+  struct runtime rt;
+  struct runtime* o_rt = a->rt;
+  struct include_frags frags;
+  struct ajj_context ctx;
+  struct env_version* env;
+  struct ajj_io* output;
+  void* udata;
+  int ret = 0;
+  if(!next(data,&output,&udata)) return 0;
+  env = ajj_env_acquire(a);
+  /* includes of every item go to the include pool just like vm_run */
+  if(a->inc_pool) include_frags_init(&frags,output,env);
+  runtime_init(a,&rt,jj,a->inc_pool ? &(frags.io) : output,0,udata,
+      ajj_env_table(env));
+  do {
+    size_t start = output_predict(jj,output);
+    int fail;
+    context_init(a,&ctx,&rt,udata);
+    if(a->inc_pool) {
+      rt.frag = &frags;
+      frags.budget = rt.budget;
+    }
+    a->rt = &rt;
+    fail = run_jinja(a);
+    a->rt = o_rt;
+    /* same as vm_run , the caller gets the error */
+    if(fail) strcpy(ajj_err_buf(a),ctx.err);
+    if(a->inc_pool)
+      fail = include_flush(a,&frags,fail);
+    if(fail) {
+      ret = -1;
+    } else if(ajj_io_sync(output)) {
+      ajj_error(a,"Cannot write to the output!");
+      fail = 1;
+      ret = -1;
+    } else {
+      output_learn(jj,output,start);
+    }
+    if(done) done(a,data,udata,fail);
+    if(!next(data,&output,&udata)) break;
+    if(a->inc_pool) include_frags_init(&frags,output,env);
+    runtime_reset(a,&rt,a->inc_pool ? &(frags.io) : output,udata);
+  } while(1);
+  runtime_destroy(a,&rt);
+  ajj_env_release(env);
+  return ret;
+}
@@ -22,6 +22,7 @@ struct program {
   size_t len;
 
   struct string* str_tbl;
+  unsigned char* str_safe; /* nonzero if the string has nothing to escape */
   size_t str_len;
   size_t str_cap;
 
@@ -81,6 +82,17 @@ struct func_frame {
  * contains a value stack + an function frame stack. Also a gc_scope pointer always
  * points to the current gc scope and a output FILE points to where the output
  * of the jinja template should go to. */
+struct include_frags;
+
+/* Budget of a rendering , shared by the runtimes of its includes and
+ * extends. Instructions are charged at backward jumps and calls */
+struct vm_budget {
+  size_t step;     /* instructions charged since the last refill */
+  size_t clock;    /* instructions charged since the clock is read */
+  size_t limit;    /* instructions between refills , 0 means unlimited */
+  double deadline; /* in milliseconds , 0 means no deadline */
+};
+
 struct runtime {
   /* Runtime inheritance chain when extends happened */
   struct runtime* prev;
@@ -100,6 +112,16 @@ struct runtime {
   struct upvalue_table* global; /* Per template based global value. This make
                                  * sure each template is executed in its own
                                  * global variable states */
+  struct upvalue_table* env; /* environment snapshot pinned by the rendering ,
+                              * parent of the global table */
+  struct ajj_object** pin_tbl; /* templates imported by this runtime, they
+                                * are pinned until the runtime is destroyed */
+  size_t pin_len;
+  size_t pin_cap;
+  struct include_frags* frag; /* includes rendered by the include pool ,
+                               * NULL means includes are rendered inline */
+  struct vm_budget* budget; /* NULL means the rendering is unlimited */
+  struct ajj_context* ctx; /* context of the rendering */
 
   /* User defined specific objects */
   void* udata;
@@ -112,6 +134,11 @@ void program_destroy( struct program* );
 int program_add_par( struct program* , struct string* , int ,
     const struct ajj_value* );
 int program_const_str( struct program* , struct string* , int );
+/* Add a string literal of an expression , it may be printed with
+ * HTML escape so whether it needs escaping is decided here once */
+int program_const_literal( struct program* , struct string* , int );
+/* Add template text that is never escaped */
+int program_const_text( struct program* , struct string* , int );
 int program_const_num( struct program* , double );
 /* helper function for converting the ajj_value to specific type */
 int vm_to_number( const struct ajj_value* , double* );
@@ -134,4 +161,18 @@ int vm_super( struct ajj* , void*, struct ajj_value* , size_t,
  * ===========================================*/
 int vm_run_jinja( struct ajj* , struct ajj_object* ,struct ajj_io* , void*);
 
+/* Render a template deferred by an include onto a worker of the include
+ * pool. It renders against the environment snapshot of the including
+ * rendering and gets what is left of its instructions and the same
+ * deadline , a NULL budget means unlimited. The instructions it runs
+ * are stored back into the step of the budget */
+struct env_version;
+int vm_run_include( struct ajj* , struct ajj_object* , struct ajj_io* ,
+    void* , struct env_version* , struct vm_budget* );
+
+/* Render the template for each item returned by the iterator. Only one
+ * runtime is created and it is reset between items */
+int vm_run_jinja_batch( struct ajj* , struct ajj_object* ,
+    ajj_batch_next , ajj_batch_done , void* );
+
 #endif /* _VM_H_ */
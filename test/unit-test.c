@@ -7,10 +7,13 @@
 #include <opt.h>
 #include <util.h>
 #include <builtin.h>
+#include <escape.h>
 #include <stdlib.h>
 #include <sys/time.h>
 #include <inttypes.h>
 #include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #ifdef NDEBUG
 #include <stdlib.h>
@@ -2795,6 +2798,2191 @@ void vm_basic() {
   vm_test("{{ -3*2>7-1998 | abs | abs | abs | abs }}");
 }
 
+static
+void vm_cache() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj_io* output = ajj_io_create_mem(a,1024);
+  struct ajj_object* jinja;
+  struct ajj_cache_stat stat;
+  size_t len;
+  /* a budget that nothing fits in, only pinned templates survive */
+  ajj_cache_set_limit(a,1);
+  jinja = load_template(a,"Main",
+      "{% include 'include.html' %}"
+      "{% import 'import.html' as T %}"
+      "{% import 'import.html' as T2 %}"
+      "{{ T.Test('Hello World') }}"
+      "{{ T2.Test('Hello World2') }}");
+  if( vm_run_jinja(a,jinja,output,NULL) ) {
+    fprintf(stderr,"%s",a->err);
+    abort();
+  }
+  ajj_io_get_content(output,&len);
+  assert(len > 0);
+  ajj_cache_get_stat(a,&stat);
+  assert(stat.miss == 2);
+  assert(stat.hit == 1);
+  assert(stat.evict == 1); /* include.html */
+  assert(stat.size == 2);
+  /* in memory template is never evicted */
+  ajj_cache_set_limit(a,1);
+  ajj_cache_get_stat(a,&stat);
+  assert(stat.evict == 2);
+  assert(stat.size == 1);
+  assert(ajj_find_template(a,"Main") != NULL);
+
+  /* unbounded cache */
+  ajj_cache_set_limit(a,0);
+  if( ajj_render_file(a,output,"include.html",NULL) ||
+      ajj_render_file(a,output,"include.html",NULL) ) {
+    fprintf(stderr,"%s",a->err);
+    abort();
+  }
+  ajj_cache_get_stat(a,&stat);
+  assert(stat.miss == 3);
+  assert(stat.hit == 2);
+  assert(stat.size == 2);
+  if( ajj_delete_template(a,"include.html") ||
+     !ajj_delete_template(a,"include.html") ) {
+    abort();
+  }
+  ajj_io_destroy(a,output);
+  ajj_destroy(a);
+}
+
+static
+void vm_render_data() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj_io* output = ajj_io_create_mem(a,1024);
+  struct ajj_cache_stat stat;
+  const char* src = "{% for x in xrange(3) %}{{x}}{% endfor %}";
+  size_t len , elen;
+  int i;
+  for( i = 0 ; i < 3 ; ++i ) {
+    if(ajj_render_data(a,output,src,"Data",NULL)) {
+      fprintf(stderr,"%s",a->err);
+      abort();
+    }
+  }
+  ajj_io_get_content(output,&len);
+  assert(len == 9);
+  ajj_cache_get_stat(a,&stat);
+  assert(stat.miss == 1);
+  assert(stat.hit == 2);
+  /* same key but different source */
+  if(ajj_render_data(a,output,"{{ 'Hello' }}","Data",NULL)) {
+    fprintf(stderr,"%s",a->err);
+    abort();
+  }
+  ajj_cache_get_stat(a,&stat);
+  assert(stat.miss == 2);
+  assert(stat.size == 2);
+  /* a source sharing the prefix is a different template */
+  if(ajj_render_data(a,output,"{{ 'Hello' }}!","Data",NULL)) {
+    fprintf(stderr,"%s",a->err);
+    abort();
+  }
+  ajj_cache_get_stat(a,&stat);
+  assert(stat.miss == 3);
+  assert(stat.size == 3);
+  /* same source under another key is not compiled again */
+  if(ajj_render_data(a,output,src,"Other",NULL)) {
+    fprintf(stderr,"%s",a->err);
+    abort();
+  }
+  ajj_cache_get_stat(a,&stat);
+  assert(stat.miss == 3);
+  assert(stat.hit == 3);
+  assert(stat.size == 3);
+
+  /* registered template */
+  if(ajj_add_template(a,"Registered","{{ 'World' }}") ||
+     ajj_render_file(a,output,"Registered",NULL)) {
+    fprintf(stderr,"%s",a->err);
+    abort();
+  }
+  ajj_cache_get_stat(a,&stat);
+  assert(stat.hit == 4);
+  assert(stat.size == 4);
+  assert(ajj_add_template(a,"Broken","{{ 'World' ") == -1);
+  assert(ajj_find_template(a,"Broken") == NULL);
+  /* data never replaces a registered template with the same name */
+  ajj_io_destroy(a,output);
+  output = ajj_io_create_mem(a,1024);
+  if(ajj_render_data(a,output,"{{ 'Data' }}","Registered",NULL) ||
+     ajj_render_file(a,output,"Registered",NULL)) {
+    fprintf(stderr,"%s",a->err);
+    abort();
+  }
+  ajj_io_get_content(output,&len);
+  assert(len == strlen("DataWorld"));
+  assert(memcmp(ajj_io_get_content(output,&len),"DataWorld",len) == 0);
+  assert(ajj_find_template(a,"Registered")->data_len == (size_t)-1);
+  /* cached data can be evicted but registered template cannot */
+  ajj_cache_set_limit(a,1);
+  ajj_cache_get_stat(a,&stat);
+  assert(stat.evict == 4);
+  assert(stat.size == 1);
+  assert(ajj_find_template(a,"Registered") != NULL);
+  /* an empty source never matches a registered template */
+  ajj_io_get_content(output,&len);
+  assert(!ajj_render_data(a,output,"","Registered",NULL));
+  ajj_io_get_content(output,&elen);
+  assert(elen == len);
+  ajj_io_destroy(a,output);
+  ajj_destroy(a);
+}
+
+static
+void* vm_compile_load( struct ajj* a , const char* name , size_t* len ,
+    time_t* ts , void* udata ) {
+  assert(a == *(struct ajj**)udata);
+  return AJJ_DEFAULT_VFS.vfs_load(a,name,len,ts,NULL);
+}
+
+static
+void vm_compile_all() {
+  struct ajj_vfs vfs = AJJ_DEFAULT_VFS;
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj_io* output = ajj_io_create_mem(a,1024);
+  struct ajj_cache_stat stat;
+  const char* files[] = {
+    "include.html",
+    "import.html",
+    "base.html",
+    "extends2.html",
+    "include.html"
+  };
+  const char* bad[] = {
+    "import.html",
+    "NotExisted.html"
+  };
+  if(ajj_compile_all(a,files,ARRAY_SIZE(files),3)) {
+    fprintf(stderr,"%s",a->err);
+    abort();
+  }
+  ajj_cache_get_stat(a,&stat);
+  assert(stat.size == 4);
+  /* already compiled */
+  if(ajj_render_file(a,output,"include.html",NULL)) {
+    fprintf(stderr,"%s",a->err);
+    abort();
+  }
+  ajj_cache_get_stat(a,&stat);
+  assert(stat.hit == 1);
+  assert(stat.mem > 0);
+
+  /* nothing is published if one of them fails */
+  assert(!ajj_delete_template(a,"import.html"));
+  assert(ajj_compile_all(a,bad,ARRAY_SIZE(bad),0) == -1);
+  assert(ajj_find_template(a,"import.html") == NULL);
+
+  if(ajj_compile_dir(a,"jinja-test-case",0)) {
+    fprintf(stderr,"%s",a->err);
+    abort();
+  }
+  assert(ajj_find_template(a,"jinja-test-case/first.jinja") != NULL);
+  ajj_io_destroy(a,output);
+  ajj_destroy(a);
+
+  /* custom vfs is called with the user's engine */
+  vfs.vfs_load = vm_compile_load;
+  a = ajj_create(&vfs,&a);
+  if(ajj_compile_all(a,files,ARRAY_SIZE(files),0)) {
+    fprintf(stderr,"%s",a->err);
+    abort();
+  }
+  ajj_destroy(a);
+}
+
+static
+void vm_mmap_vfs() {
+  struct ajj* a = ajj_create(&AJJ_MMAP_VFS,NULL);
+  struct ajj_io* output = ajj_io_create_mem(a,1024);
+  if(ajj_render_file(a,output,"include.html",NULL) ||
+     ajj_render_data(a,output,"{% import 'import.html' as T %}"
+       "{{ T.Test('Hello World') }}","Main",NULL)) {
+    fprintf(stderr,"%s",a->err);
+    abort();
+  }
+  /* the mapping is released with the template */
+  assert(!ajj_delete_template(a,"import.html"));
+  assert(ajj_render_file(a,output,"NotExisted.html",NULL) == -1);
+  ajj_io_destroy(a,output);
+  ajj_destroy(a);
+}
+
+static
+void vm_bundle_vfs() {
+  struct ajj* a;
+  struct ajj_io* output;
+  struct ajj_bundle* b;
+  const char* files[] = {
+    "include.html",
+    "import.html",
+    "jinja-test-case/first.jinja",
+    "jinja-test-case/second.jinja"
+  };
+  const char* dup[] = {
+    "import.html",
+    "import.html"
+  };
+  assert(ajj_bundle_create("bin/test.bundle",dup,ARRAY_SIZE(dup)) == -1);
+  assert(!ajj_bundle_create("bin/test.bundle",files,ARRAY_SIZE(files)));
+  assert(ajj_bundle_open("include.html") == NULL);
+  b = ajj_bundle_open("bin/test.bundle");
+  assert(b);
+  a = ajj_create(&AJJ_BUNDLE_VFS,b);
+  output = ajj_io_create_mem(a,1024);
+  if(ajj_render_file(a,output,"include.html",NULL) ||
+     ajj_render_data(a,output,"{% import 'import.html' as T %}"
+       "{{ T.Test('Hello World') }}","Main",NULL) ||
+     ajj_compile_all(a,files,ARRAY_SIZE(files),2)) {
+    fprintf(stderr,"%s",a->err);
+    abort();
+  }
+  assert(ajj_render_file(a,output,"base.html",NULL) == -1);
+  ajj_io_destroy(a,output);
+  ajj_destroy(a);
+  ajj_bundle_close(b);
+}
+
+static
+void* vm_fork_worker( void* arg ) {
+  struct ajj* a = (struct ajj*)arg;
+  struct ajj_io* output = ajj_io_create_mem(a,1024);
+  int i;
+  for( i = 0 ; i < 8 ; ++i ) {
+    if(ajj_render_file(a,output,"include.html",NULL) ||
+       ajj_render_data(a,output,"{% import 'import.html' as T %}"
+         "{{ T.Test('Hello World') }}","Main",NULL)) {
+      fprintf(stderr,"%s",a->err);
+      abort();
+    }
+  }
+  ajj_io_destroy(a,output);
+  return NULL;
+}
+
+static
+void vm_fork() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj* f[4];
+  thread_t th[4];
+  struct ajj_cache_stat stat;
+  size_t i;
+  for( i = 0 ; i < ARRAY_SIZE(f) ; ++i ) {
+    f[i] = ajj_fork(a);
+    assert(!thread_create(th+i,vm_fork_worker,f[i]));
+  }
+  for( i = 0 ; i < ARRAY_SIZE(f) ; ++i ) {
+    thread_join(th[i]);
+  }
+  /* all the forks share the store of the parent */
+  ajj_cache_get_stat(a,&stat);
+  assert(ajj_find_template(a,"include.html") != NULL);
+  assert(ajj_find_template(a,"import.html") != NULL);
+  assert(stat.hit + stat.miss >= 2*8*ARRAY_SIZE(f));
+  vm_fork_worker(a);
+  for( i = 0 ; i < ARRAY_SIZE(f) ; ++i ) {
+    ajj_destroy(f[i]);
+  }
+  ajj_destroy(a);
+}
+
+static
+void* vm_lookup_worker( void* arg ) {
+  struct ajj* a = (struct ajj*)arg;
+  struct ajj_io* output = ajj_io_create_mem(a,1024);
+  int i;
+  for( i = 0 ; i < 64 ; ++i ) {
+    if(ajj_render_file(a,output,"include.html",NULL)) {
+      fprintf(stderr,"%s",a->err);
+      abort();
+    }
+  }
+  ajj_io_destroy(a,output);
+  return NULL;
+}
+
+static
+int vm_lookup_drop( struct ajj* a , void* udata ,
+    struct ajj_value* arg , size_t arg_len , struct ajj_value* ret ) {
+  UNUSE_ARG(udata);
+  UNUSE_ARG(arg);
+  UNUSE_ARG(arg_len);
+  assert(!ajj_delete_template(a,"drop.html"));
+  assert(a->store->cache.retire_len > 0);
+  *ret = AJJ_NONE;
+  return AJJ_EXEC_OK;
+}
+
+static
+void vm_lookup() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj* f[4];
+  thread_t th[4];
+  struct ajj_cache_stat stat;
+  struct ajj_io* output;
+  size_t i , len;
+  int j;
+  for( i = 0 ; i < ARRAY_SIZE(f) ; ++i ) {
+    f[i] = ajj_fork(a);
+    assert(!thread_create(th+i,vm_lookup_worker,f[i]));
+  }
+  /* readers never see a released template while it gets replaced */
+  for( j = 0 ; j < 64 ; ++j ) {
+    ajj_delete_template(a,"include.html");
+    ajj_cache_set_limit(a,j % 2);
+  }
+  for( i = 0 ; i < ARRAY_SIZE(f) ; ++i ) {
+    thread_join(th[i]);
+    ajj_destroy(f[i]);
+  }
+  ajj_cache_get_stat(a,&stat);
+  assert(stat.hit + stat.miss >= 64*ARRAY_SIZE(f));
+
+  /* a template removed while it renders lives until the rendering is
+   * done , and is released right after that */
+  output = ajj_io_create_mem(a,1024);
+  ajj_env_add_function(a,"drop",vm_lookup_drop,NULL);
+  assert(!ajj_add_template(a,"drop.html","A{{ drop() }}B"));
+  if(ajj_render_file(a,output,"drop.html",NULL)) {
+    fprintf(stderr,"%s",a->err);
+    abort();
+  }
+  assert(ajj_find_template(a,"drop.html") == NULL);
+  assert(a->store->cache.retire_len == 0);
+  assert(memcmp(ajj_io_get_content(output,&len),"AB",2) == 0);
+  assert(len == 2);
+  ajj_io_destroy(a,output);
+  ajj_destroy(a);
+}
+
+static
+void vm_pool_callback( struct ajj* a , int ret , void* data ) {
+  UNUSE_ARG(a);
+  if(!ret) atomic_add((int*)data,1);
+}
+
+static
+void vm_pool() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj_io* expect = ajj_io_create_mem(a,1024);
+  struct ajj_io* output[32];
+  struct ajj_job* job[32];
+  struct ajj_pool* p;
+  const char* exp;
+  size_t exp_len;
+  int cnt = 0;
+  size_t i;
+
+  if(ajj_render_file(a,expect,"include.html",NULL)) {
+    fprintf(stderr,"%s",a->err);
+    abort();
+  }
+  exp = ajj_io_get_content(expect,&exp_len);
+
+  p = ajj_pool_create(a,3);
+  assert(p);
+  assert(ajj_pool_size(p) == 3);
+  for( i = 0 ; i < ARRAY_SIZE(job) ; ++i ) {
+    output[i] = ajj_io_create_mem(a,1024);
+    job[i] = ajj_pool_submit(p,output[i],"include.html",NULL,
+        vm_pool_callback,&cnt);
+  }
+  for( i = 0 ; i < ARRAY_SIZE(job) ; ++i ) {
+    const char* c;
+    size_t len;
+    assert(ajj_job_wait(job[i]) == 0);
+    assert(ajj_job_done(job[i]));
+    assert(ajj_job_error(job[i]) == NULL);
+    c = ajj_io_get_content(output[i],&len);
+    assert(len == exp_len);
+    assert(memcmp(c,exp,len) == 0);
+    ajj_job_free(job[i]);
+  }
+  assert(cnt == (int)ARRAY_SIZE(job));
+
+  /* failed job reports its error through the handle */
+  job[0] = ajj_pool_submit(p,output[0],"NotExisted.html",NULL,NULL,NULL);
+  assert(ajj_job_wait(job[0]) != 0);
+  assert(ajj_job_error(job[0]) != NULL);
+  ajj_job_free(job[0]);
+
+  /* fire and forget , destroying pool waits for it */
+  ajj_job_free(ajj_pool_submit(p,output[1],"include.html",NULL,
+        vm_pool_callback,&cnt));
+  ajj_pool_destroy(p);
+  assert(cnt == (int)ARRAY_SIZE(job)+1);
+
+  for( i = 0 ; i < ARRAY_SIZE(output) ; ++i ) {
+    ajj_io_destroy(a,output[i]);
+  }
+  ajj_io_destroy(a,expect);
+  ajj_destroy(a);
+}
+
+struct vm_stream_model {
+  char buf[1024];
+  size_t len;
+  size_t chunk[64]; /* size of each chunk taken */
+  size_t cnt;
+  int busy; /* push back every other call if set */
+  int call;
+};
+
+static
+int vm_stream_consume( void* udata , const void* mem , size_t len ) {
+  struct vm_stream_model* m = (struct vm_stream_model*)udata;
+  if( m->busy && (m->call++ % 2) == 0 ) return AJJ_IO_BUSY;
+  memcpy(m->buf+m->len,mem,len);
+  m->len += len;
+  m->chunk[m->cnt++] = len;
+  return 0;
+}
+
+/* Size of the output the stream consumer got so far */
+static
+int vm_parallel_seen( struct ajj* a , void* udata ,
+    struct ajj_value* arg , size_t arg_len , struct ajj_value* ret ) {
+  UNUSE_ARG(arg);
+  UNUSE_ARG(arg_len);
+  *ret = ajj_value_number(
+      (double)((struct vm_stream_model*)ajj_runtime_get_udata(a))->len);
+  UNUSE_ARG(udata);
+  return AJJ_EXEC_OK;
+}
+
+static
+void vm_parallel_include() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj_io* expect = ajj_io_create_mem(a,1024);
+  struct ajj_io* output = ajj_io_create_mem(a,1024);
+  struct ajj_pool* p = ajj_pool_create(a,3);
+  struct ajj_io* stream;
+  struct vm_stream_model m;
+  struct ajj* f;
+  const char* c , *e;
+  size_t len , elen;
+  assert(!ajj_add_template(a,"frag.html",
+        "Head{% include 'include.html' %}A"
+        "{% for i in [1,2,3] %}{{ i }}{% include 'include.html' %}"
+        "{% endfor %}B{% include 'extends2.html' %}C"));
+  if(ajj_render_file(a,expect,"frag.html",NULL)) {
+    fprintf(stderr,"%s",a->err);
+    abort();
+  }
+  ajj_set_include_pool(a,p);
+  if(ajj_render_file(a,output,"frag.html",NULL)) {
+    fprintf(stderr,"%s",a->err);
+    abort();
+  }
+  e = ajj_io_get_content(expect,&elen);
+  c = ajj_io_get_content(output,&len);
+  assert(len == elen);
+  assert(memcmp(c,e,len) == 0);
+
+  /* error of a fragment is reported by the including template */
+  assert(!ajj_add_template(a,"frag.html",
+        "A{% include 'NotExisted.html' %}B"));
+  assert(ajj_render_file(a,output,"frag.html",NULL) == -1);
+
+  /* the output before the first deferred include is not held back */
+  memset(&m,0,sizeof(m));
+  stream = ajj_io_create_stream(a,1,vm_stream_consume,&m);
+  ajj_env_add_function(a,"seen",vm_parallel_seen,NULL);
+  assert(!ajj_add_template(a,"frag.html",
+        "Head{{ seen() }}{% include 'frag-who.html' %}{{ seen() }}"));
+  assert(!ajj_add_template(a,"frag-who.html","{{ who }}"));
+  ajj_env_add_value(a,"who",AJJ_VALUE_STRING,"parent",strlen("parent"));
+  assert(!ajj_render_file(a,stream,"frag.html",&m));
+  assert(m.len == strlen("Head4parent5"));
+  assert(memcmp(m.buf,"Head4parent5",m.len) == 0);
+  ajj_io_destroy(a,stream);
+
+  /* fragments see the environment of the including rendering */
+  f = ajj_fork(a);
+  ajj_env_add_value(f,"who",AJJ_VALUE_STRING,"fork",strlen("fork"));
+  ajj_set_include_pool(f,p);
+  assert(!ajj_add_template(a,"frag.html","<{% include 'frag-who.html' %}>"));
+  ajj_io_destroy(a,output);
+  output = ajj_io_create_mem(a,1024);
+  if(ajj_render_file(f,output,"frag.html",NULL)) {
+    fprintf(stderr,"%s",f->err);
+    abort();
+  }
+  c = ajj_io_get_content(output,&len);
+  assert(len == 6 && memcmp(c,"<fork>",6) == 0);
+  ajj_destroy(f);
+
+  /* and its budget */
+  ajj_set_budget(a,1000,0);
+  assert(!ajj_add_template(a,"frag-loop.html",
+        "{% for i in xrange(100000) %}{% endfor %}"));
+  assert(!ajj_add_template(a,"frag.html","{% include 'frag-loop.html' %}"));
+  assert(ajj_render_file(a,output,"frag.html",NULL) == -1);
+  assert(strstr(ajj_last_error(a),"instruction budget"));
+  /* which is shared by all the fragments */
+  assert(!ajj_add_template(a,"frag-loop.html",
+        "{% for i in xrange(100) %}{% endfor %}"));
+  assert(!ajj_add_template(a,"frag.html","{% include 'frag-loop.html' %}"));
+  assert(!ajj_render_file(a,output,"frag.html",NULL));
+  assert(!ajj_add_template(a,"frag.html",
+        "{% for i in xrange(8) %}{% include 'frag-loop.html' %}"
+        "{% endfor %}"));
+  assert(ajj_render_file(a,output,"frag.html",NULL) == -1);
+  assert(strstr(ajj_last_error(a),"instruction budget"));
+  ajj_set_budget(a,0,0);
+
+  /* a failed write fails the rendering */
+  stream = ajj_io_create_fd(a,-1,16,0);
+  assert(!ajj_add_template(a,"frag.html",
+        "{% include 'frag-who.html' %}0123456789abcdefghijklmnopqrstuvwxyz"));
+  assert(ajj_render_file(a,stream,"frag.html",NULL) == -1);
+  assert(strstr(ajj_last_error(a),"Cannot write to the output"));
+  ajj_io_destroy(a,stream);
+
+  ajj_set_include_pool(a,NULL);
+  ajj_pool_destroy(p);
+  ajj_io_destroy(a,expect);
+  ajj_io_destroy(a,output);
+  ajj_destroy(a);
+}
+
+static
+int vm_batch_model( struct ajj* a , void* udata ,
+    struct ajj_value* arg , size_t arg_len , struct ajj_value* ret ) {
+  UNUSE_ARG(udata);
+  UNUSE_ARG(arg);
+  UNUSE_ARG(arg_len);
+  *ret = ajj_value_number(*(int*)ajj_runtime_get_udata(a));
+  return AJJ_EXEC_OK;
+}
+
+struct vm_batch_iter {
+  struct ajj_io* output[64];
+  int model[64];
+  size_t next;
+  int done;
+};
+
+static
+int vm_batch_next( void* data , struct ajj_io** output , void** udata ) {
+  struct vm_batch_iter* itr = (struct vm_batch_iter*)data;
+  if( itr->next == ARRAY_SIZE(itr->model) ) return 0;
+  *output = itr->output[itr->next];
+  *udata = itr->model + itr->next;
+  ++itr->next;
+  return 1;
+}
+
+static
+void vm_batch_done( struct ajj* a , void* data , void* udata , int ret ) {
+  struct vm_batch_iter* itr = (struct vm_batch_iter*)data;
+  UNUSE_ARG(a);
+  UNUSE_ARG(udata);
+  if(!ret) atomic_add(&(itr->done),1);
+}
+
+/* 1 if called by a worker of the include pool , which has no pool */
+static
+int vm_batch_pooled( struct ajj* a , void* udata ,
+    struct ajj_value* arg , size_t arg_len , struct ajj_value* ret ) {
+  UNUSE_ARG(udata);
+  UNUSE_ARG(arg);
+  UNUSE_ARG(arg_len);
+  *ret = ajj_value_number(a->inc_pool == NULL ? 1 : 0);
+  return AJJ_EXEC_OK;
+}
+
+static
+void vm_batch() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj_io* expect = ajj_io_create_mem(a,1024);
+  struct ajj_pool* p;
+  struct vm_batch_iter itr;
+  size_t nthread[] = { 1 , 4 };
+  size_t i , j;
+  ajj_env_add_function(a,"model",vm_batch_model,NULL);
+  assert(!ajj_add_template(a,"batch.html",
+        "{% import 'import.html' as T %}"
+        "{% for i in [1,2,3] %}{{ model() * i }}{% endfor %}"
+        "{{ T.Test(model()) }}"));
+  for( i = 0 ; i < ARRAY_SIZE(itr.model) ; ++i ) {
+    itr.model[i] = (int)i;
+    itr.output[i] = ajj_io_create_mem(a,1024);
+  }
+
+  for( j = 0 ; j < ARRAY_SIZE(nthread) ; ++j ) {
+    itr.next = 0;
+    itr.done = 0;
+    if(ajj_render_batch(a,"batch.html",vm_batch_next,vm_batch_done,
+          &itr,nthread[j])) {
+      fprintf(stderr,"%s",a->err);
+      abort();
+    }
+    assert(itr.done == (int)ARRAY_SIZE(itr.model));
+    for( i = 0 ; i < ARRAY_SIZE(itr.model) ; ++i ) {
+      const char* c , *e;
+      size_t len , elen;
+      if(ajj_render_file(a,expect,"batch.html",itr.model+i)) {
+        fprintf(stderr,"%s",a->err);
+        abort();
+      }
+      e = ajj_io_get_content(expect,&elen);
+      c = ajj_io_get_content(itr.output[i],&len);
+      assert(len == elen);
+      assert(memcmp(c,e,len) == 0);
+      ajj_io_destroy(a,itr.output[i]);
+      ajj_io_destroy(a,expect);
+      itr.output[i] = ajj_io_create_mem(a,1024);
+      expect = ajj_io_create_mem(a,1024);
+    }
+  }
+
+  /* includes of the items go to the include pool */
+  p = ajj_pool_create(a,2);
+  ajj_set_include_pool(a,p);
+  ajj_env_add_function(a,"pooled",vm_batch_pooled,NULL);
+  assert(!ajj_add_template(a,"batch.html",
+        "<{% include 'batch-inc.html' %}>"));
+  assert(!ajj_add_template(a,"batch-inc.html","{{ pooled() }}{{ model() }}"));
+  for( j = 0 ; j < ARRAY_SIZE(nthread) ; ++j ) {
+    itr.next = 0;
+    itr.done = 0;
+    if(ajj_render_batch(a,"batch.html",vm_batch_next,vm_batch_done,
+          &itr,nthread[j])) {
+      fprintf(stderr,"%s",a->err);
+      abort();
+    }
+    assert(itr.done == (int)ARRAY_SIZE(itr.model));
+    for( i = 0 ; i < ARRAY_SIZE(itr.model) ; ++i ) {
+      char buf[32];
+      const char* c;
+      size_t len;
+      sprintf(buf,"<1%d>",itr.model[i]);
+      c = ajj_io_get_content(itr.output[i],&len);
+      assert(len == strlen(buf));
+      assert(memcmp(c,buf,len) == 0);
+      ajj_io_destroy(a,itr.output[i]);
+      itr.output[i] = ajj_io_create_mem(a,1024);
+    }
+  }
+  ajj_set_include_pool(a,NULL);
+  ajj_pool_destroy(p);
+
+  /* failed item doesn't stop the batch */
+  itr.next = 0;
+  itr.done = 0;
+  assert(!ajj_add_template(a,"batch.html",
+        "{% if model() == 3 %}{{ NotExisted() }}{% endif %}Hi"));
+  assert(ajj_render_batch(a,"batch.html",vm_batch_next,vm_batch_done,
+        &itr,1) == -1);
+  assert(itr.done == (int)ARRAY_SIZE(itr.model)-1);
+  assert(ajj_render_batch(a,"NotExisted.html",vm_batch_next,NULL,
+        &itr,1) == -1);
+
+  for( i = 0 ; i < ARRAY_SIZE(itr.model) ; ++i ) {
+    ajj_io_destroy(a,itr.output[i]);
+  }
+  ajj_io_destroy(a,expect);
+  ajj_destroy(a);
+}
+
+struct vm_resume_model {
+  int value;
+  int sync;  /* never suspend */
+  int ready; /* suspended once for the current call */
+  int park;  /* number of times the rendering is parked */
+};
+
+static
+int vm_resume_fetch( struct ajj* a , void* udata ,
+    struct ajj_value* arg , size_t arg_len , struct ajj_value* ret ) {
+  struct vm_resume_model* m = ajj_runtime_get_udata(a);
+  UNUSE_ARG(udata);
+  UNUSE_ARG(arg);
+  UNUSE_ARG(arg_len);
+  if(!m->sync && !m->ready) {
+    m->ready = 1;
+    ++m->park;
+    return AJJ_EXEC_SUSPEND;
+  }
+  m->ready = 0;
+  *ret = ajj_value_number(m->value);
+  return AJJ_EXEC_OK;
+}
+
+static
+int vm_resume_wait( struct ajj* a , void* udata ,
+    struct ajj_value* arg , size_t arg_len , struct ajj_value* ret ) {
+  struct vm_resume_model* m = ajj_runtime_get_udata(a);
+  UNUSE_ARG(udata);
+  UNUSE_ARG(arg);
+  UNUSE_ARG(arg_len);
+  ++m->park;
+  if(ajj_suspend(a)) return AJJ_EXEC_FAIL;
+  *ret = ajj_value_number(m->value);
+  return AJJ_EXEC_OK;
+}
+
+/* Ignores the cancel and keeps suspending */
+static
+int vm_resume_stubborn( struct ajj* a , void* udata ,
+    struct ajj_value* arg , size_t arg_len , struct ajj_value* ret ) {
+  int i;
+  UNUSE_ARG(udata);
+  UNUSE_ARG(arg);
+  UNUSE_ARG(arg_len);
+  for( i = 0 ; i < 3 ; ++i ) ajj_suspend(a);
+  *ret = ajj_value_number(0);
+  return AJJ_EXEC_OK;
+}
+
+static
+void vm_resume() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj_io* expect[3];
+  struct ajj_io* output[3];
+  struct ajj_render* r[3];
+  struct vm_resume_model m[3];
+  size_t i;
+  int pending;
+  ajj_env_add_function(a,"fetch",vm_resume_fetch,NULL);
+  ajj_env_add_function(a,"wait",vm_resume_wait,NULL);
+  assert(!ajj_add_template(a,"resume.html",
+        "{% import 'import.html' as T %}"
+        "{% for i in [1,2,3] %}{{ fetch() * i }}{% endfor %}"
+        "{% include 'include.html' %}{{ T.Test(fetch()) }}"));
+  for( i = 0 ; i < ARRAY_SIZE(m) ; ++i ) {
+    m[i].value = (int)i + 1;
+    m[i].sync = 1;
+    m[i].ready = 0;
+    m[i].park = 0;
+    expect[i] = ajj_io_create_mem(a,1024);
+    output[i] = ajj_io_create_mem(a,1024);
+    if(ajj_render_file(a,expect[i],"resume.html",m+i)) {
+      fprintf(stderr,"%s",a->err);
+      abort();
+    }
+    m[i].sync = 0;
+    r[i] = ajj_render_create(a,output[i],"resume.html",m+i);
+    assert(r[i]);
+  }
+
+  /* interleave the renderings on the same engine */
+  do {
+    pending = 0;
+    for( i = 0 ; i < ARRAY_SIZE(r) ; ++i ) {
+      int ret;
+      if(ajj_render_done(r[i])) continue;
+      ret = ajj_render_resume(r[i]);
+      if(ret == -1) {
+        fprintf(stderr,"%s",ajj_render_error(r[i]));
+        abort();
+      }
+      if(ret == AJJ_RENDER_PENDING) pending = 1;
+    }
+  } while(pending);
+
+  for( i = 0 ; i < ARRAY_SIZE(r) ; ++i ) {
+    const char* c , *e;
+    size_t len , elen;
+    assert(m[i].park == 4);
+    assert(ajj_render_error(r[i]) == NULL);
+    assert(ajj_render_resume(r[i]) == 0);
+    e = ajj_io_get_content(expect[i],&elen);
+    c = ajj_io_get_content(output[i],&len);
+    assert(len == elen);
+    assert(memcmp(c,e,len) == 0);
+    ajj_render_free(r[i]);
+  }
+
+  /* suspend from inside of the host function , only allowed inside of
+   * a resumable rendering */
+  assert(!ajj_add_template(a,"resume.html","A{{ wait() }}B"));
+  assert(ajj_render_file(a,output[0],"resume.html",m) == -1);
+  r[0] = ajj_render_create(a,output[1],"resume.html",m);
+  assert(ajj_render_resume(r[0]) == AJJ_RENDER_PENDING);
+  assert(!ajj_render_done(r[0]));
+  assert(ajj_render_resume(r[0]) == 0);
+  ajj_render_free(r[0]);
+
+  /* free a suspended rendering cancels it */
+  r[0] = ajj_render_create(a,output[2],"resume.html",m);
+  assert(ajj_render_resume(r[0]) == AJJ_RENDER_PENDING);
+  ajj_render_free(r[0]);
+
+  /* a host function ignoring the cancel cannot park it again */
+  ajj_env_add_function(a,"stubborn",vm_resume_stubborn,NULL);
+  assert(!ajj_add_template(a,"stubborn.html","A{{ stubborn() }}B"));
+  r[0] = ajj_render_create(a,output[2],"stubborn.html",m);
+  assert(ajj_render_resume(r[0]) == AJJ_RENDER_PENDING);
+  ajj_render_free(r[0]);
+
+  r[0] = ajj_render_create(a,output[2],"NotExisted.html",m);
+  assert(ajj_render_resume(r[0]) == -1);
+  assert(ajj_render_error(r[0]) != NULL);
+  ajj_render_free(r[0]);
+
+  /* the deepest nesting the VM allows fits into the rendering's stack */
+  assert(!ajj_add_template(a,"deep.html",
+        "{% include 'deep.html' %}"));
+  r[0] = ajj_render_create(a,output[2],"deep.html",m);
+  assert(ajj_render_resume(r[0]) == -1);
+  assert(strstr(ajj_render_error(r[0]),"include"));
+  ajj_render_free(r[0]);
+  assert(!ajj_add_template(a,"deep.html",
+        "{% macro F(n) %}{{ F(n+1) }}{% endmacro %}{{ F(0) }}"));
+  r[0] = ajj_render_create(a,output[2],"deep.html",m);
+  assert(ajj_render_resume(r[0]) == -1);
+  assert(ajj_render_error(r[0]) != NULL);
+  ajj_render_free(r[0]);
+  assert(!ajj_add_template(a,"deep.html",
+        "{% extends 'deep.html' %}"));
+  r[0] = ajj_render_create(a,output[2],"deep.html",m);
+  assert(ajj_render_resume(r[0]) == -1);
+  assert(strstr(ajj_render_error(r[0]),"extends"));
+  ajj_render_free(r[0]);
+
+  for( i = 0 ; i < ARRAY_SIZE(m) ; ++i ) {
+    ajj_io_destroy(a,expect[i]);
+    ajj_io_destroy(a,output[i]);
+  }
+  ajj_destroy(a);
+}
+
+/* Asynchronous vfs , the loads are queued and finished by the test */
+struct vm_async_vfs {
+  struct ajj_load* load[16];
+  char* name[16];
+  size_t len;
+  size_t started;
+};
+
+static
+int vm_async_load( struct ajj* a , const char* name ,
+    struct ajj_load* l , void* udata ) {
+  struct vm_async_vfs* v = (struct vm_async_vfs*)udata;
+  UNUSE_ARG(a);
+  assert(v->len < ARRAY_SIZE(v->load));
+  assert(ajj_load_get_udata(l) == (void*)v);
+  v->load[v->len] = l;
+  v->name[v->len] = strdup(name);
+  ++v->len;
+  ++v->started;
+  return 0;
+}
+
+static
+void vm_async_finish( struct ajj* a , struct ajj_load* l ,
+    const char* name ) {
+  size_t len;
+  time_t ts = 0;
+  void* src = AJJ_DEFAULT_VFS.vfs_load(a,name,&len,&ts,NULL);
+  if(src) AJJ_DEFAULT_VFS.vfs_timestamp(a,name,&ts,NULL);
+  ajj_load_finish(l,src,src ? len : 0,ts);
+}
+
+struct vm_async_job {
+  struct ajj* a;
+  struct ajj_load* load;
+  char* name;
+};
+
+static
+void* vm_async_worker( void* arg ) {
+  struct vm_async_job* job = (struct vm_async_job*)arg;
+  vm_async_finish(job->a,job->load,job->name);
+  return NULL;
+}
+
+static
+void vm_async_vfs() {
+  struct ajj_vfs vfs = AJJ_DEFAULT_VFS;
+  struct vm_async_vfs v;
+  struct ajj* a;
+  struct ajj_io* expect;
+  struct ajj_io* output;
+  struct ajj_render* r;
+  const char* c , *e;
+  size_t len , elen;
+  int ret;
+  vfs.vfs_load_async = vm_async_load;
+  v.len = v.started = 0;
+  a = ajj_create(&vfs,&v);
+  expect = ajj_io_create_mem(a,1024);
+  output = ajj_io_create_mem(a,1024);
+  assert(!ajj_add_template(a,"async.html",
+        "A{% include 'include.html' %}B{% include 'import.html' %}C"));
+
+  /* synchronous rendering still uses vfs_load */
+  if(ajj_render_file(a,expect,"async.html",NULL)) {
+    fprintf(stderr,"%s",a->err);
+    abort();
+  }
+  assert(v.started == 0);
+  ajj_clear_template(a);
+  assert(!ajj_add_template(a,"async.html",
+        "A{% include 'include.html' %}B{% include 'import.html' %}C"));
+
+  /* every uncached include parks the rendering , the loads are finished
+   * by another thread */
+  r = ajj_render_create(a,output,"async.html",&v);
+  while( (ret = ajj_render_resume(r)) == AJJ_RENDER_PENDING ) {
+    struct vm_async_job job;
+    thread_t tid;
+    /* spurious resume */
+    assert(ajj_render_resume(r) == AJJ_RENDER_PENDING);
+    assert(v.len == 1);
+    job.a = a;
+    job.load = v.load[0];
+    job.name = v.name[0];
+    v.len = 0;
+    assert(!thread_create(&tid,vm_async_worker,&job));
+    thread_join(tid);
+    free(job.name);
+  }
+  if(ret) {
+    fprintf(stderr,"%s",ajj_render_error(r));
+    abort();
+  }
+  assert(v.started == 2);
+  ajj_render_free(r);
+  e = ajj_io_get_content(expect,&elen);
+  c = ajj_io_get_content(output,&len);
+  assert(len == elen);
+  assert(memcmp(c,e,len) == 0);
+
+  /* cached now */
+  r = ajj_render_create(a,output,"async.html",&v);
+  assert(ajj_render_resume(r) == 0);
+  assert(v.started == 2);
+  ajj_render_free(r);
+
+  /* failed load */
+  r = ajj_render_create(a,output,"NotExisted.html",&v);
+  assert(ajj_render_resume(r) == AJJ_RENDER_PENDING);
+  assert(v.len == 1);
+  v.len = 0;
+  vm_async_finish(a,v.load[0],v.name[0]);
+  free(v.name[0]);
+  assert(ajj_render_resume(r) == -1);
+  assert(ajj_render_error(r) != NULL);
+  ajj_render_free(r);
+
+  /* rendering is freed while the load is in flight */
+  r = ajj_render_create(a,output,"base.html",&v);
+  assert(ajj_render_resume(r) == AJJ_RENDER_PENDING);
+  ajj_render_free(r);
+  assert(v.len == 1);
+  v.len = 0;
+  vm_async_finish(a,v.load[0],v.name[0]);
+  free(v.name[0]);
+
+  ajj_io_destroy(a,expect);
+  ajj_io_destroy(a,output);
+  ajj_destroy(a);
+}
+
+static
+void vm_budget() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj_io* output = ajj_io_create_mem(a,1024);
+  struct ajj_io* expect = ajj_io_create_mem(a,1024);
+  struct ajj_render* r;
+  const char* c , *e;
+  size_t len , elen;
+  int ret , park = 0;
+  assert(!ajj_add_template(a,"budget.html",
+        "{% for i in xrange(100) %}{{ i }}{% endfor %}"
+        "{% include 'include.html' %}"));
+  assert(!ajj_add_template(a,"forever.html",
+        "{% macro F(n) %}{% for i in xrange(1000000) %}{% endfor %}"
+        "{{ F(n) }}{% endmacro %}{{ F(1) }}"));
+  assert(!ajj_add_template(a,"spin.html",
+        "{% for i in xrange(100000000) %}{% endfor %}"));
+  assert(!ajj_render_file(a,expect,"budget.html",NULL));
+
+  /* instruction budget */
+  ajj_set_budget(a,100,0);
+  assert(ajj_render_file(a,output,"budget.html",NULL) == -1);
+  assert(strstr(a->err,"instruction budget"));
+  ajj_io_destroy(a,output);
+  output = ajj_io_create_mem(a,1024);
+
+  /* resumable rendering takes turns instead */
+  r = ajj_render_create(a,output,"budget.html",NULL);
+  while( (ret = ajj_render_resume(r)) == AJJ_RENDER_PENDING ) ++park;
+  assert(ret == 0);
+  assert(park > 2);
+  ajj_render_free(r);
+  e = ajj_io_get_content(expect,&elen);
+  c = ajj_io_get_content(output,&len);
+  assert(len == elen);
+  assert(memcmp(c,e,len) == 0);
+
+  ajj_set_budget(a,100000,0);
+  assert(!ajj_render_file(a,output,"budget.html",NULL));
+  assert(ajj_render_file(a,output,"forever.html",NULL) == -1);
+  assert(strstr(a->err,"instruction budget"));
+
+  /* time budget */
+  ajj_set_budget(a,0,10);
+  assert(ajj_render_file(a,output,"spin.html",NULL) == -1);
+  assert(strstr(a->err,"time budget"));
+  assert(!ajj_render_file(a,output,"budget.html",NULL));
+
+  ajj_io_destroy(a,output);
+  ajj_io_destroy(a,expect);
+  ajj_destroy(a);
+}
+
+static
+int vm_context_whoami( struct ajj* a , void* udata ,
+    struct ajj_value* arg , size_t arg_len , struct ajj_value* ret ) {
+  struct ajj_context* ctx = ajj_get_context(a);
+  UNUSE_ARG(udata);
+  UNUSE_ARG(arg);
+  UNUSE_ARG(arg_len);
+  assert(ctx != NULL);
+  assert(ajj_context_get_engine(ctx) == a);
+  assert(ajj_context_get_udata(ctx) == ajj_runtime_get_udata(a));
+  *ret = ajj_value_number(*(int*)ajj_context_get_udata(ctx));
+  return AJJ_EXEC_OK;
+}
+
+/* Render another template from inside of a host function */
+static
+int vm_context_nested( struct ajj* a , void* udata ,
+    struct ajj_value* arg , size_t arg_len , struct ajj_value* ret ) {
+  struct ajj_context* ctx = ajj_get_context(a);
+  struct ajj_io* output = ajj_io_create_mem(a,64);
+  int inner = 2;
+  int r;
+  const char* c;
+  size_t len;
+  UNUSE_ARG(udata);
+  UNUSE_ARG(arg);
+  UNUSE_ARG(arg_len);
+  r = ajj_render_file(a,output,"inner.html",&inner);
+  assert(ajj_get_context(a) == ctx);
+  if(r) {
+    /* error of the nested rendering is handed over to the caller */
+    assert(strstr(ajj_context_last_error(ctx),"NotExisted"));
+    ajj_io_destroy(a,output);
+    ajj_context_error(ctx,"nested rendering fails");
+    return AJJ_EXEC_FAIL;
+  }
+  c = ajj_io_get_content(output,&len);
+  assert(len == 1 && c[0] == '2');
+  ajj_io_destroy(a,output);
+  *ret = ajj_value_number(*(int*)ajj_runtime_get_udata(a));
+  return AJJ_EXEC_OK;
+}
+
+static
+void vm_context() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj_io* output = ajj_io_create_mem(a,64);
+  int outer = 1;
+  const char* c;
+  size_t len;
+  ajj_env_add_function(a,"whoami",vm_context_whoami,NULL);
+  ajj_env_add_function(a,"nested",vm_context_nested,NULL);
+  assert(ajj_get_context(a) == NULL);
+  assert(!ajj_add_template(a,"inner.html","{{ whoami() }}"));
+  assert(!ajj_add_template(a,"outer.html",
+        "{{ whoami() }}{{ nested() }}{{ whoami() }}"));
+  if(ajj_render_file(a,output,"outer.html",&outer)) {
+    fprintf(stderr,"%s",ajj_last_error(a));
+    abort();
+  }
+  c = ajj_io_get_content(output,&len);
+  assert(len == 3 && memcmp(c,"111",3) == 0);
+  assert(ajj_get_context(a) == NULL);
+
+  assert(!ajj_add_template(a,"inner.html","{{ NotExisted() }}"));
+  assert(ajj_render_file(a,output,"outer.html",&outer) == -1);
+  assert(strstr(ajj_last_error(a),"nested rendering fails"));
+
+  ajj_io_destroy(a,output);
+  ajj_destroy(a);
+}
+
+static
+void vm_env_snapshot_expect( struct ajj* a , const char* file ,
+    const char* expect ) {
+  struct ajj_io* output = ajj_io_create_mem(a,64);
+  const char* c;
+  size_t len;
+  if(ajj_render_file(a,output,file,NULL)) {
+    fprintf(stderr,"%s",ajj_last_error(a));
+    abort();
+  }
+  c = ajj_io_get_content(output,&len);
+  assert(len == strlen(expect));
+  assert(memcmp(c,expect,len) == 0);
+  ajj_io_destroy(a,output);
+}
+
+static
+int vm_env_snapshot_wait( struct ajj* a , void* udata ,
+    struct ajj_value* arg , size_t arg_len , struct ajj_value* ret ) {
+  UNUSE_ARG(udata);
+  UNUSE_ARG(arg);
+  UNUSE_ARG(arg_len);
+  if(ajj_suspend(a)) return AJJ_EXEC_FAIL;
+  *ret = ajj_value_number(0);
+  return AJJ_EXEC_OK;
+}
+
+static
+void* vm_env_snapshot_worker( void* arg ) {
+  struct ajj* a = (struct ajj*)arg;
+  struct ajj_io* output = ajj_io_create_mem(a,64);
+  const char* c;
+  size_t len;
+  int i;
+  for( i = 0 ; i < 64 ; ++i ) {
+    if(ajj_render_file(a,output,"snap-x.html",NULL)) {
+      fprintf(stderr,"%s",ajj_last_error(a));
+      abort();
+    }
+    /* the value is read twice , both must come from one snapshot */
+    c = ajj_io_get_content(output,&len);
+    assert(len >= 3 && c[len-1] == c[len-3] && c[len-2] == ',');
+  }
+  ajj_io_destroy(a,output);
+  return NULL;
+}
+
+static
+void vm_env_snapshot() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj* f[4];
+  thread_t th[4];
+  struct ajj_io* output = ajj_io_create_mem(a,64);
+  struct ajj_render* r;
+  const char* c;
+  size_t len;
+  size_t i;
+  int j;
+  ajj_env_add_value(a,"x",AJJ_VALUE_NUMBER,1.0);
+  ajj_env_add_function(a,"wait",vm_env_snapshot_wait,NULL);
+  assert(!ajj_add_template(a,"snap.html","{{ x }}{{ wait() }}{{ x }}"));
+  assert(!ajj_add_template(a,"snap-x.html","{{ x }},{{ x }}"));
+
+  /* a suspended rendering keeps its snapshot while the env changes */
+  r = ajj_render_create(a,output,"snap.html",NULL);
+  assert(ajj_render_resume(r) == AJJ_RENDER_PENDING);
+  ajj_env_add_value(a,"x",AJJ_VALUE_NUMBER,2.0);
+  vm_env_snapshot_expect(a,"snap-x.html","2,2");
+  assert(ajj_render_resume(r) == 0);
+  ajj_render_free(r);
+  c = ajj_io_get_content(output,&len);
+  assert(len == 3 && memcmp(c,"101",3) == 0);
+  ajj_io_destroy(a,output);
+
+  /* deleting and clearing */
+  output = ajj_io_create_mem(a,64);
+  r = ajj_render_create(a,output,"snap.html",NULL);
+  assert(ajj_render_resume(r) == AJJ_RENDER_PENDING);
+  assert(!ajj_env_del(a,"x"));
+  assert(!ajj_env_has(a,"x"));
+  assert(ajj_env_del(a,"x"));
+  ajj_env_clear(a);
+  assert(!ajj_env_has(a,"wait"));
+  assert(ajj_render_resume(r) == 0);
+  ajj_render_free(r);
+  c = ajj_io_get_content(output,&len);
+  assert(len == 3 && memcmp(c,"202",3) == 0);
+  ajj_io_destroy(a,output);
+  ajj_env_add_value(a,"x",AJJ_VALUE_NUMBER,3.0);
+  assert(ajj_env_has(a,"x"));
+  vm_env_snapshot_expect(a,"snap-x.html","3,3");
+
+  /* a fork sees the parent's changes and can shadow them */
+  f[0] = ajj_fork(a);
+  vm_env_snapshot_expect(f[0],"snap-x.html","3,3");
+  ajj_env_add_value(a,"x",AJJ_VALUE_NUMBER,4.0);
+  vm_env_snapshot_expect(f[0],"snap-x.html","4,4");
+  ajj_env_add_value(f[0],"x",AJJ_VALUE_NUMBER,5.0);
+  vm_env_snapshot_expect(f[0],"snap-x.html","5,5");
+  vm_env_snapshot_expect(a,"snap-x.html","4,4");
+  assert(!ajj_env_del(f[0],"x"));
+  vm_env_snapshot_expect(f[0],"snap-x.html","4,4");
+
+  /* changes are published as deltas stacked on a few layers */
+  for( j = 0 ; j < 1000 ; ++j ) {
+    char name[16];
+    sprintf(name,"n%d",j);
+    ajj_env_add_value(f[0],name,AJJ_VALUE_NUMBER,(double)j);
+    assert(f[0]->env_layer->depth <= 12);
+  }
+  assert(f[0]->env_layer->depth > 1);
+  assert(!ajj_add_template(a,"snap-n.html","{{ n7 }},{{ n999 }},{{ x }}"));
+  vm_env_snapshot_expect(f[0],"snap-n.html","7,999,4");
+  ajj_env_add_value(f[0],"n7",AJJ_VALUE_NUMBER,8.0);
+  ajj_env_add_value(a,"x",AJJ_VALUE_NUMBER,6.0);
+  vm_env_snapshot_expect(f[0],"snap-n.html","8,999,6");
+  /* a name removed for good makes a full copy */
+  assert(!ajj_env_del(f[0],"n999"));
+  assert(f[0]->env_layer->depth == 1);
+  assert(!ajj_env_has(f[0],"n999"));
+  assert(ajj_env_has(f[0],"n998"));
+  vm_env_snapshot_expect(f[0],"snap-x.html","6,6");
+  ajj_destroy(f[0]);
+
+  /* the parent keeps changing the env while the forks are rendering */
+  for( i = 0 ; i < ARRAY_SIZE(f) ; ++i ) {
+    f[i] = ajj_fork(a);
+    assert(!thread_create(th+i,vm_env_snapshot_worker,f[i]));
+  }
+  for( j = 0 ; j < 256 ; ++j ) {
+    ajj_env_add_value(a,"x",AJJ_VALUE_NUMBER,(double)(j % 10));
+    if( j % 16 == 0 ) assert(!ajj_env_del(a,"x"));
+    ajj_env_add_value(a,"x",AJJ_VALUE_NUMBER,(double)(j % 10));
+  }
+  for( i = 0 ; i < ARRAY_SIZE(f) ; ++i ) {
+    thread_join(th[i]);
+    ajj_destroy(f[i]);
+  }
+  ajj_destroy(a);
+}
+
+static
+int vm_env_overwrite_one( struct ajj* a , void* udata ,
+    struct ajj_value* arg , size_t arg_len , struct ajj_value* ret ) {
+  UNUSE_ARG(a);
+  UNUSE_ARG(arg);
+  UNUSE_ARG(arg_len);
+  /* tests must return a boolean */
+  *ret = udata ? AJJ_TRUE : ajj_value_number(1);
+  return AJJ_EXEC_OK;
+}
+
+static
+int vm_env_overwrite_fail( struct ajj* a , void* udata ,
+    struct ajj_value* arg , size_t arg_len , struct ajj_value* ret ) {
+  UNUSE_ARG(udata);
+  UNUSE_ARG(arg);
+  UNUSE_ARG(arg_len);
+  UNUSE_ARG(ret);
+  ajj_error(a,"overwritten");
+  return AJJ_EXEC_FAIL;
+}
+
+static
+void vm_env_overwrite() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj_io* output = ajj_io_create_mem(a,64);
+  /* the name of the function is read by the traceback */
+  ajj_env_add_function(a,"twice",vm_env_overwrite_one,NULL);
+  ajj_env_add_function(a,"twice",vm_env_overwrite_fail,NULL);
+  ajj_env_add_test(a,"twice_test",vm_env_overwrite_fail,NULL);
+  ajj_env_add_test(a,"twice_test",vm_env_overwrite_one,a);
+  assert(!ajj_add_template(a,"twice.html","{{ twice() }}"));
+  assert(!ajj_add_template(a,"twice-test.html",
+        "{% if 1 is twice_test %}{{ 1 }}{% endif %}"));
+  assert(ajj_render_file(a,output,"twice.html",NULL) == -1);
+  assert(strstr(ajj_last_error(a),"overwritten"));
+  assert(strstr(ajj_last_error(a),":twice "));
+  ajj_env_add_function(a,"twice",vm_env_overwrite_one,NULL);
+  ajj_io_destroy(a,output);
+  vm_env_snapshot_expect(a,"twice.html","1");
+  vm_env_snapshot_expect(a,"twice-test.html","1");
+  ajj_destroy(a);
+}
+
+struct vm_io_model {
+  char buf[4096];
+  size_t len;
+  size_t limit; /* writes fail once the output exceeds it */
+  int flush;
+  int reserved;
+};
+
+static
+int vm_io_model_write( void* udata , const void* mem , size_t len ) {
+  struct vm_io_model* m = (struct vm_io_model*)udata;
+  if( m->len + len > m->limit ) return -1;
+  memcpy(m->buf+m->len,mem,len);
+  m->len += len;
+  return 0;
+}
+
+static
+int vm_io_model_flush( void* udata ) {
+  struct vm_io_model* m = (struct vm_io_model*)udata;
+  ++m->flush;
+  return 0;
+}
+
+static
+void* vm_io_model_reserve( void* udata , size_t len , size_t* cap ) {
+  struct vm_io_model* m = (struct vm_io_model*)udata;
+  if( m->len + len > m->limit ) return NULL;
+  *cap = m->limit - m->len;
+  m->reserved = 1;
+  return m->buf + m->len;
+}
+
+static
+int vm_io_model_commit( void* udata , size_t len ) {
+  struct vm_io_model* m = (struct vm_io_model*)udata;
+  assert(m->reserved);
+  m->reserved = 0;
+  m->len += len;
+  return 0;
+}
+
+static
+void vm_io_sink() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj_io_sink sink = { vm_io_model_write , NULL ,
+    vm_io_model_flush , NULL , NULL };
+  struct vm_io_model m;
+  struct ajj_io* output;
+  struct ajj_iovec iov[3];
+  char large[1024];
+  memset(large,'x',sizeof(large)-1);
+  large[sizeof(large)-1] = 0;
+
+  /* plain sink */
+  m.len = 0; m.limit = sizeof(m.buf); m.flush = 0; m.reserved = 0;
+  output = ajj_io_create_sink(a,&sink,&m);
+  iov[0].base = "Hello"; iov[0].len = 5;
+  iov[1].base = " "; iov[1].len = 1;
+  iov[2].base = "World"; iov[2].len = 5;
+  assert(ajj_io_writev(output,iov,3) == 11);
+  assert(ajj_io_printf(output,"%d",42) == 2);
+  assert(ajj_io_printf(output,"%s",large) == (int)strlen(large));
+  assert(!ajj_io_flush(output));
+  assert(m.flush == 1);
+  assert(m.len == 13 + strlen(large));
+  assert(memcmp(m.buf,"Hello World42",13) == 0);
+  assert(memcmp(m.buf+13,large,strlen(large)) == 0);
+  ajj_io_destroy(a,output);
+
+  /* formatted output goes into the reserved region */
+  sink.sink_reserve = vm_io_model_reserve;
+  sink.sink_commit = vm_io_model_commit;
+  m.len = 0;
+  output = ajj_io_create_sink(a,&sink,&m);
+  assert(ajj_io_printf(output,"%d-%s",1,"a") == 3);
+  assert(ajj_io_printf(output,"%s",large) == (int)strlen(large));
+  assert(!m.reserved);
+  assert(m.len == 3 + strlen(large));
+  assert(memcmp(m.buf,"1-a",3) == 0);
+  m.len = 0;
+  if(ajj_render_data(a,output,"{% for i in [1,2,3] %}{{ i }},{% endfor %}",
+        "sink.html",NULL)) {
+    fprintf(stderr,"%s",ajj_last_error(a));
+    abort();
+  }
+  assert(m.len == 6 && memcmp(m.buf,"1,2,3,",6) == 0);
+  ajj_io_destroy(a,output);
+
+  /* a failed write fails the rendering and the IO stays failed */
+  m.len = 0; m.limit = 4;
+  output = ajj_io_create_sink(a,&sink,&m);
+  assert(ajj_render_data(a,output,
+        "{% for i in [1,2,3] %}{{ i }},{% endfor %}","sink.html",NULL) == -1);
+  assert(strstr(ajj_last_error(a),"Cannot write to the output"));
+  assert(ajj_io_write(output,"a",1) == -1);
+  assert(ajj_io_flush(output) == -1);
+  ajj_io_destroy(a,output);
+  ajj_destroy(a);
+}
+
+struct vm_gather_model {
+  struct vm_io_model m;
+  struct ajj_io* output;
+  int writev;
+  int ref; /* chunks that are not in the scratch buffer */
+};
+
+static
+int vm_gather_model_writev( void* udata , const struct ajj_iovec* iov ,
+    size_t len ) {
+  struct vm_gather_model* g = (struct vm_gather_model*)udata;
+  const char* scratch = g->output->gather->scratch;
+  size_t i;
+  ++g->writev;
+  for( i = 0 ; i < len ; ++i ) {
+    const char* base = (const char*)iov[i].base;
+    if( base < scratch || base >= scratch + g->output->gather->cap )
+      ++g->ref;
+    if(vm_io_model_write(&(g->m),base,iov[i].len)) return -1;
+  }
+  return 0;
+}
+
+static
+int vm_gather_model_write( void* udata , const void* mem , size_t len ) {
+  return vm_io_model_write(udata,mem,len);
+}
+
+static
+void vm_io_gather() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj_io_sink sink = { vm_gather_model_write , vm_gather_model_writev ,
+    NULL , NULL , NULL };
+  struct vm_gather_model g;
+  struct ajj_io* mem = ajj_io_create_mem(a,64);
+  const char* expect;
+  char large[64];
+  memset(large,'x',sizeof(large)-1);
+  large[sizeof(large)-1] = 0;
+  assert(ajj_io_set_gather(mem,1024) == -1);
+  ajj_io_destroy(a,mem);
+
+  g.m.len = 0; g.m.limit = sizeof(g.m.buf); g.m.flush = 0;
+  g.writev = 0; g.ref = 0;
+  g.output = ajj_io_create_sink(a,&sink,&g);
+  assert(!ajj_io_set_gather(g.output,32));
+  ajj_env_add_value(a,"large",AJJ_VALUE_STRING,large,strlen(large));
+  assert(!ajj_add_template(a,"gather.html",
+        "<html><body>{% for i in [1,2,3] %}<p>{{ i }}</p>{% endfor %}"
+        "{{ true }}</body></html>"));
+  if(ajj_render_file(a,g.output,"gather.html",NULL)) {
+    fprintf(stderr,"%s",ajj_last_error(a));
+    abort();
+  }
+  /* everything is handed over to the sink once the rendering is done */
+  expect = "<html><body><p>1</p><p>2</p><p>3</p>True</body></html>";
+  assert(g.m.len == strlen(expect));
+  assert(memcmp(g.m.buf,expect,g.m.len) == 0);
+  assert(g.writev == 1);
+  assert(g.ref >= 8);
+
+  /* chunk list overflows and large dynamic output */
+  g.m.len = 0; g.writev = 0;
+  assert(!ajj_add_template(a,"gather.html",
+        "{% for j in [0,1,2,3,4,5,6,7,8,9] %}"
+        "{% for i in [0,1,2,3,4,5,6,7,8,9] %}<{{ i }}>{% endfor %}"
+        "{% endfor %}{{ large }}"));
+  if(ajj_render_file(a,g.output,"gather.html",NULL)) {
+    fprintf(stderr,"%s",ajj_last_error(a));
+    abort();
+  }
+  assert(g.m.len == 300 + strlen(large));
+  assert(memcmp(g.m.buf,"<0><1>",6) == 0);
+  assert(memcmp(g.m.buf+300,large,strlen(large)) == 0);
+  assert(g.writev > 2);
+
+  /* other output keeps the order */
+  g.m.len = 0;
+  assert(ajj_io_write(g.output,"a",1) == 1);
+  assert(ajj_io_printf(g.output,"%d",2) == 1);
+  assert(ajj_io_write(g.output,"c",1) == 1);
+  assert(!ajj_io_flush(g.output));
+  assert(g.m.len == 3 && memcmp(g.m.buf,"a2c",3) == 0);
+  ajj_io_destroy(a,g.output);
+  ajj_destroy(a);
+}
+
+/* Read whatever is in the pipe without blocking */
+static
+size_t vm_io_fd_drain( int fd , char* buf , size_t cap ) {
+  size_t len = 0;
+  ssize_t ret;
+  while( len < cap && (ret = read(fd,buf+len,cap-len)) > 0 )
+    len += (size_t)ret;
+  return len;
+}
+
+static
+void vm_io_fd() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj_io* output;
+  int fd[2];
+  char buf[4096];
+  char large[512];
+  const char* expect;
+  size_t len;
+  memset(large,'x',sizeof(large)-1);
+  large[sizeof(large)-1] = 0;
+  assert(!pipe(fd));
+  assert(!fcntl(fd[0],F_SETFL,fcntl(fd[0],F_GETFL) | O_NONBLOCK));
+  assert(!ajj_add_template(a,"fd.html",
+        "<ul>{% for i in [1,2,3,4,5,6,7,8,9] %}<li>{{ i }}</li>{% endfor %}"
+        "</ul>"));
+  expect = "<ul><li>1</li><li>2</li><li>3</li><li>4</li><li>5</li>"
+    "<li>6</li><li>7</li><li>8</li><li>9</li></ul>";
+
+  /* nothing leaves before the buffer is full or flushed */
+  output = ajj_io_create_fd(a,fd[1],0,0);
+  if(ajj_render_file(a,output,"fd.html",NULL)) {
+    fprintf(stderr,"%s",ajj_last_error(a));
+    abort();
+  }
+  assert(vm_io_fd_drain(fd[0],buf,sizeof(buf)) == 0);
+  assert(!ajj_io_flush(output));
+  len = vm_io_fd_drain(fd[0],buf,sizeof(buf));
+  assert(len == strlen(expect) && memcmp(buf,expect,len) == 0);
+
+  /* destroying writes out the rest */
+  assert(ajj_io_printf(output,"%d",42) == 2);
+  ajj_io_destroy(a,output);
+  assert(vm_io_fd_drain(fd[0],buf,sizeof(buf)) == 2);
+
+  /* small buffer with a high water mark streams while rendering */
+  output = ajj_io_create_fd(a,fd[1],64,16);
+  assert(!ajj_io_set_gather(output,32));
+  if(ajj_render_file(a,output,"fd.html",NULL)) {
+    fprintf(stderr,"%s",ajj_last_error(a));
+    abort();
+  }
+  assert(ajj_io_printf(output,"%s",large) == (int)strlen(large));
+  assert(ajj_io_write(output,large,strlen(large)) == (int)strlen(large));
+  len = vm_io_fd_drain(fd[0],buf,sizeof(buf));
+  assert(len + 16 > strlen(expect) + 2*strlen(large));
+  assert(!ajj_io_flush(output));
+  len += vm_io_fd_drain(fd[0],buf+len,sizeof(buf)-len);
+  assert(len == strlen(expect) + 2*strlen(large));
+  assert(memcmp(buf,expect,strlen(expect)) == 0);
+  assert(memcmp(buf+strlen(expect),large,strlen(large)) == 0);
+  assert(memcmp(buf+strlen(expect)+strlen(large),large,strlen(large)) == 0);
+  ajj_io_destroy(a,output);
+
+  /* write failure fails the rendering */
+  output = ajj_io_create_fd(a,-1,16,0);
+  assert(ajj_render_file(a,output,"fd.html",NULL) == -1);
+  assert(strstr(ajj_last_error(a),"Cannot write to the output"));
+  ajj_io_destroy(a,output);
+
+  close(fd[0]);
+  close(fd[1]);
+  ajj_destroy(a);
+}
+
+static
+void vm_io_stream() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj* f;
+  struct vm_stream_model m;
+  struct ajj_io* output;
+  struct ajj_render* r;
+  const char* expect;
+  size_t i;
+  int park = 0;
+  int ret;
+  memset(&m,0,sizeof(m));
+  assert(!ajj_add_template(a,"stream.html",
+        "<head>title</head>{% flush %}"
+        "<body>{% for i in [1,2,3,4,5] %}<p>{{ i }}</p>{% endfor %}</body>"));
+  expect = "<head>title</head><body><p>1</p><p>2</p><p>3</p><p>4</p>"
+    "<p>5</p></body>";
+
+  /* fixed size chunks , {% flush %} sends the head right away */
+  output = ajj_io_create_stream(a,8,vm_stream_consume,&m);
+  if(ajj_render_file(a,output,"stream.html",NULL)) {
+    fprintf(stderr,"%s",ajj_last_error(a));
+    abort();
+  }
+  assert(m.cnt >= 3);
+  assert(m.chunk[0] == 8 && m.chunk[1] == 8 && m.chunk[2] == 2);
+  for( i = 3 ; i < m.cnt ; ++i ) assert(m.chunk[i] == 8);
+  assert(m.len < strlen(expect));
+  assert(!ajj_io_flush(output));
+  assert(m.len == strlen(expect));
+  assert(memcmp(m.buf,expect,m.len) == 0);
+
+  /* consumer pushing back suspends a resumable rendering */
+  memset(&m,0,sizeof(m));
+  m.busy = 1;
+  r = ajj_render_create(a,output,"stream.html",NULL);
+  while( (ret = ajj_render_resume(r)) == AJJ_RENDER_PENDING ) ++park;
+  assert(ret == 0);
+  assert(park >= 3);
+  ajj_render_free(r);
+  while( (ret = ajj_io_flush(output)) == AJJ_IO_BUSY ) ;
+  assert(ret == 0);
+  assert(m.len == strlen(expect));
+  assert(memcmp(m.buf,expect,m.len) == 0);
+  for( i = 0 ; i < m.cnt ; ++i ) assert(m.chunk[i] <= 8);
+
+  /* the rendering suspended is the one writing , not one of the engine
+   * that created the stream */
+  memset(&m,0,sizeof(m));
+  m.busy = 1;
+  f = ajj_fork(a);
+  r = ajj_render_create(f,output,"stream.html",NULL);
+  park = 0;
+  while( (ret = ajj_render_resume(r)) == AJJ_RENDER_PENDING ) ++park;
+  assert(ret == 0);
+  assert(park >= 3);
+  ajj_render_free(r);
+  ajj_destroy(f);
+  while( (ret = ajj_io_flush(output)) == AJJ_IO_BUSY ) ;
+  assert(ret == 0);
+  assert(m.len == strlen(expect));
+  assert(memcmp(m.buf,expect,m.len) == 0);
+
+  /* otherwise the output is kept until the consumer takes it , still
+   * in chunks of the given size */
+  memset(&m,0,sizeof(m));
+  m.busy = 1;
+  if(ajj_render_file(a,output,"stream.html",NULL)) {
+    fprintf(stderr,"%s",ajj_last_error(a));
+    abort();
+  }
+  assert(m.cnt > 0);
+  while( (ret = ajj_io_flush(output)) == AJJ_IO_BUSY ) ;
+  assert(ret == 0);
+  assert(m.len == strlen(expect));
+  assert(memcmp(m.buf,expect,m.len) == 0);
+  for( i = 0 ; i < m.cnt ; ++i ) assert(m.chunk[i] <= 8);
+  ajj_io_destroy(a,output);
+  ajj_destroy(a);
+}
+
+static
+void vm_output_predict() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj_io* output = ajj_io_create_mem(a,4096);
+  struct ajj_object* jj;
+  size_t len;
+  int i;
+  /* explicit capacity is honoured */
+  assert(output->out.m.cap == 4096);
+  ajj_io_destroy(a,output);
+
+  assert(!ajj_add_template(a,"predict.html",
+        "{% for i in [1,2,3,4,5,6,7,8,9,10] %}"
+        "<tr><td>{{ i }}</td><td>Some cell of the report</td></tr>"
+        "{% endfor %}"));
+  for( i = 0 ; i < 3 ; ++i ) {
+    output = ajj_io_create_mem(a,0);
+    if(ajj_render_file(a,output,"predict.html",NULL)) {
+      fprintf(stderr,"%s",ajj_last_error(a));
+      abort();
+    }
+    ajj_io_get_content(output,&len);
+    jj = ajj_find_template(a,"predict.html")->tmpl;
+    assert(jj_file_of(jj)->out_avg == len);
+    /* reserved from the first rendering , so it never grows */
+    if(i > 0) assert(output->out.m.cap == len + (len >> 3) + 1);
+    ajj_io_destroy(a,output);
+  }
+  ajj_destroy(a);
+}
+
+static
+void vm_number_format_expect( double val , const char* expect ) {
+  char buf[DTOC_BUF_SIZE];
+  size_t len = dtoc_buf(val,buf);
+  if( len != strlen(expect) || strcmp(buf,expect) ) {
+    fprintf(stderr,"Expect %s but get %s\n",expect,buf);
+    abort();
+  }
+  /* must read back as the same number */
+  assert( strtod(buf,NULL) == val );
+}
+
+static
+void vm_number_format() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj_io* output = ajj_io_create_mem(a,0);
+  const char* str;
+  size_t len;
+  uint64_t x = 1;
+  int i;
+  vm_number_format_expect(0,"0");
+  vm_number_format_expect(-0.0,"0");
+  vm_number_format_expect(7,"7");
+  vm_number_format_expect(-42,"-42");
+  vm_number_format_expect(1234567890,"1234567890");
+  vm_number_format_expect(3000000000.0,"3000000000");
+  vm_number_format_expect(999999999999999.0,"999999999999999");
+  vm_number_format_expect(1.5,"1.5");
+  vm_number_format_expect(-2.25,"-2.25");
+  vm_number_format_expect(0.1,"0.1");
+  vm_number_format_expect(0.05,"0.05");
+  vm_number_format_expect(0.0001,"0.0001");
+  vm_number_format_expect(123.456,"123.456");
+  vm_number_format_expect(0.1+0.2,"0.30000000000000004");
+  vm_number_format_expect(1.0/3,"0.3333333333333333");
+  vm_number_format_expect(0.00001,"1e-05");
+  vm_number_format_expect(1e300,"1e+300");
+  vm_number_format_expect(-1e300,"-1e+300");
+  vm_number_format_expect(1e15,"1e+15");
+  vm_number_format_expect(1234567890123456.0,"1234567890123456");
+  vm_number_format_expect(123456789012345678.0,"1.2345678901234568e+17");
+  vm_number_format_expect(1.7976931348623157e308,"1.7976931348623157e+308");
+  vm_number_format_expect(2.2250738585072014e-308,"2.2250738585072014e-308");
+  vm_number_format_expect(5e-324,"5e-324");
+  vm_number_format_expect(9007199254740993.0,"9007199254740992");
+  vm_number_format_expect(0.000123456789,"0.000123456789");
+  vm_number_format_expect(1.0/81,"0.012345679012345678");
+  vm_number_format_expect(HUGE_VAL,"inf");
+  vm_number_format_expect(-HUGE_VAL,"-inf");
+  /* same as the shortest precision of printf that round trips */
+  for( i = 0 ; i < 100000 ; ++i ) {
+    char buf[DTOC_BUF_SIZE] , expect[DTOC_BUF_SIZE];
+    double val;
+    int prec;
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    memcpy(&val,&x,sizeof(val));
+    if( val != val || val == HUGE_VAL || val == -HUGE_VAL ) continue;
+    for( prec = 15 ; prec < 17 ; ++prec ) {
+      sprintf(expect,"%.*g",prec,val);
+      if( strtod(expect,NULL) == val ) break;
+    }
+    if( prec == 17 ) sprintf(expect,"%.17g",val);
+    dtoc_buf(val,buf);
+    if(strcmp(buf,expect)) {
+      fprintf(stderr,"Expect %s but get %s\n",expect,buf);
+      abort();
+    }
+  }
+
+  assert(!ajj_add_template(a,"number.html",
+        "{{ 1 }}|{{ 0.5 }}|{{ -3 }}|{{ 1.25 ~ 2 }}"));
+  if(ajj_render_file(a,output,"number.html",NULL)) {
+    fprintf(stderr,"%s",ajj_last_error(a));
+    abort();
+  }
+  str = ajj_io_get_content(output,&len);
+  assert(len == strlen("1|0.5|-3|1.252"));
+  assert(memcmp(str,"1|0.5|-3|1.252",len) == 0);
+  ajj_io_destroy(a,output);
+  ajj_destroy(a);
+}
+
+static
+int vm_display_io_ctor( struct ajj* a , void* udata ,
+    struct ajj_value* arg , size_t arg_len , void** ret , int* tp ) {
+  double* pt = malloc(sizeof(double)*2);
+  UNUSE_ARG(a);
+  UNUSE_ARG(udata);
+  assert(arg_len == 2);
+  pt[0] = ajj_value_to_number(arg);
+  pt[1] = ajj_value_to_number(arg+1);
+  *ret = pt;
+  *tp = AJJ_USER_DEFINE_EXTENSION + 1;
+  return AJJ_EXEC_OK;
+}
+
+static
+void vm_display_io_dtor( struct ajj* a , void* udata , void* obj ) {
+  UNUSE_ARG(a);
+  UNUSE_ARG(udata);
+  free(obj);
+}
+
+static
+int vm_display_io_point( struct ajj* a , const struct ajj_value* val ,
+    struct ajj_io* output ) {
+  double* pt = (double*)(val->value.object->val.obj.data);
+  UNUSE_ARG(a);
+  return ajj_io_printf(output,"(%d,%d)",(int)pt[0],(int)pt[1]) < 0 ?
+    -1 : 0;
+}
+
+static
+void vm_display_io() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj_io* output = ajj_io_create_mem(a,0);
+  struct ajj_class cls;
+  const char* expect = "(1,2)|(3,4)!|1 a True 0.5|k=(5,6)|xrange(3)";
+  const char* str;
+  size_t len;
+
+  memset(&cls,0,sizeof(cls));
+  cls.name = "Point";
+  cls.ctor = vm_display_io_ctor;
+  cls.dtor = vm_display_io_dtor;
+  cls.slot.display_io = vm_display_io_point;
+  ajj_env_add_class(a,&cls);
+
+  /* print streams , ~ goes through the string built by ajj_display */
+  assert(!ajj_add_template(a,"display.html",
+        "{{ Point(1,2) }}|{{ Point(3,4) ~ '!' }}|"
+        "{{ [1,'a',True,0.5] }}|{{ {'k':Point(5,6)} }}|"
+        "{{ xrange(3) }}"));
+  if(ajj_render_file(a,output,"display.html",NULL)) {
+    fprintf(stderr,"%s",ajj_last_error(a));
+    abort();
+  }
+  str = ajj_io_get_content(output,&len);
+  assert(len == strlen(expect));
+  assert(memcmp(str,expect,len) == 0);
+  ajj_io_destroy(a,output);
+  ajj_destroy(a);
+}
+
+static
+void vm_autoescape_expect( struct ajj* a , const char* name ,
+    const char* src , const char* expect ) {
+  struct ajj_io* output = ajj_io_create_mem(a,0);
+  const char* str;
+  size_t len;
+  if(ajj_add_template(a,name,src) ||
+     ajj_render_file(a,output,name,NULL)) {
+    fprintf(stderr,"%s",ajj_last_error(a));
+    abort();
+  }
+  str = ajj_io_get_content(output,&len);
+  if( len != strlen(expect) || memcmp(str,expect,len) ) {
+    fprintf(stderr,"Expect %s but get %.*s\n",expect,(int)len,str);
+    abort();
+  }
+  ajj_io_destroy(a,output);
+}
+
+static
+void vm_autoescape() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  char buf[128];
+  size_t i , j;
+
+  /* every position inside and after the vector blocks */
+  for( i = 0 ; i < 100 ; ++i ) {
+    memset(buf,'a',i);
+    assert(html_escape_scan(buf,i) == i);
+    for( j = 0 ; j < i ; ++j ) {
+      buf[j] = "&<>\"'"[j%5];
+      assert(html_escape_scan(buf,i) == j);
+      buf[j] = 'a';
+    }
+  }
+
+  /* off by default */
+  vm_autoescape_expect(a,"off.html","<p>{{ '<b>' }}</p>","<p><b></p>");
+  vm_autoescape_expect(a,"block.html",
+      "{% autoescape true %}{{ '<b>' }}{% endautoescape %}{{ '<b>' }}",
+      "&lt;b&gt;<b>");
+
+  ajj_set_autoescape(a,AJJ_ESCAPE_HTML);
+  vm_autoescape_expect(a,"text.html","<p>{{ 'a&b' }}</p>","<p>a&amp;b</p>");
+  vm_autoescape_expect(a,"quote.html","{{ '\"\\'' }}","&#34;&#39;");
+  vm_autoescape_expect(a,"long.html",
+      "{{ 'A long string that is longer than any vector <x> & more' }}",
+      "A long string that is longer than any vector &lt;x&gt; &amp; more");
+  vm_autoescape_expect(a,"plain.html","{{ 'plain' }}|{{ 1.5 }}|{{ True }}",
+      "plain|1.5|True");
+  vm_autoescape_expect(a,"safe.html","{{ '<i>'|safe }}{{ ['<',1]|safe }}",
+      "<i>< 1");
+  vm_autoescape_expect(a,"list.html","{{ ['<',1] }}|{{ {'k':'&'} }}",
+      "&lt; 1|k=&amp;");
+  vm_autoescape_expect(a,"set.html","{% set x %}<br>{% endset %}{{ x }}",
+      "<br>");
+  vm_autoescape_expect(a,"macro.html",
+      "{% macro m(v) %}<b>{{ v }}</b>{% endmacro %}{{ m('<') }}",
+      "<b>&lt;</b>");
+  vm_autoescape_expect(a,"unblock.html",
+      "{% autoescape false %}{{ '<b>' }}{% endautoescape %}{{ '<b>' }}",
+      "<b>&lt;b&gt;");
+  /* concatenating a safe string escapes the other side once */
+  vm_autoescape_expect(a,"concat.html",
+      "{% set x = '<i>'|safe %}{{ x ~ '<' }}|{{ '&' ~ x }}|{{ x ~ 1 }}|"
+      "{{ x + '>' }}|{{ (x ~ '<') ~ '>' }}|{{ '<' ~ '>' }}",
+      "<i>&lt;|&amp;<i>|<i>1|<i>&gt;|<i>&lt;&gt;|&lt;&gt;");
+  ajj_destroy(a);
+}
+
+/* Minimal inflater for the stored and fixed Huffman blocks written by
+ * the deflate IO , returns the size of the output or -1 */
+struct vm_inflate {
+  const unsigned char* in;
+  size_t len;
+  size_t pos;
+  int bit;
+};
+
+static
+int vm_inflate_bit( struct vm_inflate* z ) {
+  int b;
+  assert( z->pos < z->len );
+  b = (z->in[z->pos] >> z->bit) & 1;
+  if( ++z->bit == 8 ) {
+    z->bit = 0;
+    ++z->pos;
+  }
+  return b;
+}
+
+static
+unsigned int vm_inflate_bits( struct vm_inflate* z , int n ) {
+  unsigned int v = 0;
+  int i;
+  for( i = 0 ; i < n ; ++i ) v |= (unsigned int)vm_inflate_bit(z) << i;
+  return v;
+}
+
+static
+int vm_inflate_sym( struct vm_inflate* z ) {
+  unsigned int code = 0;
+  int i;
+  for( i = 0 ; i < 7 ; ++i ) code = (code << 1) | vm_inflate_bit(z);
+  if( code <= 0x17 ) return 256 + code;
+  code = (code << 1) | vm_inflate_bit(z);
+  if( code >= 0x30 && code <= 0xbf ) return code - 0x30;
+  if( code >= 0xc0 && code <= 0xc7 ) return 280 + code - 0xc0;
+  code = (code << 1) | vm_inflate_bit(z);
+  assert( code >= 0x190 && code <= 0x1ff );
+  return 144 + code - 0x190;
+}
+
+static
+long vm_inflate_run( struct vm_inflate* z , unsigned char* out ,
+    size_t cap ) {
+  static const unsigned short LBASE[29] = {
+    3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,
+    35,43,51,59,67,83,99,115,131,163,195,227,258 };
+  static const unsigned char LEXTRA[29] = {
+    0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+  static const unsigned short DBASE[30] = {
+    1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,
+    1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+  static const unsigned char DEXTRA[30] = {
+    0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,
+    13,13 };
+  size_t olen = 0;
+  int final;
+  do {
+    int type;
+    final = vm_inflate_bit(z);
+    type = (int)vm_inflate_bits(z,2);
+    if( type == 0 ) {
+      size_t n;
+      if( z->bit ) { z->bit = 0; ++z->pos; }
+      n = z->in[z->pos] | (z->in[z->pos+1] << 8);
+      if( (n ^ 0xffff) != (size_t)(z->in[z->pos+2] | (z->in[z->pos+3] << 8)) )
+        return -1;
+      z->pos += 4;
+      if( olen + n > cap ) return -1;
+      memcpy(out+olen,z->in+z->pos,n);
+      olen += n;
+      z->pos += n;
+    } else if( type == 1 ) {
+      for( ;; ) {
+        int sym = vm_inflate_sym(z);
+        if( sym < 256 ) {
+          if( olen == cap ) return -1;
+          out[olen++] = (unsigned char)sym;
+        } else if( sym == 256 ) {
+          break;
+        } else {
+          size_t len , dist;
+          int d;
+          sym -= 257;
+          len = LBASE[sym] + vm_inflate_bits(z,LEXTRA[sym]);
+          d = 0;
+          for( sym = 0 ; sym < 5 ; ++sym ) d = (d << 1) | vm_inflate_bit(z);
+          dist = DBASE[d] + vm_inflate_bits(z,DEXTRA[d]);
+          if( dist > olen || olen + len > cap ) return -1;
+          for( ; len > 0 ; --len , ++olen ) out[olen] = out[olen-dist];
+        }
+      }
+    } else {
+      return -1;
+    }
+  } while(!final);
+  if( z->bit ) { z->bit = 0; ++z->pos; }
+  return (long)olen;
+}
+
+static
+uint32_t vm_crc32( const unsigned char* p , size_t len ) {
+  uint32_t c = 0xffffffffU;
+  int k;
+  while( len-- > 0 ) {
+    c ^= *p++;
+    for( k = 0 ; k < 8 ; ++k ) c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+  }
+  return c ^ 0xffffffffU;
+}
+
+static
+void vm_io_deflate() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj_io* expect = ajj_io_create_mem(a,0);
+  struct ajj_io* output = ajj_io_create_mem(a,0);
+  struct ajj_io* z;
+  struct vm_inflate inf;
+  const unsigned char* c;
+  const char* e;
+  unsigned char* buf;
+  size_t len , elen , i;
+  uint32_t a1 = 1 , a2 = 0;
+  long n;
+
+  /* large enough for the window to slide a few times */
+  assert(!ajj_add_template(a,"big.html",
+        "<ul>{% for i in xrange(40) %}{% for j in xrange(300) %}"
+        "<li class=\'item\'>{{ i }}-{{ j }}</li>"
+        "{% endfor %}{% endfor %}</ul>"));
+  assert(!ajj_render_file(a,expect,"big.html",NULL));
+  e = ajj_io_get_content(expect,&elen);
+  assert(elen > 100000);
+  buf = malloc(elen);
+
+  /* gzip */
+  assert(ajj_io_create_deflate(a,output,100) == NULL);
+  z = ajj_io_create_deflate(a,output,AJJ_DEFLATE_GZIP);
+  if(ajj_render_file(a,z,"big.html",NULL)) {
+    fprintf(stderr,"%s",ajj_last_error(a));
+    abort();
+  }
+  ajj_io_destroy(a,z);
+  c = (const unsigned char*)ajj_io_get_content(output,&len);
+  assert(len < elen/5);
+  assert(c[0] == 0x1f && c[1] == 0x8b && c[2] == 8);
+  inf.in = c; inf.len = len; inf.pos = 10; inf.bit = 0;
+  n = vm_inflate_run(&inf,buf,elen);
+  assert(n == (long)elen);
+  assert(memcmp(buf,e,elen) == 0);
+  assert(inf.pos + 8 == len);
+  assert((c[inf.pos] | (c[inf.pos+1] << 8) | (c[inf.pos+2] << 16) |
+        ((uint32_t)c[inf.pos+3] << 24)) ==
+      vm_crc32((const unsigned char*)e,elen));
+  assert((c[inf.pos+4] | (c[inf.pos+5] << 8) | (c[inf.pos+6] << 16) |
+        ((uint32_t)c[inf.pos+7] << 24)) == (uint32_t)elen);
+  ajj_io_destroy(a,output);
+
+  /* zlib */
+  output = ajj_io_create_mem(a,0);
+  z = ajj_io_create_deflate(a,output,AJJ_DEFLATE_ZLIB);
+  assert(!ajj_render_file(a,z,"big.html",NULL));
+  ajj_io_destroy(a,z);
+  c = (const unsigned char*)ajj_io_get_content(output,&len);
+  assert(((c[0] << 8) | c[1]) % 31 == 0 && (c[0] & 0xf) == 8);
+  inf.in = c; inf.len = len; inf.pos = 2; inf.bit = 0;
+  n = vm_inflate_run(&inf,buf,elen);
+  assert(n == (long)elen);
+  assert(memcmp(buf,e,elen) == 0);
+  for( i = 0 ; i < elen ; ++i ) {
+    a1 = (a1 + (unsigned char)e[i]) % 65521;
+    a2 = (a2 + a1) % 65521;
+  }
+  assert(inf.pos + 4 == len);
+  assert((((uint32_t)c[inf.pos] << 24) | (c[inf.pos+1] << 16) |
+        (c[inf.pos+2] << 8) | c[inf.pos+3]) == ((a2 << 16) | a1));
+  ajj_io_destroy(a,output);
+
+  /* {% flush %} leaves a sync point , the head can be decoded alone */
+  output = ajj_io_create_mem(a,0);
+  z = ajj_io_create_deflate(a,output,AJJ_DEFLATE_GZIP);
+  assert(!ajj_add_template(a,"sync.html",
+        "<head>title</head>{% flush %}<body>body</body>"));
+  assert(!ajj_render_file(a,z,"sync.html",NULL));
+  c = (const unsigned char*)ajj_io_get_content(output,&len);
+  assert(len > 14);
+  assert(memcmp(c+len-4,"\x00\x00\xff\xff",4) == 0);
+  ajj_io_destroy(a,z);
+  c = (const unsigned char*)ajj_io_get_content(output,&len);
+  inf.in = c; inf.len = len; inf.pos = 10; inf.bit = 0;
+  n = vm_inflate_run(&inf,buf,elen);
+  assert(n == (long)strlen("<head>title</head><body>body</body>"));
+  assert(memcmp(buf,"<head>title</head><body>body</body>",n) == 0);
+  ajj_io_destroy(a,output);
+
+  /* incompressible input goes into stored blocks and barely grows */
+  for( i = 0 ; i < elen ; ++i ) {
+    a1 = a1 * 1103515245U + 12345U;
+    buf[i] = (unsigned char)(a1 >> 16);
+  }
+  output = ajj_io_create_mem(a,0);
+  z = ajj_io_create_deflate(a,output,AJJ_DEFLATE_GZIP);
+  assert(ajj_io_write(z,buf,elen) == (int)elen);
+  ajj_io_destroy(a,z);
+  c = (const unsigned char*)ajj_io_get_content(output,&len);
+  assert(len < elen + elen/1000 + 32);
+  e = (const char*)malloc(elen);
+  memcpy((char*)e,buf,elen);
+  inf.in = c; inf.len = len; inf.pos = 10; inf.bit = 0;
+  n = vm_inflate_run(&inf,buf,elen);
+  assert(n == (long)elen);
+  assert(memcmp(buf,e,elen) == 0);
+  free((char*)e);
+  ajj_io_destroy(a,output);
+
+  free(buf);
+  ajj_io_destroy(a,expect);
+  ajj_destroy(a);
+}
+
+static
+void vm_io_tee() {
+  struct ajj* a = ajj_create(&AJJ_DEFAULT_VFS,NULL);
+  struct ajj_io* expect = ajj_io_create_mem(a,0);
+  struct ajj_io* child[3];
+  struct ajj_io* output;
+  struct ajj_io* h;
+  struct vm_stream_model m;
+  const char* e;
+  const char* c;
+  size_t elen , len , i;
+  uint64_t x , y;
+  int ret;
+
+  /* XXH64 test vectors */
+  h = ajj_io_create_hash(a);
+  assert(!ajj_io_get_hash(h,&x) && x == 0xef46db3751d8e999ULL);
+  ajj_io_write(h,"abc",3);
+  assert(!ajj_io_get_hash(h,&x) && x == 0x44bc2cf5ad770999ULL);
+  ajj_io_destroy(a,h);
+  assert(ajj_io_get_hash(expect,&x) == -1);
+
+  assert(!ajj_add_template(a,"tee.html",
+        "<ul>{% for i in xrange(100) %}<li>{{ i }}</li>{% endfor %}</ul>"));
+  assert(!ajj_render_file(a,expect,"tee.html",NULL));
+  e = ajj_io_get_content(expect,&elen);
+
+  /* the same output goes to every child , with or without gathering */
+  for( i = 0 ; i < 2 ; ++i ) {
+    child[0] = ajj_io_create_mem(a,0);
+    child[1] = ajj_io_create_mem(a,0);
+    child[2] = ajj_io_create_hash(a);
+    output = ajj_io_create_tee(a,child,3);
+    if(i) assert(!ajj_io_set_gather(output,64));
+    if(ajj_render_file(a,output,"tee.html",NULL)) {
+      fprintf(stderr,"%s",ajj_last_error(a));
+      abort();
+    }
+    ajj_io_destroy(a,output);
+    c = ajj_io_get_content(child[0],&len);
+    assert(len == elen && memcmp(c,e,len) == 0);
+    c = ajj_io_get_content(child[1],&len);
+    assert(len == elen && memcmp(c,e,len) == 0);
+    h = ajj_io_create_hash(a);
+    ajj_io_write(h,e,elen);
+    assert(!ajj_io_get_hash(h,&x));
+    assert(!ajj_io_get_hash(child[2],&y));
+    assert(x == y);
+    ajj_io_destroy(a,h);
+    ajj_io_destroy(a,child[0]);
+    ajj_io_destroy(a,child[1]);
+    ajj_io_destroy(a,child[2]);
+  }
+
+  /* a busy child makes the flush busy */
+  memset(&m,0,sizeof(m));
+  m.busy = 1;
+  child[0] = ajj_io_create_stream(a,8,vm_stream_consume,&m);
+  child[1] = ajj_io_create_mem(a,0);
+  output = ajj_io_create_tee(a,child,2);
+  assert(!ajj_add_template(a,"tee-flush.html","<p>tee</p><p>flush</p>"));
+  assert(!ajj_render_file(a,output,"tee-flush.html",NULL));
+  while( (ret = ajj_io_flush(output)) == AJJ_IO_BUSY ) ;
+  assert(ret == 0);
+  assert(m.len == strlen("<p>tee</p><p>flush</p>"));
+  assert(memcmp(m.buf,"<p>tee</p><p>flush</p>",m.len) == 0);
+  c = ajj_io_get_content(child[1],&len);
+  assert(len == m.len && memcmp(c,m.buf,len) == 0);
+  ajj_io_destroy(a,output);
+  ajj_io_destroy(a,child[0]);
+  ajj_io_destroy(a,child[1]);
+
+  ajj_io_destroy(a,expect);
+  ajj_destroy(a);
+}
+
 void vm_test_main() {
   vm_expr();
   vm_loop();
@@ -2810,6 +4998,32 @@ void vm_test_main() {
   vm_include_with_context();
   vm_include_with_json();
   vm_basic();
+  vm_cache();
+  vm_render_data();
+  vm_compile_all();
+  vm_mmap_vfs();
+  vm_bundle_vfs();
+  vm_fork();
+  vm_lookup();
+  vm_pool();
+  vm_parallel_include();
+  vm_batch();
+  vm_resume();
+  vm_async_vfs();
+  vm_budget();
+  vm_context();
+  vm_env_snapshot();
+  vm_env_overwrite();
+  vm_io_sink();
+  vm_io_gather();
+  vm_io_fd();
+  vm_io_stream();
+  vm_output_predict();
+  vm_number_format();
+  vm_display_io();
+  vm_autoescape();
+  vm_io_deflate();
+  vm_io_tee();
 }
 
 #ifndef DO_COVERAGE